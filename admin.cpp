@@ -66,6 +66,11 @@ int main(int argc, char **argv)
 		cout << "e. Update way/relation bboxes" << endl;
 		cout << "g. Upgrade/downgrade db schema" << endl;
 		cout << "h. Create/drop bbox indices" << endl;
+		cout << "i. Stream map data from dump_path (no csv files needed)" << endl;
+		cout << "j. Copy map data and create indicies in parallel" << endl;
+		cout << "k. Stream changeset metadata from changesets_import_path into empty tables" << endl;
+		cout << "l. Create/drop tag indices" << endl;
+		cout << "m. Build tag and density statistics for query estimates" << endl;
 
 		cout << endl << "q. Quit" << endl;
 
@@ -103,7 +108,8 @@ int main(int argc, char **argv)
 		if(inputStr == "3")
 		{
 			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
-			bool ok = admin->CopyMapData(verbose, config["csv_absolute_path"], errStr);
+			bool ok = admin->CopyMapData(verbose, config["csv_absolute_path"], errStr,
+				atoi(config["csv_binary_format"].c_str()) != 0);
 
 			if(ok)
 				cout << "All done!" << endl;
@@ -350,6 +356,105 @@ int main(int argc, char **argv)
 			continue;
 		}
 
+		if(inputStr == "l")
+		{
+			cout << "Create or delete (c/d)?" << endl;
+			std::string action;
+			cin >> action;
+			bool ok = true;
+
+			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
+			if(action == "c")
+				ok = admin->CreateTagIndices(verbose, errStr);
+			else if(action == "d") 
+				ok = admin->DropTagIndices(verbose, errStr);
+			admin->Commit();
+
+			if(ok)
+				cout << "All done!" << endl;
+			else
+				cout << errStr.errStr << endl;
+			continue;
+		}
+
+		if(inputStr == "i")
+		{
+			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
+			bool ok = admin->StreamMapData(verbose, config["dump_path"], errStr);
+
+			if(ok)
+				cout << "All done!" << endl;
+			else
+				cout << errStr.errStr << endl;
+			continue;
+		}
+
+		if(inputStr == "m")
+		{
+			int64_t minValueCount = 100;
+			if(config.find("stats_min_value_count") != config.end())
+				minValueCount = atol(config["stats_min_value_count"].c_str());
+			double gridSize = 1.0;
+			if(config.find("stats_grid_size") != config.end())
+				gridSize = atof(config["stats_grid_size"].c_str());
+
+			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
+			bool ok = admin->BuildTagStats(verbose, minValueCount, gridSize, errStr);
+			admin->Commit();
+
+			if(ok)
+				cout << "All done!" << endl;
+			else
+				cout << errStr.errStr << endl;
+			continue;
+		}
+
+		if(inputStr == "k")
+		{
+			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
+
+			std::vector<std::string> finaList;
+			fs::path p(config["changesets_import_path"]);
+			if(is_directory(p))
+			{
+				finaList = get_file_list(config["changesets_import_path"]);
+				sort(finaList.begin(), finaList.end());
+			}
+			else
+				finaList.push_back(config["changesets_import_path"]);
+
+			bool ok = true;
+			for(size_t i=0; i<finaList.size() && ok; i++)
+			{
+				fs::path p2(finaList[i]);
+				if(is_directory(p2)) continue;
+				ok = admin->StreamChangesetMetadata(finaList[i], verbose, errStr);
+			}
+
+			if(ok)
+				cout << "All done!" << endl;
+			else
+				cout << errStr.errStr << endl;
+			continue;
+		}
+
+		if(inputStr == "j")
+		{
+			int numConnections = 4;
+			if(config.find("admin_connections") != config.end())
+				numConnections = atoi(config["admin_connections"].c_str());
+
+			std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin();
+			bool ok = admin->ParallelCopyAndIndex(verbose, config["csv_absolute_path"], 
+				atoi(config["csv_binary_format"].c_str()) != 0, numConnections, config["maintenance_work_mem"], errStr);
+
+			if(ok)
+				cout << "All done!" << endl;
+			else
+				cout << errStr.errStr << endl;
+			continue;
+		}
+
 		if(inputStr == "q")
 		{
 			running = false;
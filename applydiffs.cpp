@@ -5,6 +5,7 @@
 #include "cppo5m/OsmData.h"
 #include "cppo5m/osmxml.h"
 #include "pgmap.h"
+#include "tileexpiry.h"
 #include <boost/program_options.hpp>
 namespace po = boost::program_options;
 
@@ -16,6 +17,8 @@ int main(int argc, char **argv)
 		("help", "produce help message")
 		("in", po::value<string>(), "path to diffs, or diff file name")
 		("verbose", po::value<int>(), "verbosity level (default is 1)")
+		("bulk", po::value<int>(), "catch up by storing the latest version of each object over this many connections (needs max_prepared_transactions)")
+		("expire", po::value<string>(), "append the z/x/y tiles changed by the diffs to this file")
 	;
 
 	po::variables_map vm;
@@ -45,14 +48,118 @@ int main(int argc, char **argv)
 	if (vm.count("verbose"))
 		inPath = vm["in"].as<string>();
 	
+	//Diffs are decoded incrementally and applied in blocks of this many objects (zero decodes each file in one step)
+	size_t maxObjects = 50000;
+	if(config.find("diffs_max_objects") != config.end())
+		maxObjects = atol(config["diffs_max_objects"].c_str());
+
+	//Number of later blocks to decode in the background while applying the current one
+	size_t prefetchBlocks = 0;
+	if(config.find("diffs_prefetch") != config.end())
+		prefetchBlocks = atol(config["diffs_prefetch"].c_str());
+	int prefetchThreads = 2;
+	if(config.find("diffs_prefetch_threads") != config.end())
+		prefetchThreads = atoi(config["diffs_prefetch_threads"].c_str());
+
+	//Commit after this many files, recording progress so an interrupted run can be resumed (zero
+	//applies everything in one transaction)
+	size_t filesPerCommit = 0;
+	if(config.find("diffs_files_per_commit") != config.end())
+		filesPerCommit = atol(config["diffs_files_per_commit"].c_str());
+
+	//Tiles touched by the diffs are appended to a file after each commit
+	string expirePath = config["expire_tiles_path"];
+	if (vm.count("expire"))
+		expirePath = vm["expire"].as<string>();
+	std::shared_ptr<class TileExpiry> expiry;
+	if(expirePath.size() > 0)
+	{
+		string zoomsStr = "12-15";
+		if(config.find("expire_zooms") != config.end())
+			zoomsStr = config["expire_zooms"];
+		vector<int> zooms;
+		string zoomErr;
+		if(!ParseZoomList(zoomsStr, zooms, zoomErr))
+		{
+			cerr << zoomErr << endl;
+			return -1;
+		}
+		int64_t maxTilesPerBbox = 65536;
+		if(config.find("expire_max_tiles_per_object") != config.end())
+			maxTilesPerBbox = atol(config["expire_max_tiles_per_object"].c_str());
+		expiry.reset(new class TileExpiry(zooms, maxTilesPerBbox));
+	}
+
 	string cstr = GeneratePgConnectionString(config);
 	
 	class PgMap pgMap(cstr, config["dbtableprefix"], config["dbtablemodifyprefix"], config["dbtablemodifyprefix"], config["dbtabletestprefix"]);
 	class PgMapError errStr;
 
 	//Apply diffs to database	
-	std::shared_ptr<class PgAdmin> admin = pgMap.GetAdmin("EXCLUSIVE");
-	bool ok = admin->ApplyDiffs(inPath, verbose, errStr);
+	std::shared_ptr<class PgAdmin> admin;
+	bool ok = false;
+	if (filesPerCommit > 0 && !vm.count("bulk"))
+	{
+		admin = pgMap.GetAdmin("EXCLUSIVE");
+		vector<string> filenames;
+		admin->ListDiffFiles(inPath, filenames);
+
+		//Skip files that were applied by an earlier run
+		int64_t start = admin->FindDiffResumeIndex(inPath, filenames, errStr);
+		if(start < 0)
+		{
+			cerr << errStr.errStr << endl;
+			admin->Abort();
+			return -2;
+		}
+		if(start > 0)
+			cout << "Resuming after " << admin->GetDiffCheckpoint() << endl;
+		admin->Abort();
+
+		for(size_t i=start; i<filenames.size(); i+=filesPerCommit)
+		{
+			vector<string> chunk(filenames.begin()+i, 
+				filenames.begin()+std::min(i+filesPerCommit, filenames.size()));
+			admin = pgMap.GetAdmin("EXCLUSIVE");
+			ok = admin->ApplyDiffFiles(inPath, chunk, maxObjects, prefetchBlocks, prefetchThreads, verbose, 
+				errStr, expiry.get());
+			if(!ok)
+			{
+				cout << errStr.errStr << endl;
+				admin->Abort();
+				return -2;
+			}
+			admin->Commit();
+
+			if(expiry)
+			{
+				string expireErr;
+				if(!expiry->WriteFile(expirePath, true, expireErr))
+					cerr << expireErr << endl;
+				expiry->Clear();
+			}
+		}
+
+		//Next ids were updated as the diffs were applied
+		cout << "All done!" << endl;
+		return 0;
+	}
+
+	if (vm.count("bulk"))
+	{
+		//Other connections write to the map tables, so the map is not locked. Edits should not
+		//be accepted while this runs.
+		admin = pgMap.GetAdmin();
+		ok = admin->ApplyDiffsBulk(inPath, verbose, vm["bulk"].as<int>(), errStr, expiry.get());
+	}
+	else
+	{
+		admin = pgMap.GetAdmin("EXCLUSIVE");
+		if(prefetchBlocks > 0)
+			ok = admin->ApplyDiffsPipelined(inPath, verbose, maxObjects, prefetchBlocks, prefetchThreads, errStr, expiry.get());
+		else
+			ok = admin->ApplyDiffs(inPath, verbose, errStr, maxObjects, expiry.get());
+	}
 
 	if(!ok)
 	{
@@ -74,6 +181,16 @@ int main(int argc, char **argv)
 	//Note that changeset, user ID counts are not updated (because this is currently very slow).
 
 	admin->Commit();
+
+	if(expiry)
+	{
+		string expireErr;
+		if(!expiry->WriteFile(expirePath, true, expireErr))
+			cerr << expireErr << endl;
+		else
+			cout << "Expired " << expiry->Count() << " tiles" << endl;
+	}
+
 	cout << "All done!" << endl;
 	return 0;
 }
@@ -0,0 +1,143 @@
+#include "changesetbbox.h"
+#include <stdexcept>
+using namespace std;
+
+ChangesetBboxAccumulator::ChangesetBboxAccumulator(int64_t flushInterval):
+	flushInterval(flushInterval),
+	nextGeneration(1)
+{
+
+}
+
+ChangesetBboxAccumulator::~ChangesetBboxAccumulator()
+{
+
+}
+
+int64_t ChangesetBboxAccumulator::GetFlushInterval()
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	return this->flushInterval;
+}
+
+void ChangesetBboxAccumulator::SetFlushInterval(int64_t seconds)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	this->flushInterval = seconds;
+}
+
+bool ChangesetBboxAccumulator::IsTracked(int64_t cid)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	return this->entries.find(cid) != this->entries.end();
+}
+
+void ChangesetBboxAccumulator::Track(int64_t cid, int64_t now)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	auto it = this->entries.find(cid);
+	if(it != this->entries.end())
+		return;
+	class Entry &entry = this->entries[cid];
+	entry.since = now;
+	entry.generation = this->nextGeneration++;
+}
+
+void ChangesetBboxAccumulator::Add(int64_t cid, const std::vector<double> &bbox, int64_t now)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	auto it = this->entries.find(cid);
+	if(it == this->entries.end())
+	{
+		class Entry &entry = this->entries[cid];
+		entry.bbox = bbox;
+		entry.since = now;
+		entry.generation = this->nextGeneration++;
+		return;
+	}
+	if(it->second.bbox.empty())
+		it->second.since = now;
+	MergeBbox(it->second.bbox, bbox);
+	it->second.generation = this->nextGeneration++;
+}
+
+void ChangesetBboxAccumulator::GetPending(int64_t cid, int64_t addedBefore,
+	std::map<int64_t, std::vector<double> > &bboxesOut,
+	std::map<int64_t, uint64_t> &generationsOut)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	if(cid != 0)
+	{
+		auto it = this->entries.find(cid);
+		if(it != this->entries.end() && !it->second.bbox.empty() && it->second.since <= addedBefore)
+		{
+			bboxesOut[cid] = it->second.bbox;
+			generationsOut[cid] = it->second.generation;
+		}
+		return;
+	}
+
+	auto it = this->entries.begin();
+	while(it != this->entries.end())
+	{
+		if(it->second.since > addedBefore)
+		{
+			it++;
+			continue;
+		}
+		if(it->second.bbox.empty())
+		{
+			//Nothing to write, so forgetting it only costs a direct update on the next upload
+			it = this->entries.erase(it);
+			continue;
+		}
+		bboxesOut[it->first] = it->second.bbox;
+		generationsOut[it->first] = it->second.generation;
+		it++;
+	}
+}
+
+void ChangesetBboxAccumulator::Written(const std::map<int64_t, uint64_t> &generations)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	for(auto it = generations.begin(); it != generations.end(); it++)
+	{
+		auto it2 = this->entries.find(it->first);
+		if(it2 != this->entries.end() && it2->second.generation == it->second)
+			this->entries.erase(it2);
+	}
+}
+
+void ChangesetBboxAccumulator::Forget(const std::set<int64_t> &cids)
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	for(auto it = cids.begin(); it != cids.end(); it++)
+		this->entries.erase(*it);
+}
+
+size_t ChangesetBboxAccumulator::CountPending()
+{
+	std::lock_guard<std::mutex> guard(this->mtx);
+	size_t count = 0;
+	for(auto it = this->entries.begin(); it != this->entries.end(); it++)
+		if(!it->second.bbox.empty())
+			count ++;
+	return count;
+}
+
+// **********************************************
+
+void MergeBbox(std::vector<double> &bbox, const std::vector<double> &other)
+{
+	if (other.size() != 4)
+		throw runtime_error("bbox should have size of 4");
+	if(bbox.size() != 4)
+	{
+		bbox = other;
+		return;
+	}
+	if(other[0] < bbox[0]) bbox[0] = other[0];
+	if(other[1] < bbox[1]) bbox[1] = other[1];
+	if(other[2] > bbox[2]) bbox[2] = other[2];
+	if(other[3] > bbox[3]) bbox[3] = other[3];
+}
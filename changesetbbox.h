@@ -0,0 +1,58 @@
+#ifndef _CHANGESET_BBOX_H
+#define _CHANGESET_BBOX_H
+
+#include <vector>
+#include <map>
+#include <set>
+#include <mutex>
+#include <cstdint>
+
+//Holds the envelopes of uploads to open changesets in memory, so the changesets row is
+//rewritten once per flush rather than once per upload. It is shared by the transactions of
+//a PgMap and is locked internally. Envelopes are only added after the upload that produced
+//them has committed. A changeset is tracked once its row has been updated directly, which
+//confirms it exists in the active table.
+class ChangesetBboxAccumulator
+{
+private:
+	class Entry
+	{
+	public:
+		std::vector<double> bbox; //Empty if nothing is waiting to be written
+		int64_t since; //When tracked, or when the oldest unwritten envelope was added
+		uint64_t generation;
+	};
+
+	int64_t flushInterval;
+	std::map<int64_t, class Entry> entries;
+	uint64_t nextGeneration;
+	std::mutex mtx;
+
+public:
+	ChangesetBboxAccumulator(int64_t flushInterval);
+	virtual ~ChangesetBboxAccumulator();
+
+	//Seconds an envelope may wait before being written. Zero or less disables accumulation.
+	int64_t GetFlushInterval();
+	void SetFlushInterval(int64_t seconds);
+
+	bool IsTracked(int64_t cid);
+	void Track(int64_t cid, int64_t now);
+	void Add(int64_t cid, const std::vector<double> &bbox, int64_t now);
+
+	//Gets the envelopes that have waited since addedBefore or earlier, for one changeset or
+	//for all if cid is zero. Getting all also drops tracked changesets with nothing to write.
+	void GetPending(int64_t cid, int64_t addedBefore,
+		std::map<int64_t, std::vector<double> > &bboxesOut,
+		std::map<int64_t, uint64_t> &generationsOut);
+	//Call after the transaction that wrote the envelopes has committed. Changesets that
+	//gained envelopes since GetPending are kept.
+	void Written(const std::map<int64_t, uint64_t> &generations);
+	void Forget(const std::set<int64_t> &cids);
+	size_t CountPending();
+};
+
+//Grows bbox (min lon, min lat, max lon, max lat) to include other. An empty bbox is replaced.
+void MergeBbox(std::vector<double> &bbox, const std::vector<double> &other);
+
+#endif //_CHANGESET_BBOX_H
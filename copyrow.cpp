@@ -0,0 +1,342 @@
+#include "copyrow.h"
+#include "dbjson.h"
+#include "util.h"
+#include <sstream>
+#include <cstring>
+using namespace std;
+
+// https://www.postgresql.org/docs/current/sql-copy.html
+
+static void PgCopyBigEndian(uint64_t val, int bytes, std::string &out)
+{
+	for(int i=bytes-1; i>=0; i--)
+		out += (char)((val >> (8*i)) & 0xff);
+}
+
+static void PgCopyLittleEndian(uint64_t val, int bytes, std::string &out)
+{
+	for(int i=0; i<bytes; i++)
+		out += (char)((val >> (8*i)) & 0xff);
+}
+
+static std::string PointEwkt(double lon, double lat)
+{
+	stringstream ss;
+	ss.precision(9);
+	ss << "SRID=4326;POINT(" << fixed << lon << " " << lat << ")";
+	return ss.str();
+}
+
+void CopyTextEscape(const std::string &in, std::string &out)
+{
+	out.clear();
+	out.reserve(in.size());
+	for(size_t i=0; i<in.size(); i++)
+	{
+		char ch = in[i];
+		if(ch == '\\')
+			out += "\\\\";
+		else if(ch == '\t')
+			out += "\\t";
+		else if(ch == '\n')
+			out += "\\n";
+		else if(ch == '\r')
+			out += "\\r";
+		else
+			out += ch;
+	}
+}
+
+// **********************************************
+
+CopyTextRow::CopyTextRow():
+	first(true)
+{
+
+}
+
+CopyTextRow::~CopyTextRow()
+{
+
+}
+
+void CopyTextRow::Sep()
+{
+	if(!first)
+		row += '\t';
+	first = false;
+}
+
+void CopyTextRow::Null()
+{
+	Sep();
+	row += "\\N";
+}
+
+void CopyTextRow::Int(int64_t val, int bytes)
+{
+	Sep();
+	row += to_string(val);
+}
+
+void CopyTextRow::Bool(bool val)
+{
+	Sep();
+	row += val ? "true" : "false";
+}
+
+void CopyTextRow::Text(const std::string &val)
+{
+	Sep();
+	string tmp;
+	CopyTextEscape(val, tmp);
+	row += tmp;
+}
+
+void CopyTextRow::Json(const std::string &json)
+{
+	Text(json);
+}
+
+void CopyTextRow::Point(double lon, double lat)
+{
+	Sep();
+	row += PointEwkt(lon, lat);
+}
+
+void CopyTextRow::EndRow(std::string &out)
+{
+	out += row;
+	row.clear();
+	first = true;
+}
+
+// **********************************************
+
+CsvRow::CsvRow():
+	first(true)
+{
+
+}
+
+CsvRow::~CsvRow()
+{
+
+}
+
+void CsvRow::Sep()
+{
+	if(!first)
+		row += ',';
+	first = false;
+}
+
+void CsvRow::Null()
+{
+	Sep();
+	row += "NULL";
+}
+
+void CsvRow::Int(int64_t val, int bytes)
+{
+	Sep();
+	row += to_string(val);
+}
+
+void CsvRow::Bool(bool val)
+{
+	Sep();
+	row += val ? "true" : "false";
+}
+
+void CsvRow::Text(const std::string &val)
+{
+	Sep();
+	string tmp = val;
+	StrReplaceAll(tmp, "\"", "\"\"");
+	row += "\"" + tmp + "\"";
+}
+
+void CsvRow::Json(const std::string &json)
+{
+	Text(json);
+}
+
+void CsvRow::Point(double lon, double lat)
+{
+	Sep();
+	row += PointEwkt(lon, lat);
+}
+
+void CsvRow::EndRow(std::string &out)
+{
+	out += row;
+	out += '\n';
+	row.clear();
+	first = true;
+}
+
+// **********************************************
+
+CopyBinaryRow::CopyBinaryRow():
+	numFields(0)
+{
+
+}
+
+CopyBinaryRow::~CopyBinaryRow()
+{
+
+}
+
+void CopyBinaryRow::Null()
+{
+	PgCopyBigEndian(0xffffffff, 4, fields);
+	numFields ++;
+}
+
+void CopyBinaryRow::Int(int64_t val, int bytes)
+{
+	PgCopyBigEndian(bytes, 4, fields);
+	PgCopyBigEndian((uint64_t)val, bytes, fields);
+	numFields ++;
+}
+
+void CopyBinaryRow::Bool(bool val)
+{
+	Int(val ? 1 : 0, 1);
+}
+
+void CopyBinaryRow::Text(const std::string &val)
+{
+	PgCopyBigEndian(val.size(), 4, fields);
+	fields += val;
+	numFields ++;
+}
+
+//Binary JSONB is a version byte followed by the json text
+void CopyBinaryRow::Json(const std::string &json)
+{
+	PgCopyBigEndian(json.size()+1, 4, fields);
+	fields += (char)1;
+	fields += json;
+	numFields ++;
+}
+
+//PostGIS accepts EWKB for binary geometry input
+void CopyBinaryRow::Point(double lon, double lat)
+{
+	uint64_t x = 0, y = 0;
+	memcpy(&x, &lon, sizeof(x));
+	memcpy(&y, &lat, sizeof(y));
+
+	PgCopyBigEndian(25, 4, fields);
+	fields += (char)1; //Little endian
+	PgCopyLittleEndian(0x20000001, 4, fields); //Point with SRID
+	PgCopyLittleEndian(4326, 4, fields);
+	PgCopyLittleEndian(x, 8, fields);
+	PgCopyLittleEndian(y, 8, fields);
+	numFields ++;
+}
+
+void CopyBinaryRow::EndRow(std::string &out)
+{
+	PgCopyBigEndian(numFields, 2, out);
+	out += fields;
+	fields.clear();
+	numFields = 0;
+}
+
+void CopyBinaryHeader(std::string &out)
+{
+	//Signature, flags and header extension length
+	out.append("PGCOPY\n\377\r\n\0", 11);
+	PgCopyBigEndian(0, 4, out);
+	PgCopyBigEndian(0, 4, out);
+}
+
+void CopyBinaryTrailer(std::string &out)
+{
+	PgCopyBigEndian(0xffff, 2, out);
+}
+
+// **********************************************
+
+//The columns common to all live and old object tables
+static void CopyRowMetaData(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool includeVisible, const TagMap &tags)
+{
+	string tagsJson;
+	EncodeTags(tags, tagsJson);
+
+	row.Int(objId, 8);
+	if(metaData.changeset != 0)
+		row.Int(metaData.changeset, 8);
+	else
+		row.Null();
+	row.Null(); //changeset_index
+	if(metaData.username.size() > 0)
+		row.Text(metaData.username);
+	else
+		row.Null();
+	if(metaData.uid != 0)
+		row.Int(metaData.uid, 4);
+	else
+		row.Null();
+	if(includeVisible)
+		row.Bool(metaData.visible);
+	if(metaData.timestamp != 0)
+		row.Int(metaData.timestamp, 8);
+	else
+		row.Null();
+	row.Int(metaData.version, 4);
+	row.Json(tagsJson);
+}
+
+void CopyRowNode(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags, double lat, double lon)
+{
+	CopyRowMetaData(row, objId, metaData, !live, tags);
+	row.Point(lon, lat);
+}
+
+void CopyRowWay(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags, const std::vector<int64_t> &refs)
+{
+	string refsJson;
+	EncodeInt64Vec(refs, refsJson);
+
+	CopyRowMetaData(row, objId, metaData, !live, tags);
+	row.Json(refsJson);
+	if(live)
+		row.Null(); //bbox
+}
+
+void CopyRowRelation(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags,
+	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+	const std::vector<std::string> &refRoles)
+{
+	string refsJson, refRolesJson;
+	EncodeRelationMems(refTypeStrs, refIds, refsJson);
+	EncodeStringVec(refRoles, refRolesJson);
+
+	CopyRowMetaData(row, objId, metaData, !live, tags);
+	row.Json(refsJson);
+	row.Json(refRolesJson);
+	if(live)
+		row.Null(); //bbox
+}
+
+void CopyRowId(class ICopyRowWriter &row, int64_t objId)
+{
+	row.Int(objId, 8);
+}
+
+void CopyRowMember(class ICopyRowWriter &row, int64_t objId, int64_t version, size_t index, int64_t memberId)
+{
+	row.Int(objId, 8);
+	row.Int(version, 4);
+	row.Int(index, 4);
+	row.Int(memberId, 8);
+}
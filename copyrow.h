@@ -0,0 +1,112 @@
+#ifndef _COPY_ROW_H
+#define _COPY_ROW_H
+
+#include <string>
+#include <vector>
+#include "cppo5m/o5m.h"
+
+//Receives the fields of one table row in column order. There is a writer for each file
+//format, so the column layout of the object tables is only defined by the CopyRow functions.
+class ICopyRowWriter
+{
+public:
+	virtual ~ICopyRowWriter() {};
+
+	virtual void Null() = 0;
+	//bytes is the size of the column type (8 for BIGINT, 4 for INTEGER)
+	virtual void Int(int64_t val, int bytes) = 0;
+	virtual void Bool(bool val) = 0;
+	virtual void Text(const std::string &val) = 0;
+	virtual void Json(const std::string &json) = 0;
+	virtual void Point(double lon, double lat) = 0;
+
+	//Appends the finished row to out and starts a new one
+	virtual void EndRow(std::string &out) = 0;
+};
+
+//PostgreSQL COPY text format. Rows have no line end, since pqxx::tablewriter adds it.
+class CopyTextRow : public ICopyRowWriter
+{
+private:
+	std::string row;
+	bool first;
+
+	void Sep();
+
+public:
+	CopyTextRow();
+	virtual ~CopyTextRow();
+
+	virtual void Null();
+	virtual void Int(int64_t val, int bytes);
+	virtual void Bool(bool val);
+	virtual void Text(const std::string &val);
+	virtual void Json(const std::string &json);
+	virtual void Point(double lon, double lat);
+	virtual void EndRow(std::string &out);
+};
+
+//csv, loaded with COPY ... WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL')
+class CsvRow : public ICopyRowWriter
+{
+private:
+	std::string row;
+	bool first;
+
+	void Sep();
+
+public:
+	CsvRow();
+	virtual ~CsvRow();
+
+	virtual void Null();
+	virtual void Int(int64_t val, int bytes);
+	virtual void Bool(bool val);
+	virtual void Text(const std::string &val);
+	virtual void Json(const std::string &json);
+	virtual void Point(double lon, double lat);
+	virtual void EndRow(std::string &out);
+};
+
+//PostgreSQL binary COPY format. The field count is written when the row is finished.
+class CopyBinaryRow : public ICopyRowWriter
+{
+private:
+	std::string fields;
+	int numFields;
+
+public:
+	CopyBinaryRow();
+	virtual ~CopyBinaryRow();
+
+	virtual void Null();
+	virtual void Int(int64_t val, int bytes);
+	virtual void Bool(bool val);
+	virtual void Text(const std::string &val);
+	virtual void Json(const std::string &json);
+	virtual void Point(double lon, double lat);
+	virtual void EndRow(std::string &out);
+};
+
+//Start and end of a binary COPY file
+void CopyBinaryHeader(std::string &out);
+void CopyBinaryTrailer(std::string &out);
+
+//Escapes a value for the COPY text format
+void CopyTextEscape(const std::string &in, std::string &out);
+
+//Rows of the live and old object tables. Only the live way and relation tables have a bbox column.
+void CopyRowNode(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags, double lat, double lon);
+void CopyRowWay(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags, const std::vector<int64_t> &refs);
+void CopyRowRelation(class ICopyRowWriter &row, int64_t objId, const class MetaData &metaData,
+	bool live, const TagMap &tags,
+	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+	const std::vector<std::string> &refRoles);
+
+//Rows of the id and member tables
+void CopyRowId(class ICopyRowWriter &row, int64_t objId);
+void CopyRowMember(class ICopyRowWriter &row, int64_t objId, int64_t version, size_t index, int64_t memberId);
+
+#endif //_COPY_ROW_H
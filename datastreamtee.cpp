@@ -0,0 +1,208 @@
+#include "datastreamtee.h"
+#include "util.h"
+#include <stdexcept>
+using namespace std;
+
+DataStreamTee::DataStreamTee(const std::vector<std::shared_ptr<IDataStreamHandler> > &handlers,
+		size_t batchSize, size_t maxQueuedBatches):
+	batchSize(batchSize),
+	maxQueuedBatches(maxQueuedBatches),
+	batchCount(0),
+	stopping(false)
+{
+	batch.reset(new class OsmData());
+	for(size_t i=0; i<handlers.size(); i++)
+	{
+		std::shared_ptr<class TeeOutput> output(new class TeeOutput());
+		output->handler = handlers[i];
+		outputs.push_back(output);
+	}
+	for(size_t i=0; i<outputs.size(); i++)
+		outputs[i]->thread = std::thread(&DataStreamTee::Worker, this, outputs[i].get());
+}
+
+DataStreamTee::~DataStreamTee()
+{
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	for(size_t i=0; i<outputs.size(); i++)
+		outputs[i]->thread.join();
+}
+
+void DataStreamTee::Worker(class TeeOutput *output)
+{
+	while(true)
+	{
+		std::shared_ptr<class TeeItem> item;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			while(output->queue.size() == 0 && !this->stopping)
+				this->changed.wait(lock);
+			if(output->queue.size() == 0)
+				return;
+			item = output->queue.front();
+		}
+
+		try
+		{
+			IDataStreamHandler &handler = *output->handler;
+			if(item->type == 0)
+				StreamObjectsTo(*item->data, handler);
+			else if(item->type == 1)
+				handler.Sync();
+			else if(item->type == 2)
+				handler.Reset();
+			else if(item->type == 3)
+				handler.Finish();
+			else if(item->type == 4)
+				handler.StoreIsDiff(item->isDiff);
+			else if(item->type == 5)
+				handler.StoreBounds(item->bounds[0], item->bounds[1], item->bounds[2], item->bounds[3]);
+		}
+		catch (const std::exception &e)
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			if(this->errStr.size() == 0)
+				this->errStr = e.what();
+		}
+
+		//The item is only removed once processed, so an empty queue means the output is idle
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			output->queue.pop_front();
+		}
+		this->changed.notify_all();
+	}
+}
+
+void DataStreamTee::CheckError()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	if(this->errStr.size() > 0)
+		throw runtime_error(this->errStr);
+}
+
+void DataStreamTee::Push(std::shared_ptr<class TeeItem> item)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	for(size_t i=0; i<outputs.size(); i++)
+	{
+		while(outputs[i]->queue.size() >= this->maxQueuedBatches && this->errStr.size() == 0)
+			this->changed.wait(lock);
+	}
+	if(this->errStr.size() > 0)
+		throw runtime_error(this->errStr);
+	for(size_t i=0; i<outputs.size(); i++)
+		outputs[i]->queue.push_back(item);
+	lock.unlock();
+	this->changed.notify_all();
+}
+
+void DataStreamTee::FlushBatch()
+{
+	if(this->batchCount == 0)
+		return;
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 0;
+	item->data = this->batch;
+	Push(item);
+
+	this->batch.reset(new class OsmData());
+	this->batchCount = 0;
+}
+
+void DataStreamTee::WaitForOutputs()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	for(size_t i=0; i<outputs.size(); i++)
+	{
+		while(outputs[i]->queue.size() > 0)
+			this->changed.wait(lock);
+	}
+	if(this->errStr.size() > 0)
+		throw runtime_error(this->errStr);
+}
+
+bool DataStreamTee::Sync()
+{
+	FlushBatch();
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 1;
+	Push(item);
+	WaitForOutputs();
+	return false;
+}
+
+bool DataStreamTee::Reset()
+{
+	FlushBatch();
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 2;
+	Push(item);
+	return false;
+}
+
+bool DataStreamTee::Finish()
+{
+	FlushBatch();
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 3;
+	Push(item);
+	WaitForOutputs();
+	return false;
+}
+
+bool DataStreamTee::StoreIsDiff(bool isDiff)
+{
+	FlushBatch();
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 4;
+	item->isDiff = isDiff;
+	Push(item);
+	return false;
+}
+
+bool DataStreamTee::StoreBounds(double x1, double y1, double x2, double y2)
+{
+	FlushBatch();
+	std::shared_ptr<class TeeItem> item(new class TeeItem());
+	item->type = 5;
+	item->bounds = {x1, y1, x2, y2};
+	Push(item);
+	return false;
+}
+
+bool DataStreamTee::StoreNode(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, double lat, double lon)
+{
+	this->batch->StoreNode(objId, metaData, tags, lat, lon);
+	this->batchCount ++;
+	if(this->batchCount >= this->batchSize)
+		FlushBatch();
+	return false;
+}
+
+bool DataStreamTee::StoreWay(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, const std::vector<int64_t> &refs)
+{
+	this->batch->StoreWay(objId, metaData, tags, refs);
+	this->batchCount ++;
+	if(this->batchCount >= this->batchSize)
+		FlushBatch();
+	return false;
+}
+
+bool DataStreamTee::StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+	const std::vector<std::string> &refRoles)
+{
+	this->batch->StoreRelation(objId, metaData, tags, refTypeStrs, refIds, refRoles);
+	this->batchCount ++;
+	if(this->batchCount >= this->batchSize)
+		FlushBatch();
+	return false;
+}
+
@@ -0,0 +1,72 @@
+#ifndef _DATA_STREAM_TEE_H
+#define _DATA_STREAM_TEE_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "cppo5m/OsmData.h"
+
+//Passes one stream of objects to several outputs, each running on its own thread. Objects
+//are collected into batches of batchSize, which are shared by all outputs. Storing objects
+//blocks while any output has maxQueuedBatches waiting, so memory use stays bounded.
+//Finish and Sync return after every output has processed them.
+class DataStreamTee : public IDataStreamHandler
+{
+private:
+	class TeeItem
+	{
+	public:
+		int type; //0 objects, 1 sync, 2 reset, 3 finish, 4 is diff, 5 bounds
+		std::shared_ptr<const class OsmData> data;
+		bool isDiff;
+		std::vector<double> bounds;
+	};
+
+	class TeeOutput
+	{
+	public:
+		std::shared_ptr<IDataStreamHandler> handler;
+		std::deque<std::shared_ptr<class TeeItem> > queue;
+		std::thread thread;
+	};
+
+	size_t batchSize, maxQueuedBatches;
+	std::vector<std::shared_ptr<class TeeOutput> > outputs;
+	std::shared_ptr<class OsmData> batch;
+	size_t batchCount;
+	bool stopping;
+	std::mutex mtx;
+	std::condition_variable changed;
+	std::string errStr;
+
+	void FlushBatch();
+	void Push(std::shared_ptr<class TeeItem> item);
+	void WaitForOutputs();
+	void Worker(class TeeOutput *output);
+	void CheckError();
+
+public:
+	DataStreamTee(const std::vector<std::shared_ptr<IDataStreamHandler> > &handlers,
+		size_t batchSize = 1000, size_t maxQueuedBatches = 16);
+	virtual ~DataStreamTee();
+
+	virtual bool Sync();
+	virtual bool Reset();
+	virtual bool Finish();
+
+	virtual bool StoreIsDiff(bool isDiff);
+	virtual bool StoreBounds(double x1, double y1, double x2, double y2);
+	virtual bool StoreNode(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, double lat, double lon);
+	virtual bool StoreWay(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, const std::vector<int64_t> &refs);
+	virtual bool StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+		const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+		const std::vector<std::string> &refRoles);
+};
+
+#endif //_DATA_STREAM_TEE_H
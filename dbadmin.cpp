@@ -6,13 +6,22 @@
 #include "dbquery.h"
 #include "dbusername.h"
 #include "dbmeta.h"
+#include "dbparallel.h"
+#include "dbtagstats.h"
 #include "util.h"
+#include "osmchangestream.h"
+#include "tileexpiry.h"
 #include "cppGzip/DecodeGzip.h"
 #include "cppo5m/utils.h"
 #include <map>
 #include <set>
 #include <boost/filesystem.hpp>
 #include <fstream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <ctime>
+#include <unistd.h>
 using namespace std;
 using namespace boost::filesystem;
 
@@ -332,6 +341,7 @@ bool DbDowngradeTables11To0(pqxx::connection &c, pqxx::transaction_base *work,
 	ok = DbExec(work, sql, errStr, nullptr, verbose);
 	sql = "DROP TABLE IF EXISTS "+c.quote_name(tablePrefix+"usernames")+" CASCADE;";
 	ok = DbExec(work, sql, errStr, nullptr, verbose);
+	ok = DbDropTagStats(c, work, verbose, tablePrefix, errStr);
 	return ok;	
 
 }
@@ -437,52 +447,80 @@ bool DbSetSchemaVersion(pqxx::connection &c, pqxx::transaction_base *work,
 	return true;
 }
 
+void DbCopyDataSteps(pqxx::connection &c, 
+	const string &filePrefix,
+	const string &tablePrefix, 
+	bool binaryFormat,
+	std::vector<class DbParallelStep> &stepsOut)
+{
+	//Table name, file name
+	const char *tables[][2] = {{"oldnodes", "oldnodes"}, {"oldways", "oldways"}, {"oldrelations", "oldrelations"},
+		{"livenodes", "livenodes"}, {"liveways", "liveways"}, {"liverelations", "liverelations"},
+		{"nodeids", "nodeids"}, {"wayids", "wayids"}, {"relationids", "relationids"},
+		{"way_mems", "waymems"}, {"relation_mems_n", "relationmems-n"}, {"relation_mems_w", "relationmems-w"},
+		{"relation_mems_r", "relationmems-r"}};
+
+	for(size_t i=0; i<sizeof(tables)/sizeof(tables[0]); i++)
+	{
+		string tableName = tablePrefix+tables[i][0];
+		string sql;
+		if(binaryFormat)
+			sql = "COPY "+c.quote_name(tableName)+" FROM PROGRAM 'zcat "+filePrefix+tables[i][1]+".pgcopy.gz' WITH (FORMAT 'binary');";
+		else
+			sql = "COPY "+c.quote_name(tableName)+" FROM PROGRAM 'zcat "+filePrefix+tables[i][1]+".csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
+		stepsOut.push_back(DbParallelStep("copy "+tableName, {sql}, {}));
+	}
+}
+
 bool DbCopyData(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const string &filePrefix,
 	const string &tablePrefix, 
+	bool binaryFormat,
 	std::string &errStr)
 {
-	string sql = "COPY "+c.quote_name(tablePrefix+"oldnodes")+" FROM PROGRAM 'zcat "+filePrefix+"oldnodes.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	bool ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-
-	sql = "COPY "+c.quote_name(tablePrefix+"oldways")+" FROM PROGRAM 'zcat "+filePrefix+"oldways.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"oldrelations")+" FROM PROGRAM 'zcat "+filePrefix+"oldrelations.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
+	std::vector<class DbParallelStep> steps;
+	DbCopyDataSteps(c, filePrefix, tablePrefix, binaryFormat, steps);
+	return DbRunSteps(work, verbose, steps, errStr);
+}
 
-	sql = "COPY "+c.quote_name(tablePrefix+"livenodes")+" FROM PROGRAM 'zcat "+filePrefix+"livenodes.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"liveways")+" FROM PROGRAM 'zcat "+filePrefix+"liveways.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"liverelations")+" FROM PROGRAM 'zcat "+filePrefix+"liverelations.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
+//Adds a primary key step. Later indices on the table depend on this, since adding
+//a primary key locks out other index builds on the same table.
+static void AddPrimaryKeyStep(pqxx::connection &c, pqxx::transaction_base *work, 
+	const string &tableName, const string &cols,
+	std::vector<class DbParallelStep> &stepsOut)
+{
+	if(DbCountPrimaryKeyCols(c, work, tableName)!=0)
+		return;
+	string sql = "ALTER TABLE "+c.quote_name(tableName)+" ADD PRIMARY KEY ("+cols+");";
+	stepsOut.push_back(DbParallelStep("pk "+tableName, {sql}, {"copy "+tableName}));
+}
 
-	sql = "COPY "+c.quote_name(tablePrefix+"nodeids")+" FROM PROGRAM 'zcat "+filePrefix+"nodeids.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"wayids")+" FROM PROGRAM 'zcat "+filePrefix+"wayids.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"relationids")+" FROM PROGRAM 'zcat "+filePrefix+"relationids.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
+static void AddIndexStep(pqxx::connection &c, 
+	const string &ine,
+	const string &indexName, const string &tableName, const string &indexDef,
+	std::vector<class DbParallelStep> &stepsOut)
+{
+	string sql = "CREATE INDEX "+ine+c.quote_name(indexName)+" ON "+c.quote_name(tableName)+" "+indexDef+";";
+	stepsOut.push_back(DbParallelStep(indexName, {sql}, {"copy "+tableName, "pk "+tableName}));
+}
 
-	sql = "COPY "+c.quote_name(tablePrefix+"way_mems")+" FROM PROGRAM 'zcat "+filePrefix+"waymems.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"relation_mems_n")+" FROM PROGRAM 'zcat "+filePrefix+"relationmems-n.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"relation_mems_w")+" FROM PROGRAM 'zcat "+filePrefix+"relationmems-w.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "COPY "+c.quote_name(tablePrefix+"relation_mems_r")+" FROM PROGRAM 'zcat "+filePrefix+"relationmems-r.csv.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); 
-	return ok;	
+//Index with a following VACUUM ANALYZE, to update the planner statistics
+static void AddGistIndexStep(pqxx::connection &c, pqxx::transaction_base *work, 
+	const string &ine,
+	const string &indexName, const string &tableName, const string &col,
+	std::vector<class DbParallelStep> &stepsOut)
+{
+	if(DbCheckIndexExists(c, work, indexName))
+		return;
+	AddIndexStep(c, ine, indexName, tableName, "USING GIST ("+col+")", stepsOut);
+	stepsOut.back().sqls.push_back("VACUUM ANALYZE "+c.quote_name(tableName)+"("+col+");");
 }
 
-bool DbCreateIndices(pqxx::connection &c, pqxx::transaction_base *work, 
-	int verbose, 
+void DbCreateIndicesSteps(pqxx::connection &c, pqxx::transaction_base *work, 
 	const string &tablePrefix, 
-	std::string &errStr)
+	std::vector<class DbParallelStep> &stepsOut)
 {
-	bool ok = true;
-	string sql;
 	int majorVer=0, minorVer=0;
 	DbGetVersion(c, work, majorVer, minorVer);
 	string ine = "IF NOT EXISTS ";
@@ -493,157 +531,83 @@ bool DbCreateIndices(pqxx::connection &c, pqxx::transaction_base *work,
 		brinSupported = false;
 	}
 
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"oldnodes")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"oldnodes")+" ADD PRIMARY KEY (id, version);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"oldways")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"oldways")+" ADD PRIMARY KEY (id, version);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"oldrelations")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"oldrelations")+" ADD PRIMARY KEY (id, version);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
-
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"livenodes")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"livenodes")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"liveways")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"liveways")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"liverelations")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"liverelations")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
-
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"nodeids")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"nodeids")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"wayids")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"wayids")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	}
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"relationids")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"relationids")+" ADD PRIMARY KEY (id);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
-
-	if(!DbCheckIndexExists(c, work, tablePrefix+"livenodes_gix"))
-	{
-		//Used to do a standard map query
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"livenodes_gix")+" ON "+c.quote_name(tablePrefix+"livenodes")+" USING GIST (geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddPrimaryKeyStep(c, work, tablePrefix+"oldnodes", "id, version", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"oldways", "id, version", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"oldrelations", "id, version", stepsOut);
 
-		sql = "VACUUM ANALYZE "+c.quote_name(tablePrefix+"livenodes")+"(geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
+	AddPrimaryKeyStep(c, work, tablePrefix+"livenodes", "id", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"liveways", "id", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"liverelations", "id", stepsOut);
 
-	if(!DbCheckIndexExists(c, work, tablePrefix+"oldnodes_gix"))
-	{
-		//Used for quering nodes at a particular point in time
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldnodes_gix")+" ON "+c.quote_name(tablePrefix+"oldnodes")+" USING GIST (geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddPrimaryKeyStep(c, work, tablePrefix+"nodeids", "id", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"wayids", "id", stepsOut);
+	AddPrimaryKeyStep(c, work, tablePrefix+"relationids", "id", stepsOut);
 
-		sql = "VACUUM ANALYZE "+c.quote_name(tablePrefix+"oldnodes")+"(geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-	}
+	//Used to do a standard map query
+	AddGistIndexStep(c, work, ine, tablePrefix+"livenodes_gix", tablePrefix+"livenodes", "geom", stepsOut);
+	//Used for quering nodes at a particular point in time
+	AddGistIndexStep(c, work, ine, tablePrefix+"oldnodes_gix", tablePrefix+"oldnodes", "geom", stepsOut);
 
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"way_mems_mids")+" ON "+c.quote_name(tablePrefix+"way_mems")+" (member);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddIndexStep(c, ine, tablePrefix+"way_mems_mids", tablePrefix+"way_mems", "(member)", stepsOut);
 
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"relation_mems_n_mids")+" ON "+c.quote_name(tablePrefix+"relation_mems_n")+" (member);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"relation_mems_w_mids")+" ON "+c.quote_name(tablePrefix+"relation_mems_w")+" (member);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"relation_mems_r_mids")+" ON "+c.quote_name(tablePrefix+"relation_mems_r")+" (member);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddIndexStep(c, ine, tablePrefix+"relation_mems_n_mids", tablePrefix+"relation_mems_n", "(member)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"relation_mems_w_mids", tablePrefix+"relation_mems_w", "(member)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"relation_mems_r_mids", tablePrefix+"relation_mems_r", "(member)", stepsOut);
 
 	//Timestamp indicies
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldnodes_ts2")+" ON "+c.quote_name(tablePrefix+"oldnodes")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldways_ts2")+" ON "+c.quote_name(tablePrefix+"oldways")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldrelations_ts2")+" ON "+c.quote_name(tablePrefix+"oldrelations")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddIndexStep(c, ine, tablePrefix+"oldnodes_ts2", tablePrefix+"oldnodes", "(timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"oldways_ts2", tablePrefix+"oldways", "(timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"oldrelations_ts2", tablePrefix+"oldrelations", "(timestamp)", stepsOut);
 
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"livenodes_ts")+" ON "+c.quote_name(tablePrefix+"livenodes")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liveways_ts")+" ON "+c.quote_name(tablePrefix+"liveways")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liverelations_ts")+" ON "+c.quote_name(tablePrefix+"liverelations")+" (timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	AddIndexStep(c, ine, tablePrefix+"livenodes_ts", tablePrefix+"livenodes", "(timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"liveways_ts", tablePrefix+"liveways", "(timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"liverelations_ts", tablePrefix+"liverelations", "(timestamp)", stepsOut);
 
 	if(brinSupported)
 	{
 		//Object user indices
 		//Is this really used?
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldnodes_uid2")+" ON "+c.quote_name(tablePrefix+"oldnodes")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldways_uid2")+" ON "+c.quote_name(tablePrefix+"oldways")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldrelations_uid2")+" ON "+c.quote_name(tablePrefix+"oldrelations")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+		AddIndexStep(c, ine, tablePrefix+"oldnodes_uid2", tablePrefix+"oldnodes", "USING BRIN(uid)", stepsOut);
+		AddIndexStep(c, ine, tablePrefix+"oldways_uid2", tablePrefix+"oldways", "USING BRIN(uid)", stepsOut);
+		AddIndexStep(c, ine, tablePrefix+"oldrelations_uid2", tablePrefix+"oldrelations", "USING BRIN(uid)", stepsOut);
 
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"livenodes_uid")+" ON "+c.quote_name(tablePrefix+"livenodes")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liveways_uid")+" ON "+c.quote_name(tablePrefix+"liveways")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liverelations_uid")+" ON "+c.quote_name(tablePrefix+"liverelations")+" USING BRIN(uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+		AddIndexStep(c, ine, tablePrefix+"livenodes_uid", tablePrefix+"livenodes", "USING BRIN(uid)", stepsOut);
+		AddIndexStep(c, ine, tablePrefix+"liveways_uid", tablePrefix+"liveways", "USING BRIN(uid)", stepsOut);
+		AddIndexStep(c, ine, tablePrefix+"liverelations_uid", tablePrefix+"liverelations", "USING BRIN(uid)", stepsOut);
 	}
 
 	//Changeset indices
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldnodes_cs2")+" ON "+c.quote_name(tablePrefix+"oldnodes")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldways_cs2")+" ON "+c.quote_name(tablePrefix+"oldways")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"oldrelations_cs2")+" ON "+c.quote_name(tablePrefix+"oldrelations")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"livenodes_cs")+" ON "+c.quote_name(tablePrefix+"livenodes")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liveways_cs")+" ON "+c.quote_name(tablePrefix+"liveways")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"liverelations_cs")+" ON "+c.quote_name(tablePrefix+"liverelations")+" (changeset);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"changesets_uidx")+" ON "+c.quote_name(tablePrefix+"changesets")+" (uid);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"changesets_open_timestampx")+" ON "+c.quote_name(tablePrefix+"changesets")+" (open_timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"changesets_close_timestampx")+" ON "+c.quote_name(tablePrefix+"changesets")+" (close_timestamp);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"changesets_is_openx")+" ON "+c.quote_name(tablePrefix+"changesets")+" (is_open);";
-	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-
-	if(!DbCheckIndexExists(c, work, tablePrefix+"changesets_gix"))
-	{
-		sql = "CREATE INDEX "+ine+c.quote_name(tablePrefix+"changesets_gix")+" ON "+c.quote_name(tablePrefix+"changesets")+" USING GIST (geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
-
-		sql = "VACUUM ANALYZE "+c.quote_name(tablePrefix+"changesets")+"(geom);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); 
-	}
+	AddIndexStep(c, ine, tablePrefix+"oldnodes_cs2", tablePrefix+"oldnodes", "(changeset)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"oldways_cs2", tablePrefix+"oldways", "(changeset)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"oldrelations_cs2", tablePrefix+"oldrelations", "(changeset)", stepsOut);
+
+	AddIndexStep(c, ine, tablePrefix+"livenodes_cs", tablePrefix+"livenodes", "(changeset)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"liveways_cs", tablePrefix+"liveways", "(changeset)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"liverelations_cs", tablePrefix+"liverelations", "(changeset)", stepsOut);
+
+	AddIndexStep(c, ine, tablePrefix+"changesets_uidx", tablePrefix+"changesets", "(uid)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"changesets_open_timestampx", tablePrefix+"changesets", "(open_timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"changesets_close_timestampx", tablePrefix+"changesets", "(close_timestamp)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"changesets_is_openx", tablePrefix+"changesets", "(is_open)", stepsOut);
+	//For paging through changesets in (close timestamp, id) order
+	AddIndexStep(c, ine, tablePrefix+"changesets_close_idx", tablePrefix+"changesets", 
+		"((COALESCE(NULLIF(close_timestamp, 0), 9223372036854775807)), id)", stepsOut);
+	AddIndexStep(c, ine, tablePrefix+"changesets_uid_close_idx", tablePrefix+"changesets", 
+		"(uid, (COALESCE(NULLIF(close_timestamp, 0), 9223372036854775807)), id)", stepsOut);
+
+	AddGistIndexStep(c, work, ine, tablePrefix+"changesets_gix", tablePrefix+"changesets", "geom", stepsOut);
+
+	AddPrimaryKeyStep(c, work, tablePrefix+"usernames", "uid", stepsOut);
+}
 
-	if(DbCountPrimaryKeyCols(c, work, tablePrefix+"usernames")==0)
-	{
-		sql = "ALTER TABLE "+c.quote_name(tablePrefix+"usernames")+" ADD PRIMARY KEY (uid);";
-		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;	
-	}
-	return ok;
+bool DbCreateIndices(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const string &tablePrefix, 
+	std::string &errStr)
+{
+	std::vector<class DbParallelStep> steps;
+	DbCreateIndicesSteps(c, work, tablePrefix, steps);
+	return DbRunSteps(work, verbose, steps, errStr);
 }
 
 bool DbCreateBboxIndices(pqxx::connection &c, pqxx::transaction_base *work, 
@@ -710,6 +674,59 @@ bool DbDropBboxIndices(pqxx::connection &c, pqxx::transaction_base *work,
 	return ok;
 }
 
+bool DbCreateTagIndices(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const string &tablePrefix, 
+	std::string &errStr)
+{
+	bool ok = true;
+	string sql;
+	int majorVer=0, minorVer=0;
+	DbGetVersion(c, work, majorVer, minorVer);
+	if(majorVer < 9 || (majorVer == 9 && minorVer <= 3))
+	{
+		errStr = "Tag indices need JSONB, which requires PostgreSQL 9.4 or later";
+		return false;
+	}
+	string ine = "IF NOT EXISTS ";
+
+	std::vector<std::string> objTypes = {"node", "way", "relation"};
+	for(size_t i=0; i<objTypes.size(); i++)
+	{
+		string tableName = tablePrefix+"live"+objTypes[i]+"s";
+		string indexName = tablePrefix+"live"+objTypes[i]+"s_tagx";
+		if(DbCheckIndexExists(c, work, indexName))
+			continue;
+
+		sql = "CREATE INDEX "+ine+c.quote_name(indexName)+" ON "+c.quote_name(tableName)+" USING GIN (tags jsonb_path_ops);";
+		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+
+		sql = "VACUUM ANALYZE "+c.quote_name(tableName)+"(tags);";
+		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	}
+
+	return ok;
+}
+
+bool DbDropTagIndices(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const string &tablePrefix, 
+	std::string &errStr)
+{
+	bool ok = true;
+	string sql;
+	string ie = "IF EXISTS ";
+
+	std::vector<std::string> objTypes = {"node", "way", "relation"};
+	for(size_t i=0; i<objTypes.size(); i++)
+	{
+		sql = "DROP INDEX "+ie+c.quote_name(tablePrefix+"live"+objTypes[i]+"s_tagx")+";";
+		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	}
+
+	return ok;
+}
+
 bool DbRefreshMaxIdsOfType(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const string &tablePrefix, 
@@ -898,14 +915,221 @@ bool DbGenerateUsernameTable(pqxx::connection &c, pqxx::transaction_base *work,
 	return true;
 }
 
+bool DbApplyDiffBlock(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tableModPrefix, 
+	const std::string &action,
+	class OsmData &block,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	class TileExpiry *expiry)
+{
+	//Set visibility flag depending on action
+	bool isCreate = action == "create";
+	bool isDelete = action == "delete";
+	for(size_t j=0; j<block.nodes.size(); j++)
+		block.nodes[j].metaData.visible = !isDelete;
+	for(size_t j=0; j<block.ways.size(); j++)
+		block.ways[j].metaData.visible = !isDelete;
+	for(size_t j=0; j<block.relations.size(); j++)
+		block.relations[j].metaData.visible = !isDelete;
+
+	//Expire the old envelopes of changed objects
+	if(expiry != nullptr)
+		pgCommon->ExpireObjectTiles(block, *expiry);
+
+	//Store objects
+	std::map<int64_t, int64_t> createdNodeIds, createdWayIds, createdRelationIds;
+
+	bool ok = ::StoreObjects(c, work, tableModPrefix, block, 
+		createdNodeIds, createdWayIds, createdRelationIds, errStr);
+	if(!ok)
+		return false;
+
+	std::set<int64_t> waysToUpdate, relsToUpdate;
+	for(size_t j=0; j<block.ways.size(); j++)
+	{
+		if (block.ways[j].objId <= 0) throw runtime_error("ID should not be zero or negative");
+		waysToUpdate.insert(block.ways[j].objId);
+	}
+	for(size_t j=0; j<block.relations.size(); j++)
+	{
+		if (block.relations[j].objId <= 0) throw runtime_error("ID should not be zero or negative");
+		relsToUpdate.insert(block.relations[j].objId);
+	}
+
+	if(!isCreate)
+	{
+		//Get affected parent objects
+		std::shared_ptr<class OsmData> affectedParents = make_shared<class OsmData>();
+
+		pgCommon->GetAffectedParents2(block, affectedParents);
+		if(expiry != nullptr)
+			pgCommon->ExpireObjectTiles(*affectedParents, *expiry);
+
+		//Ensure a copy of affected parents is in the active table
+		std::map<int64_t, int64_t> unusedNodeIds, unusedWayIds, unusedRelationIds;
+		ok = ::StoreObjects(c, work, tableModPrefix, *affectedParents.get(), 
+			unusedNodeIds, unusedWayIds, unusedRelationIds, errStr);
+		if(!ok)
+			return false;
+
+		for(size_t j=0; j<affectedParents->ways.size(); j++)
+			waysToUpdate.insert(affectedParents->ways[j].objId);
+		for(size_t j=0; j<affectedParents->relations.size(); j++)
+			relsToUpdate.insert(affectedParents->relations[j].objId);
+	}
+
+	//Update bboxes of modified and parent ways
+	int ret = ::UpdateWayBboxesById(c, work,
+		waysToUpdate,
+		0,
+		tableModPrefix, 
+		errStr);
+
+	//Update relation bboxes
+	ret = ::UpdateRelationBboxesById(c, work,
+		relsToUpdate,
+		0,
+		tableModPrefix, 
+		errStr);
+
+	//Expire the new envelopes
+	if(expiry != nullptr)
+	{
+		for(size_t j=0; j<block.nodes.size(); j++)
+			if(!isDelete)
+				expiry->ExpirePoint(block.nodes[j].lon, block.nodes[j].lat);
+		pgCommon->ExpireObjectTiles("way", waysToUpdate, *expiry);
+		pgCommon->ExpireObjectTiles("relation", relsToUpdate, *expiry);
+	}
+
+	return true;
+}
+
+static void UpdateMaxIds(const class OsmData &block, std::map<std::string, int64_t> *maxIds)
+{
+	if(maxIds == nullptr)
+		return;
+	int64_t &maxNode = (*maxIds)["node"];
+	for(size_t i=0; i<block.nodes.size(); i++)
+		if(block.nodes[i].objId > maxNode) maxNode = block.nodes[i].objId;
+	int64_t &maxWay = (*maxIds)["way"];
+	for(size_t i=0; i<block.ways.size(); i++)
+		if(block.ways[i].objId > maxWay) maxWay = block.ways[i].objId;
+	int64_t &maxRelation = (*maxIds)["relation"];
+	for(size_t i=0; i<block.relations.size(); i++)
+		if(block.relations[i].objId > maxRelation) maxRelation = block.relations[i].objId;
+}
+
+//Applies each block of a diff as soon as it has been decoded. A block that fails throws,
+//which the decoder catches to stop parsing and report the error.
+class ApplyDiffBlocks : public IOsmChangeBlock
+{
+public:
+	pqxx::connection &c;
+	pqxx::transaction_base *work;
+	std::string tableModPrefix;
+	class PgCommon *pgCommon;
+	std::map<std::string, int64_t> *maxIds;
+	class TileExpiry *expiry;
+
+	ApplyDiffBlocks(pqxx::connection &c, pqxx::transaction_base *work, 
+		const std::string &tableModPrefix, class PgCommon *pgCommon, std::map<std::string, int64_t> *maxIds,
+		class TileExpiry *expiry):
+		c(c), work(work), tableModPrefix(tableModPrefix), pgCommon(pgCommon), maxIds(maxIds), expiry(expiry) {};
+	virtual ~ApplyDiffBlocks() {};
+
+	virtual void StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused)
+	{
+		class OsmData block(osmData);
+		string errStr;
+		bool ok = DbApplyDiffBlock(c, work, tableModPrefix, action, block, pgCommon, errStr, expiry);
+		if(!ok)
+			throw runtime_error(errStr);
+		UpdateMaxIds(block, maxIds);
+	}
+};
+
+bool DbApplyDiffFile(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tableModPrefix, 
+	const std::string &fina, 
+	size_t maxObjects,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	std::map<std::string, int64_t> *maxIds,
+	class TileExpiry *expiry,
+	int verbose)
+{
+	if(maxObjects == 0)
+	{
+		std::string xmlData;
+		DecodeGzipQuickFromFilename(fina, xmlData);
+		
+		shared_ptr<class OsmChange> data(new class OsmChange());
+		std::stringbuf sb(xmlData);
+		LoadFromOsmChangeXml(sb, data.get());
+
+		for(size_t i=0; i<data->blocks.size(); i++)
+		{
+			if(verbose >= 1)
+				cout << data->actions[i] << endl;
+			bool ok = DbApplyDiffBlock(c, work, tableModPrefix, data->actions[i], data->blocks[i], pgCommon, errStr, expiry);
+			if(!ok)
+			{
+				errStr = fina + ": " + errStr;
+				return false;
+			}
+			UpdateMaxIds(data->blocks[i], maxIds);
+		}
+		return true;
+	}
+
+	//Decompress and decode the file in chunks, applying blocks of up to maxObjects as they are decoded
+	std::filebuf fi;
+	if(fi.open(fina, std::ios::in | std::ios::binary) == nullptr)
+	{
+		errStr = "Failed to open "+fina;
+		return false;
+	}
+	class DecodeGzip gzipDec(fi);
+	std::shared_ptr<class ApplyDiffBlocks> applyBlocks(new class ApplyDiffBlocks(c, work, tableModPrefix, pgCommon, maxIds, expiry));
+	class OsmChangeStreamDecode decoder(applyBlocks, maxObjects);
+	bool ok = DecodeOsmChangeStream(gzipDec, decoder);
+	if(!ok)
+	{
+		errStr = fina + ": " + decoder.errString;
+		return false;
+	}
+	return true;
+}
+
 bool DbApplyDiffs(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const std::string &tableStaticPrefix, 
 	const std::string &tableModPrefix, 
 	const std::string &tableTestPrefix, 
 	const std::string &diffPath, 
+	size_t maxObjects,
 	class PgCommon *pgCommon,
-	std::string &errStr)
+	std::string &errStr,
+	class TileExpiry *expiry)
+{
+	vector<string> filenames;
+	DbListDiffFiles(diffPath, filenames);
+
+	for(size_t i=0; i<filenames.size(); i++)
+	{
+		if(verbose >= 1)
+			cout << "   " << filenames[i] << endl;
+		bool ok = DbApplyDiffFile(c, work, tableModPrefix, filenames[i], maxObjects, pgCommon, errStr, nullptr, expiry, 
+			verbose);
+		if(!ok) return false;
+	}
+
+	return true;
+}
+
+void DbListDiffFiles(const std::string &diffPath, std::vector<std::string> &out)
 {
 	path p (diffPath);
 
@@ -917,106 +1141,281 @@ bool DbApplyDiffs(pqxx::connection &c, pqxx::transaction_base *work,
 			back_inserter(result));
 		sort(result.begin(), result.end());
 		for (vector<path>::const_iterator it (result.begin()); it != result.end(); ++it)
+			DbListDiffFiles(it->native(), out);
+	}
+	else if (extension(diffPath) == ".gz")
+		out.push_back(diffPath);
+}
+
+std::string DbDiffRelativePath(const std::string &diffPath, const std::string &fina)
+{
+	path p (diffPath);
+	if(!is_directory(p))
+		return path(fina).filename().native();
+
+	//Listed files are below diffPath, so strip it and the separator that follows
+	string prefix = p.native();
+	if(fina.compare(0, prefix.size(), prefix) != 0)
+		return fina;
+	string rel = fina.substr(prefix.size());
+	while(rel.size() > 0 && rel[0] == '/')
+		rel = rel.substr(1);
+	return rel;
+}
+
+bool DbApplyDiffsPipelined(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const std::string &tableModPrefix, 
+	const std::vector<std::string> &filenames, 
+	size_t maxObjects,
+	size_t prefetchBlocks,
+	int numThreads,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	std::map<std::string, int64_t> *maxIds,
+	class TileExpiry *expiry)
+{
+	//Zero decodes each action of a file as one block, as DbApplyDiffFile decodes whole files
+	size_t blockObjects = maxObjects > 0 ? maxObjects : SIZE_MAX;
+	size_t maxQueuedObjects = maxObjects > 0 ? maxObjects * std::max(prefetchBlocks, (size_t)1) : SIZE_MAX;
+
+	//Later blocks are decoded on background threads while the current one is applied
+	class OsmChangePrefetch prefetch(filenames, prefetchBlocks, numThreads, blockObjects, maxQueuedObjects);
+	string fina, lastFina, action;
+	std::shared_ptr<class OsmData> block;
+	while(true)
+	{
+		try
+		{
+			if(!prefetch.Next(fina, action, block))
+				break;
+		}
+		catch (const std::exception &e)
+		{
+			errStr = e.what();
+			return false;
+		}
+
+		if(fina != lastFina && verbose >= 1)
+			cout << "   " << fina << endl;
+		lastFina = fina;
+
+		bool ok = DbApplyDiffBlock(c, work, tableModPrefix, action, *block, pgCommon, errStr, expiry);
+		if(!ok)
 		{
-			//cout << "   " << *it << endl;
-
-			string pathStr(it->native());
-			bool ok = DbApplyDiffs(c, work, 
-				verbose, 
-				tableStaticPrefix, 
-				tableModPrefix, 
-				tableTestPrefix, 
-				pathStr, 
-				pgCommon,
-				errStr);
-			if(!ok) return false;
+			errStr = fina + ": " + errStr;
+			return false;
 		}
+		UpdateMaxIds(*block, maxIds);
 	}
-	else
+
+	return true;
+}
+
+bool DbRaiseNextIds(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix, 
+	const std::map<std::string, int64_t> &maxIds,
+	std::string &errStr)
+{
+	map<string, int64_t> nextIdMapOriginal, nextIdMap;
+	bool ok = GetNextObjectIds(c, work, tablePrefix, nextIdMapOriginal, errStr);
+	if(!ok)
+		return false;
+	nextIdMap = nextIdMapOriginal;
+
+	for(auto it=maxIds.begin(); it!=maxIds.end(); it++)
 	{
-		if (extension(diffPath) == ".gz")
-		{
-			cout << "   " << diffPath << endl;
-			std::string xmlData;
-			DecodeGzipQuickFromFilename(diffPath, xmlData);
-			
-			shared_ptr<class OsmChange> data(new class OsmChange());
-			std::stringbuf sb(xmlData);
-			LoadFromOsmChangeXml(sb, data.get());
+		auto it2 = nextIdMap.find(it->first);
+		if(it2 == nextIdMap.end() || it2->second <= it->second)
+			nextIdMap[it->first] = it->second + 1;
+	}
 
-			for(size_t i=0; i<data->blocks.size(); i++)
-			{
-				cout << data->actions[i] << endl;
-				class OsmData &block = data->blocks[i];
-
-				//Set visibility flag depending on action
-				bool isCreate = data->actions[i] == "delete";
-				bool isDelete = data->actions[i] == "delete";
-				for(size_t j=0; j<block.nodes.size(); j++)
-					block.nodes[j].metaData.visible = !isDelete;
-				for(size_t j=0; j<block.ways.size(); j++)
-					block.ways[j].metaData.visible = !isDelete;
-				for(size_t j=0; j<block.relations.size(); j++)
-					block.relations[j].metaData.visible = !isDelete;
-
-				//Store objects
-				std::map<int64_t, int64_t> createdNodeIds, createdWayIds, createdRelationIds;
-
-				bool ok = ::StoreObjects(c, work, tableModPrefix, block, 
-					createdNodeIds, createdWayIds, createdRelationIds, errStr);
-				if(!ok)
-					cout << "Warning: " << errStr << endl;
-
-				std::set<int64_t> waysToUpdate, relsToUpdate;
-				for(size_t j=0; j<block.ways.size(); j++)
-				{
-					if (block.ways[j].objId <= 0) throw runtime_error("ID should not be zero or negative");
-					waysToUpdate.insert(block.ways[j].objId);
-				}
-				for(size_t j=0; j<block.relations.size(); j++)
-				{
-					if (block.relations[j].objId <= 0) throw runtime_error("ID should not be zero or negative");
-					relsToUpdate.insert(block.relations[j].objId);
-				}
-
-				if(!isCreate)
-				{
-					//Get affected parent objects
-					std::shared_ptr<class OsmData> affectedParents = make_shared<class OsmData>();
-
-					pgCommon->GetAffectedParents2(block, affectedParents);
-
-					//Ensure a copy of affected parents is in the active table
-					std::map<int64_t, int64_t> unusedNodeIds, unusedWayIds, unusedRelationIds;
-					bool ok = ::StoreObjects(c, work, tableModPrefix, *affectedParents.get(), 
-						unusedNodeIds, unusedWayIds, unusedRelationIds, errStr);
-
-					for(size_t j=0; j<affectedParents->ways.size(); j++)
-						waysToUpdate.insert(affectedParents->ways[j].objId);
-					for(size_t j=0; j<affectedParents->relations.size(); j++)
-						relsToUpdate.insert(affectedParents->relations[j].objId);
-				}
-
-				//Update bboxes of modified and parent ways
-				int ret = ::UpdateWayBboxesById(c, work,
-					waysToUpdate,
-					0,
-					tableModPrefix, 
-					errStr);
-
-				//Update relation bboxes
-				ret = ::UpdateRelationBboxesById(c, work,
-					relsToUpdate,
-					0,
-					tableModPrefix, 
-					errStr);
-			}
+	return UpdateNextObjectIds(c, work, tablePrefix, nextIdMap, nextIdMapOriginal, errStr);
+}
+
+template<class T> static void CollapseObjects(const std::vector<T> &objs, bool visible, std::map<int64_t, T> &out)
+{
+	for(size_t i=0; i<objs.size(); i++)
+	{
+		const T &obj = objs[i];
+		typename std::map<int64_t, T>::iterator it = out.find(obj.objId);
+		if(it != out.end() && it->second.metaData.version > obj.metaData.version)
+			continue;
+		T &stored = out[obj.objId];
+		stored = obj;
+		stored.metaData.visible = visible;
+	}
+}
+
+bool DbCollapseDiffs(const std::vector<std::string> &filenames, 
+	size_t prefetchFiles,
+	int numThreads,
+	class OsmData &out,
+	std::string &errStr)
+{
+	std::map<int64_t, class OsmNode> nodes;
+	std::map<int64_t, class OsmWay> ways;
+	std::map<int64_t, class OsmRelation> relations;
+
+	class OsmChangePrefetch prefetch(filenames, prefetchFiles, numThreads, 10000, 10000 * std::max(prefetchFiles, (size_t)1));
+	string fina, action;
+	std::shared_ptr<class OsmData> block;
+	while(true)
+	{
+		try
+		{
+			if(!prefetch.Next(fina, action, block))
+				break;
+		}
+		catch (const std::exception &e)
+		{
+			errStr = e.what();
+			return false;
 		}
+
+		bool visible = action != "delete";
+		CollapseObjects(block->nodes, visible, nodes);
+		CollapseObjects(block->ways, visible, ways);
+		CollapseObjects(block->relations, visible, relations);
 	}
 
+	for(auto it=nodes.begin(); it!=nodes.end(); it++)
+		out.nodes.push_back(it->second);
+	for(auto it=ways.begin(); it!=ways.end(); it++)
+		out.ways.push_back(it->second);
+	for(auto it=relations.begin(); it!=relations.end(); it++)
+		out.relations.push_back(it->second);
 	return true;
 }
 
+//Lets the parallel store workers commit only once all of them have prepared their transactions
+class DbStoreBarrier
+{
+public:
+	std::mutex mtx;
+	std::condition_variable changed;
+	int remaining;
+	bool failed;
+	std::string errStr;
+
+	DbStoreBarrier(int numWorkers): remaining(numWorkers), failed(false) {};
+
+	void Fail(const std::string &workerErrStr)
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		if(!this->failed)
+		{
+			this->failed = true;
+			this->errStr = workerErrStr;
+		}
+	}
+
+	//Returns true if every worker succeeded
+	bool Finished(bool ok, const std::string &workerErrStr)
+	{
+		if(!ok)
+			Fail(workerErrStr);
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->remaining --;
+		this->changed.notify_all();
+		while(this->remaining > 0)
+			this->changed.wait(lock);
+		return !this->failed;
+	}
+};
+template<class T> static void PartitionObjects(const std::vector<T> &objs, int numPartitions, 
+	std::vector<class OsmData> &partitions, std::vector<T> OsmData::*member)
+{
+	//Objects are in id order, so each partition is a contiguous id range
+	size_t partitionSize = (objs.size() + numPartitions - 1) / numPartitions;
+	for(size_t i=0; i<objs.size(); i++)
+		(partitions[i / partitionSize].*member).push_back(objs[i]);
+}
+
+static void StoreObjectsWorker(const std::string &connectionString,
+	const std::string &tableModPrefix, 
+	const class OsmData *partition,
+	const std::string &gid,
+	class DbStoreBarrier *barrier)
+{
+	std::shared_ptr<pqxx::connection> c;
+	std::shared_ptr<pqxx::nontransaction> work;
+	string errStr;
+	bool ok = false, prepared = false;
+	try
+	{
+		//The transaction is managed here so it can be prepared for a two phase commit
+		c.reset(new pqxx::connection(connectionString));
+		work.reset(new pqxx::nontransaction(*c));
+		work->exec("BEGIN;");
+		std::map<int64_t, int64_t> createdNodeIds, createdWayIds, createdRelationIds;
+		ok = ::StoreObjects(*c, work.get(), tableModPrefix, *partition, 
+			createdNodeIds, createdWayIds, createdRelationIds, errStr);
+		if(ok)
+		{
+			work->exec("PREPARE TRANSACTION "+c->quote(gid)+";");
+			prepared = true;
+		}
+	}
+	catch (const std::exception &e)
+	{
+		errStr = e.what();
+		ok = false;
+	}
+
+	bool allOk = barrier->Finished(ok, errStr);
+	if(!work)
+		return;
+	try
+	{
+		if(allOk)
+			work->exec("COMMIT PREPARED "+c->quote(gid)+";");
+		else if(prepared)
+			work->exec("ROLLBACK PREPARED "+c->quote(gid)+";");
+		else
+			work->exec("ROLLBACK;");
+	}
+	catch (const std::exception &e)
+	{
+		//A prepared transaction survives the connection, so it can still be finished by hand
+		barrier->Fail(string(e.what()) + " (prepared transaction " + gid + ")");
+	}
+}
+
+bool DbStoreObjectsParallel(const std::string &connectionString,
+	const std::string &tableModPrefix, 
+	const class OsmData &data,
+	int numConnections,
+	std::string &errStr)
+{
+	if(numConnections < 1)
+		numConnections = 1;
+	std::vector<class OsmData> partitions(numConnections);
+	PartitionObjects(data.nodes, numConnections, partitions, &OsmData::nodes);
+	PartitionObjects(data.ways, numConnections, partitions, &OsmData::ways);
+	PartitionObjects(data.relations, numConnections, partitions, &OsmData::relations);
+
+	//Transaction ids must be unique across the server while prepared
+	std::vector<std::string> gids;
+	for(int i=0; i<numConnections; i++)
+	{
+		stringstream ss;
+		ss << "pgmap_store_" << getpid() << "_" << time(nullptr) << "_" << i;
+		gids.push_back(ss.str());
+	}
+
+	class DbStoreBarrier barrier(numConnections);
+	std::vector<std::thread> workers;
+	for(int i=0; i<numConnections; i++)
+		workers.push_back(std::thread(StoreObjectsWorker, connectionString, tableModPrefix, &partitions[i], 
+			std::cref(gids[i]), &barrier));
+	for(size_t i=0; i<workers.size(); i++)
+		workers[i].join();
+
+	errStr = barrier.errStr;
+	return !barrier.failed;
+}
+
 size_t DbCheckWaysFromCursor(pqxx::connection &c, pqxx::transaction_base *work, 
 	const string &tablePrefix, 
 	const string &excludeTablePrefix, 
@@ -3,7 +3,9 @@
 
 #include <pqxx/pqxx> //apt install libpqxx-dev
 #include <string>
+#include <map>
 #include "pgcommon.h"
+#include "dbparallel.h"
 
 bool ResetActiveTables(pqxx::connection &c, pqxx::transaction_base *work, 
 	const std::string &tableActivePrefix, 
@@ -16,10 +18,12 @@ bool DbSetSchemaVersion(pqxx::connection &c, pqxx::transaction_base *work,
 	const std::string &tablePrefix, 
 	int targetVer, bool latest, std::string &errStr);
 
+//Loads the files written by osm2csv, which are either csv or PostgreSQL binary COPY format
 bool DbCopyData(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const std::string &filePrefix,
 	const std::string &tablePrefix, 
+	bool binaryFormat,
 	std::string &errStr);
 
 bool DbCreateIndices(pqxx::connection &c, pqxx::transaction_base *work, 
@@ -27,6 +31,18 @@ bool DbCreateIndices(pqxx::connection &c, pqxx::transaction_base *work,
 	const std::string &tablePrefix, 
 	std::string &errStr);
 
+//These build the steps used by DbCopyData and DbCreateIndices, so they can be run in parallel.
+//Index steps depend on the "copy <table>" and "pk <table>" steps of the indexed table.
+void DbCopyDataSteps(pqxx::connection &c, 
+	const std::string &filePrefix,
+	const std::string &tablePrefix, 
+	bool binaryFormat,
+	std::vector<class DbParallelStep> &stepsOut);
+
+void DbCreateIndicesSteps(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix, 
+	std::vector<class DbParallelStep> &stepsOut);
+
 bool DbRefreshMaxIds(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const std::string &tableStaticPrefix, 
@@ -48,13 +64,85 @@ bool DbGenerateUsernameTable(pqxx::connection &c, pqxx::transaction_base *work,
 	const std::string &tableTestPrefix, 
 	std::string &errStr);
 
+//Stores one block of a diff in the active tables and updates the bboxes of the affected ways and relations.
+//If expiry is set, the old and new envelopes of changed objects and their parents are added to it.
+//Returns false if the objects could not be stored, in which case the transaction should be aborted.
+bool DbApplyDiffBlock(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tableModPrefix, 
+	const std::string &action,
+	class OsmData &block,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	class TileExpiry *expiry = nullptr);
+
+//Applies a .osc.gz file. If maxObjects is more than zero, the file is decoded incrementally and 
+//applied in blocks of at most maxObjects objects, otherwise it is decoded in one step.
+//If maxIds is set, it is raised to the highest id of each object type in the file.
+bool DbApplyDiffFile(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tableModPrefix, 
+	const std::string &fina, 
+	size_t maxObjects,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	std::map<std::string, int64_t> *maxIds = nullptr,
+	class TileExpiry *expiry = nullptr,
+	int verbose = 0);
+
+//Makes sure the next ids of tablePrefix are above the given maximum id of each object type
+bool DbRaiseNextIds(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix, 
+	const std::map<std::string, int64_t> &maxIds,
+	std::string &errStr);
+
 bool DbApplyDiffs(pqxx::connection &c, pqxx::transaction_base *work, 
 	int verbose, 
 	const std::string &tableStaticPrefix, 
 	const std::string &tableModPrefix, 
 	const std::string &tableTestPrefix, 
 	const std::string &diffPath, 
+	size_t maxObjects,
 	class PgCommon *pgCommon,
+	std::string &errStr,
+	class TileExpiry *expiry = nullptr);
+
+//Lists the .gz files under diffPath in sorted order, recursing into directories
+void DbListDiffFiles(const std::string &diffPath, std::vector<std::string> &out);
+
+//Name of a listed diff file relative to diffPath (e.g. 004/123/456.osc.gz), which does not change 
+//if the diffs are moved
+std::string DbDiffRelativePath(const std::string &diffPath, const std::string &fina);
+
+//Applies a list of diff files in order, in blocks of at most maxObjects objects. Up to 
+//prefetchBlocks later blocks (from at most that many later files) are decompressed and decoded 
+//on numThreads background threads. If maxIds is set, it is raised to the highest id of each 
+//object type in the files.
+bool DbApplyDiffsPipelined(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const std::string &tableModPrefix, 
+	const std::vector<std::string> &filenames, 
+	size_t maxObjects,
+	size_t prefetchBlocks,
+	int numThreads,
+	class PgCommon *pgCommon,
+	std::string &errStr,
+	std::map<std::string, int64_t> *maxIds = nullptr,
+	class TileExpiry *expiry = nullptr);
+
+//Decodes a list of diffs and keeps the latest version of each object, in id order. 
+//Objects deleted by a diff have their visible flag cleared.
+bool DbCollapseDiffs(const std::vector<std::string> &filenames, 
+	size_t prefetchFiles,
+	int numThreads,
+	class OsmData &out,
+	std::string &errStr);
+
+//Stores objects over numConnections new connections, each given a contiguous id range of each
+//object type. Each connection prepares its transaction (which needs max_prepared_transactions 
+//to be at least numConnections) and they only commit once every partition has been prepared.
+bool DbStoreObjectsParallel(const std::string &connectionString,
+	const std::string &tableModPrefix, 
+	const class OsmData &data,
+	int numConnections,
 	std::string &errStr);
 
 void DbCheckNodesExistForAllWays(pqxx::connection &c, pqxx::transaction_base *work, 
@@ -88,5 +176,16 @@ bool DbDropBboxIndices(pqxx::connection &c, pqxx::transaction_base *work,
 	const std::string &tablePrefix, 
 	std::string &errStr);
 
+//GIN jsonb_path_ops indices on the tags of live objects, used by tag=value queries
+bool DbCreateTagIndices(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const std::string &tablePrefix, 
+	std::string &errStr);
+
+bool DbDropTagIndices(pqxx::connection &c, pqxx::transaction_base *work, 
+	int verbose, 
+	const std::string &tablePrefix, 
+	std::string &errStr);
+
 #endif //_DB_ADMIN_H
 
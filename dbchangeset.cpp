@@ -4,6 +4,14 @@
 #include "dbcommon.h"
 #include "dbdecode.h"
 #include "dbjson.h"
+#include "dbreplicate.h"
+#include "osmchangestream.h"
+#include "cppGzip/EncodeGzip.h"
+#include "cppGzip/DecodeGzip.h"
+#include <fstream>
+#include <boost/filesystem.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
 extern "C" {
 #include "cppo5m/iso8601lib/iso8601.h"
 }
@@ -241,6 +249,187 @@ bool GetAllRelationsByChangeset(pqxx::connection &c, pqxx::transaction_base *wor
 
 // ***********************************************
 
+//Sorts objects into created, modified and deleted as they are decoded
+class ChangesetClassify : public IDataStreamHandler
+{
+public:
+	class OsmData created, modified, deleted;
+
+	ChangesetClassify() {};
+	virtual ~ChangesetClassify() {};
+
+	class OsmData &Target(const class MetaData &metaData)
+	{
+		if(metaData.version == 1)
+			return created;
+		if(metaData.visible)
+			return modified;
+		return deleted;
+	}
+
+	bool StoreIsDiff(bool) {return false;};
+	bool StoreBounds(double x1, double y1, double x2, double y2) {return false;};
+	bool StoreNode(int64_t objId, const class MetaData &metaData, 
+		const TagMap &tags, double lat, double lon)
+	{
+		return Target(metaData).StoreNode(objId, metaData, tags, lat, lon);
+	}
+	bool StoreWay(int64_t objId, const class MetaData &metaData, 
+		const TagMap &tags, const std::vector<int64_t> &refs)
+	{
+		return Target(metaData).StoreWay(objId, metaData, tags, refs);
+	}
+	bool StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags, 
+		const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds, 
+		const std::vector<std::string> &refRoles)
+	{
+		return Target(metaData).StoreRelation(objId, metaData, tags, refTypeStrs, refIds, refRoles);
+	}
+};
+
+//Passes each block to two outputs
+class OsmChangeBlockTee : public IOsmChangeBlock
+{
+public:
+	IOsmChangeBlock &out1, &out2;
+
+	OsmChangeBlockTee(IOsmChangeBlock &out1, IOsmChangeBlock &out2): out1(out1), out2(out2) {};
+	virtual ~OsmChangeBlockTee() {};
+
+	virtual void StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused)
+	{
+		out1.StoreOsmData(action, osmData, ifunused);
+		out2.StoreOsmData(action, osmData, ifunused);
+	}
+};
+
+//Selects every version of one object type in the changeset from the old and live tables 
+//of both table sets, with the same columns in each part of the union
+static string ChangesetObjectsSql(pqxx::connection &c, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType, int64_t changesetId)
+{
+	string cols = "id, changeset, username, uid, timestamp, version, tags";
+	if(objType == "node")
+		cols += ", ST_X(geom) AS lon, ST_Y(geom) AS lat";
+	else if(objType == "way")
+		cols += ", members";
+	else
+		cols += ", members, memberroles";
+
+	const string prefixes[2] = {tableStaticPrefix, tableActivePrefix};
+	stringstream sql;
+	for(int i=0; i<2; i++)
+	{
+		if(i > 0)
+			sql << " UNION ALL ";
+		sql << "SELECT "<<cols<<", visible FROM "<<c.quote_name(prefixes[i]+"old"+objType+"s");
+		sql << " WHERE changeset = " << changesetId;
+		sql << " UNION ALL SELECT "<<cols<<", TRUE AS visible FROM "<<c.quote_name(prefixes[i]+"live"+objType+"s");
+		sql << " WHERE changeset = " << changesetId;
+	}
+	sql << ";";
+	return sql.str();
+}
+
+void GetChangesetOsmChangeFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int64_t changesetId,
+	class IOsmChangeBlock &out)
+{
+	std::shared_ptr<class ChangesetClassify> classify(new class ChangesetClassify());
+
+	pqxx::icursorstream nodeCursor( *work, ChangesetObjectsSql(c, tableStaticPrefix, tableActivePrefix, 
+		"node", changesetId), "nodesbychangeset", 1000 );
+	int count = 1;
+	while(count > 0)
+		count = NodeResultsToEncoder(nodeCursor, usernames, classify);
+
+	pqxx::icursorstream wayCursor( *work, ChangesetObjectsSql(c, tableStaticPrefix, tableActivePrefix, 
+		"way", changesetId), "waysbychangeset", 1000 );
+	count = 1;
+	while(count > 0)
+		count = WayResultsToEncoder(wayCursor, usernames, classify);
+
+	pqxx::icursorstream relCursor( *work, ChangesetObjectsSql(c, tableStaticPrefix, tableActivePrefix, 
+		"relation", changesetId), "relationsbychangeset", 1000 );
+	set<int64_t> emptySkipIds;
+	RelationResultsToEncoder(relCursor, usernames, emptySkipIds, classify);
+
+	if(!classify->created.IsEmpty())
+		out.StoreOsmData("create", classify->created, false);
+	if(!classify->modified.IsEmpty())
+		out.StoreOsmData("modify", classify->modified, false);
+	if(!classify->deleted.IsEmpty())
+		out.StoreOsmData("delete", classify->deleted, false);
+}
+
+void GetChangesetOsmChangeCached(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int64_t changesetId,
+	const std::string &cachePath,
+	class IOsmChangeBlock &out)
+{
+	string fina = ReplicateSequencePath(cachePath, changesetId) + ".osc.gz";
+	if(boost::filesystem::exists(fina))
+	{
+		//Decode the whole file before passing anything on, so a damaged file is treated as a miss
+		class OsmChange cached;
+		bool cacheOk = true;
+		try
+		{
+			DecodeOsmChangeFile(fina, cached);
+		}
+		catch (const std::exception &e)
+		{
+			cacheOk = false;
+		}
+		if(cacheOk)
+		{
+			for(size_t i=0; i<cached.blocks.size(); i++)
+				out.StoreOsmData(cached.actions[i], cached.blocks[i], cached.ifunused[i]);
+			return;
+		}
+		boost::system::error_code ec;
+		boost::filesystem::remove(fina, ec);
+	}
+
+	//Write the cache file while passing the blocks on, and only keep it once it is complete. The 
+	//temporary name is unique, so concurrent requests for the same changeset don't share a file.
+	boost::filesystem::create_directories(boost::filesystem::path(fina).parent_path());
+	string tmpFina = boost::filesystem::unique_path(fina + ".%%%%-%%%%-%%%%.tmp").native();
+	try
+	{
+		std::filebuf outfi;
+		if(outfi.open(tmpFina, std::ios::out | std::ios::binary) == nullptr)
+			throw runtime_error("Failed to open "+tmpFina);
+		class EncodeGzip gzipEnc(outfi);
+		{
+			class OsmChangeXmlEncode enc(gzipEnc, false);
+			class OsmChangeBlockTee tee(out, enc);
+			GetChangesetOsmChangeFromDb(c, work, usernames, tableStaticPrefix, tableActivePrefix, 
+				changesetId, tee);
+		}
+	}
+	catch (const std::exception &e)
+	{
+		boost::system::error_code ec;
+		boost::filesystem::remove(tmpFina, ec);
+		throw;
+	}
+	boost::system::error_code ec;
+	boost::filesystem::rename(tmpFina, fina, ec);
+	if(ec)
+		boost::filesystem::remove(tmpFina, ec);
+}
+
+// ***********************************************
+
 int GetChangesetFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
 	class DbUsernameLookup &usernames,
@@ -318,6 +507,76 @@ bool GetChangesetsFromDb(pqxx::connection &c, pqxx::transaction_base *work,
 	return true;
 }
 
+//Changesets are listed in descending order of this key, then id. Open changesets have a close 
+//timestamp of zero (or NULL) and sort first. This must match the changesets_close_idx index.
+static string ChangesetSortKeySql(const string &table)
+{
+	return "COALESCE(NULLIF("+table+".close_timestamp, 0), 9223372036854775807)";
+}
+
+int64_t ChangesetSortKey(const class PgChangeset &changeset)
+{
+	if(changeset.close_timestamp == 0)
+		return INT64_MAX;
+	return changeset.close_timestamp;
+}
+
+bool GetChangesetsPageFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	const std::string &excludePrefix,
+	class DbUsernameLookup &usernames,
+	const class PgChangesetFilter &filter,
+	size_t pageSize,
+	int64_t afterCloseKey, int64_t afterId,
+	std::vector<class PgChangeset> &changesetOut,
+	std::string &errStr)
+{
+	string changesetTable = c.quote_name(tablePrefix + "changesets");
+	string excludeTable;
+	if(excludePrefix.size() > 0)
+		excludeTable = c.quote_name(excludePrefix + "changesets");
+	string sortKey = ChangesetSortKeySql(changesetTable);
+	if(filter.bbox.size() != 0 && filter.bbox.size() != 4)
+	{
+		errStr = "Bbox has wrong length";
+		return false;
+	}
+
+	stringstream sql;
+	sql.precision(9);
+	sql << "SELECT "<<changesetTable<<".*, ST_XMin("<<changesetTable<<".geom) as xmin, ST_XMax("<<changesetTable<<".geom) as xmax,";
+	sql << " ST_YMin("<<changesetTable<<".geom) as ymin, ST_YMax("<<changesetTable<<".geom) as ymax";
+	sql << " FROM " << changesetTable;
+	if(excludeTable.size() > 0)
+		sql << " LEFT JOIN " << excludeTable << " ON " << changesetTable <<".id = " << excludeTable << ".id";
+	sql << " WHERE TRUE"; 
+	if(excludeTable.size() > 0)
+		sql << " AND " << excludeTable << ".id IS NULL";
+	if(filter.user_uid != 0)
+		sql << " AND " << changesetTable << ".uid=" << filter.user_uid;
+	if(filter.is_open_only)
+		sql << " AND "<<changesetTable<<".is_open=TRUE";
+	if(filter.is_closed_only)
+		sql << " AND "<<changesetTable<<".is_open=FALSE";
+	if(filter.openedBeforeTimestamp != -1)
+		sql << " AND "<<changesetTable<<".open_timestamp<" << filter.openedBeforeTimestamp;
+	if(filter.closedAfterTimestamp != -1)
+		sql << " AND "<<changesetTable<<".close_timestamp>" << filter.closedAfterTimestamp;
+	if(filter.bbox.size() == 4)
+		sql << fixed << " AND "<<changesetTable<<".geom && ST_MakeEnvelope(" << filter.bbox[0] << "," 
+			<< filter.bbox[1] << "," << filter.bbox[2] << "," << filter.bbox[3] << ", 4326)";
+	if(afterId > 0)
+		sql << " AND ("<<sortKey<<", "<<changesetTable<<".id) < (" << afterCloseKey << ", " << afterId << ")";
+
+	sql << " ORDER BY "<<sortKey<<" DESC, "<<changesetTable<<".id DESC";
+	sql << " LIMIT " << pageSize << ";";
+
+	pqxx::result r = work->exec(sql.str());
+
+	DecodeRowsToChangesets(r, usernames, changesetOut);
+	return true;
+}
+
 bool InsertChangesetInDb(pqxx::connection &c, 
 	pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
@@ -488,6 +747,37 @@ int DbExpandChangesetBbox(pqxx::connection &c,
 	return rowsAffected;
 }
 
+bool DbExpandChangesetBboxFromObjects(pqxx::connection &c, 
+	pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	int64_t cid,
+	int64_t openedBefore,
+	std::string &errStr)
+{
+	string changesetTable = c.quote_name(tablePrefix+"changesets");
+
+	//Live objects are indexed by changeset. Versions already replaced are in the old tables,
+	//which have no changeset index, so they are not included.
+	stringstream extent;
+	extent << "(SELECT ST_Envelope(ST_Collect(g)) FROM (";
+	extent << "SELECT geom AS g FROM "<<c.quote_name(tablePrefix+"livenodes")<<" WHERE changeset = cs2.id";
+	extent << " UNION ALL SELECT bbox FROM "<<c.quote_name(tablePrefix+"liveways")<<" WHERE changeset = cs2.id";
+	extent << " UNION ALL SELECT bbox FROM "<<c.quote_name(tablePrefix+"liverelations")<<" WHERE changeset = cs2.id";
+	extent << ") AS objs)";
+
+	stringstream ss;
+	ss << "UPDATE "<<changesetTable<<" AS cs SET geom=";
+	ss << "CASE ST_IsValid(cs.geom) WHEN TRUE THEN ST_MakeValid(ST_Envelope(ST_Collect(ext.extent, cs.geom))) ELSE ST_MakeValid(ext.extent) END";
+	ss << " FROM (SELECT cs2.id, "<<extent.str()<<" AS extent FROM "<<changesetTable<<" AS cs2";
+	if(cid != 0)
+		ss << " WHERE cs2.id = " << cid;
+	else
+		ss << " WHERE cs2.is_open=true AND cs2.open_timestamp<" << openedBefore;
+	ss << ") AS ext WHERE cs.id = ext.id AND ext.extent IS NOT NULL;";
+
+	return DbExec(work, ss.str(), errStr);
+}
+
 bool CloseChangesetInDb(pqxx::connection &c, 
 	pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
@@ -715,6 +1005,11 @@ void OsmChangesetsDecodeString::StartElement(const XML_Char *name, const XML_Cha
 	}
 }
 
+void OsmChangesetsDecodeString::StoreChangeset(const class PgChangeset &changeset)
+{
+	this->outChangesets.push_back(changeset);
+}
+
 void OsmChangesetsDecodeString::EndElement(const XML_Char *name)
 {
 	//cout << this->xmlDepth << " endel " << name << endl;
@@ -722,7 +1017,7 @@ void OsmChangesetsDecodeString::EndElement(const XML_Char *name)
 	if(this->xmlDepth == 2)
 	{
 		this->currentChangeset.tags = this->currentTags;
-		this->outChangesets.push_back(this->currentChangeset);
+		this->StoreChangeset(this->currentChangeset);
 
 		class PgChangeset emptyChangeset;
 		this->currentChangeset = emptyChangeset;
@@ -765,4 +1060,93 @@ void OsmChangesetsDecodeString::XmlAttsToMap(const XML_Char **atts, std::map<std
 	}
 }
 
+// **********************************************
+
+bool DecodeChangesetsFile(const std::string &fina, class OsmChangesetsDecodeString &decoder, 
+	std::string &errStr)
+{
+	std::filebuf fi;
+	if(fi.open(fina, std::ios::in | std::ios::binary) == nullptr)
+	{
+		errStr = "Error reading file";
+		return false;
+	}
+
+	std::shared_ptr<std::streambuf> decompressor;
+	std::streambuf *in = &fi;
+	string ext = boost::filesystem::extension(fina);
+	if(ext == ".gz")
+	{
+		decompressor.reset(new class DecodeGzip(fi));
+		in = decompressor.get();
+	}
+	else if(ext == ".bz2")
+	{
+		boost::iostreams::filtering_istreambuf *bz2 = new boost::iostreams::filtering_istreambuf();
+		bz2->push(boost::iostreams::bzip2_decompressor());
+		bz2->push(fi);
+		decompressor.reset(bz2);
+		in = bz2;
+	}
+
+	std::vector<char> buff(65536);
+	bool done = false;
+	while(!done)
+	{
+		std::streamsize len = in->sgetn(&buff[0], buff.size());
+		done = len < (std::streamsize)buff.size();
+		decoder.DecodeSubString(&buff[0], len, done);
+		if(decoder.errString.size() > 0)
+		{
+			errStr = decoder.errString;
+			return false;
+		}
+	}
+	if(!decoder.parseCompletedOk)
+	{
+		errStr = "Changeset file was not completely decoded";
+		return false;
+	}
+	return true;
+}
+
+//Writes each changeset to the database as soon as it is decoded
+class OsmChangesetsUpsert : public OsmChangesetsDecodeString
+{
+public:
+	pqxx::connection &c;
+	pqxx::transaction_base *work;
+	std::string tablePrefix;
+	int64_t count;
+
+	OsmChangesetsUpsert(pqxx::connection &c, pqxx::transaction_base *work, const std::string &tablePrefix):
+		c(c), work(work), tablePrefix(tablePrefix), count(0) {};
+	virtual ~OsmChangesetsUpsert() {};
 
+	virtual void StoreChangeset(const class PgChangeset &changeset)
+	{
+		if(errString.size() > 0)
+			return;
+		string nativeErrStr;
+		bool ok = true;
+		int rowsAffected = UpdateChangesetInDb(c, work, tablePrefix, changeset, nativeErrStr);
+		if(rowsAffected==0)
+			ok = InsertChangesetInDb(c, work, tablePrefix, changeset, nativeErrStr);
+		if(!ok)
+			errString = nativeErrStr;
+		else
+			count ++;
+	}
+};
+
+bool DbImportChangesets(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	const std::string &fina,
+	int64_t &countOut,
+	std::string &errStr)
+{
+	class OsmChangesetsUpsert decoder(c, work, tablePrefix);
+	bool ok = DecodeChangesetsFile(fina, decoder, errStr);
+	countOut = decoder.count;
+	return ok;
+}
@@ -23,6 +23,25 @@ bool GetAllRelationsByChangeset(pqxx::connection &c, pqxx::transaction_base *wor
 	int64_t changesetId,
 	std::shared_ptr<IDataStreamHandler> enc);
 
+//Gets every version of objects in the changeset with one query per object type, sorted into
+//create, modify and delete blocks as the rows are decoded
+void GetChangesetOsmChangeFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int64_t changesetId,
+	class IOsmChangeBlock &out);
+
+//As GetChangesetOsmChangeFromDb, but reads the osmChange from cachePath/NNN/NNN/NNN.osc.gz if it
+//exists, otherwise it is written there. Only use for closed changesets.
+void GetChangesetOsmChangeCached(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int64_t changesetId,
+	const std::string &cachePath,
+	class IOsmChangeBlock &out);
+
 int GetChangesetFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
 	class DbUsernameLookup &usernames,
@@ -43,6 +62,22 @@ bool GetChangesetsFromDb(pqxx::connection &c, pqxx::transaction_base *work,
 	std::vector<class PgChangeset> &changesetOut,
 	std::string &errStr);
 
+//Key used with the id to page through changesets, the close timestamp or the maximum value if it 
+//is zero, as in ChangesetSortKeySql
+int64_t ChangesetSortKey(const class PgChangeset &changeset);
+
+//Gets up to pageSize changesets that match the filter and come after (afterCloseKey, afterId) in 
+//descending (close timestamp, id) order. If afterId is zero, starts from the first changeset.
+bool GetChangesetsPageFromDb(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	const std::string &excludePrefix,
+	class DbUsernameLookup &usernames,
+	const class PgChangesetFilter &filter,
+	size_t pageSize,
+	int64_t afterCloseKey, int64_t afterId,
+	std::vector<class PgChangeset> &changesetOut,
+	std::string &errStr);
+
 bool InsertChangesetInDb(pqxx::connection &c, 
 	pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
@@ -62,6 +97,16 @@ int DbExpandChangesetBbox(pqxx::connection &c,
 	const std::vector<double> &bbox,
 	std::string &errStr);
 
+//Expands the bbox of changeset cid, or if cid is zero of every open changeset opened before 
+//openedBefore, to cover the objects in the live tables that were last changed by it. This recovers 
+//envelopes that were held in memory by a process that ended before writing them.
+bool DbExpandChangesetBboxFromObjects(pqxx::connection &c, 
+	pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	int64_t cid,
+	int64_t openedBefore,
+	std::string &errStr);
+
 bool CloseChangesetInDb(pqxx::connection &c, 
 	pqxx::transaction_base *work, 
 	const std::string &tablePrefix,
@@ -107,10 +152,25 @@ public:
 	OsmChangesetsDecodeString();
 	virtual ~OsmChangesetsDecodeString();
 	
+	//Called for each decoded changeset. By default, it is added to outChangesets.
+	virtual void StoreChangeset(const class PgChangeset &changeset);
+
 	void StartElement(const XML_Char *name, const XML_Char **atts);
 	void EndElement(const XML_Char *name);
 	bool DecodeSubString(const char *xml, size_t len, bool done);
 	void XmlAttsToMap(const XML_Char **atts, std::map<std::string, std::string> &attribs);
 };
 
+//Decodes a changesets file (.osm, .osm.gz or .osm.bz2) in chunks, so it does not need to fit in memory.
+//Stops early if the decoder's errString is set.
+bool DecodeChangesetsFile(const std::string &fina, class OsmChangesetsDecodeString &decoder, 
+	std::string &errStr);
+
+//Inserts or updates each changeset in a file as it is decoded
+bool DbImportChangesets(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix,
+	const std::string &fina,
+	int64_t &countOut,
+	std::string &errStr);
+
 #endif //_DB_CHANGESET_H
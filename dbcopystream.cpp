@@ -0,0 +1,469 @@
+#include "dbcopystream.h"
+#include "copyrow.h"
+#include "dbjson.h"
+#include "dbchangeset.h"
+#include "util.h"
+#include "cppGzip/DecodeGzip.h"
+#include <iostream>
+#include <fstream>
+#include <sstream>
+using namespace std;
+
+// **********************************************
+
+DbCopyStreamTable::DbCopyStreamTable(const std::string &connectionString, const std::string &tableName,
+		size_t batchSize, size_t maxQueuedBatches):
+	connectionString(connectionString),
+	tableName(tableName),
+	batchSize(batchSize),
+	maxQueuedBatches(maxQueuedBatches),
+	inputDone(false),
+	failed(false),
+	rowCount(0)
+{
+	batch.reset(new std::vector<std::string>());
+	batch->reserve(batchSize);
+	thread = std::thread(&DbCopyStreamTable::Run, this);
+}
+
+DbCopyStreamTable::~DbCopyStreamTable()
+{
+	if(thread.joinable())
+	{
+		string ignored;
+		Complete(ignored);
+	}
+}
+
+void DbCopyStreamTable::Run()
+{
+	try
+	{
+		pqxx::connection c(this->connectionString);
+		pqxx::work work(c);
+		pqxx::tablewriter writer(work, this->tableName);
+
+		while(true)
+		{
+			std::shared_ptr<std::vector<std::string> > rows;
+			{
+				std::unique_lock<std::mutex> lock(this->mtx);
+				while(this->queue.size() == 0 && !this->inputDone)
+					this->queueChanged.wait(lock);
+				if(this->failed)
+					return; //Aborted, so the work is rolled back
+				if(this->queue.size() == 0)
+					break;
+				rows = this->queue.front();
+				this->queue.pop_front();
+			}
+			this->queueChanged.notify_all();
+
+			for(size_t i=0; i<rows->size(); i++)
+				writer.write_raw_line((*rows)[i]);
+		}
+
+		writer.complete();
+		work.commit();
+	}
+	catch (const std::exception &e)
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->failed = true;
+		this->errStr = this->tableName + ": " + e.what();
+		this->queue.clear();
+		lock.unlock();
+		this->queueChanged.notify_all();
+	}
+}
+
+void DbCopyStreamTable::PushBatch()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(this->queue.size() >= this->maxQueuedBatches && !this->failed)
+		this->queueChanged.wait(lock);
+	if(!this->failed)
+		this->queue.push_back(this->batch);
+	lock.unlock();
+	this->queueChanged.notify_all();
+
+	this->batch.reset(new std::vector<std::string>());
+	this->batch->reserve(this->batchSize);
+}
+
+void DbCopyStreamTable::AddRow(const std::string &row)
+{
+	this->batch->push_back(row);
+	this->rowCount ++;
+	if(this->batch->size() >= this->batchSize)
+		PushBatch();
+}
+
+void DbCopyStreamTable::Abort()
+{
+	if(!thread.joinable())
+		return;
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		if(!this->failed)
+		{
+			this->failed = true;
+			this->errStr = this->tableName + ": aborted";
+		}
+		this->queue.clear();
+		this->inputDone = true;
+	}
+	this->queueChanged.notify_all();
+	thread.join();
+}
+
+bool DbCopyStreamTable::HasFailed(std::string &errStrOut)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	errStrOut = this->errStr;
+	return this->failed;
+}
+
+bool DbCopyStreamTable::Complete(std::string &errStrOut)
+{
+	if(!thread.joinable())
+	{
+		errStrOut = this->errStr;
+		return !this->failed;
+	}
+
+	if(this->batch->size() > 0)
+		PushBatch();
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->inputDone = true;
+	}
+	this->queueChanged.notify_all();
+	thread.join();
+
+	errStrOut = this->errStr;
+	return !this->failed;
+}
+
+// **********************************************
+
+DataStreamCopyTables::DataStreamCopyTables(const std::string &connectionString, const std::string &tablePrefix, int verbose):
+	verbose(verbose),
+	finished(false),
+	ok(true)
+{
+	livenodes = AddTable(connectionString, tablePrefix+"livenodes");
+	liveways = AddTable(connectionString, tablePrefix+"liveways");
+	liverelations = AddTable(connectionString, tablePrefix+"liverelations");
+	oldnodes = AddTable(connectionString, tablePrefix+"oldnodes");
+	oldways = AddTable(connectionString, tablePrefix+"oldways");
+	oldrelations = AddTable(connectionString, tablePrefix+"oldrelations");
+
+	nodeids = AddTable(connectionString, tablePrefix+"nodeids");
+	wayids = AddTable(connectionString, tablePrefix+"wayids");
+	relationids = AddTable(connectionString, tablePrefix+"relationids");
+
+	waymems = AddTable(connectionString, tablePrefix+"way_mems");
+	relationmemsn = AddTable(connectionString, tablePrefix+"relation_mems_n");
+	relationmemsw = AddTable(connectionString, tablePrefix+"relation_mems_w");
+	relationmemsr = AddTable(connectionString, tablePrefix+"relation_mems_r");
+}
+
+DataStreamCopyTables::~DataStreamCopyTables()
+{
+	Finish();
+}
+
+std::shared_ptr<class DbCopyStreamTable> DataStreamCopyTables::AddTable(const std::string &connectionString, const std::string &tableName)
+{
+	std::shared_ptr<class DbCopyStreamTable> table(new class DbCopyStreamTable(connectionString, tableName, 10000, 8));
+	tables.push_back(table);
+	return table;
+}
+
+bool DataStreamCopyTables::Finish()
+{
+	if(this->finished)
+		return this->ok;
+
+	//Don't commit anything if a table has already failed
+	for(size_t i=0; i<tables.size(); i++)
+	{
+		string tableErr;
+		if(tables[i]->HasFailed(tableErr))
+		{
+			this->errStr = tableErr;
+			Abort();
+			return false;
+		}
+	}
+	this->finished = true;
+
+	for(size_t i=0; i<tables.size(); i++)
+	{
+		string tableErr;
+		bool tableOk = tables[i]->Complete(tableErr);
+		if(!tableOk)
+		{
+			this->ok = false;
+			this->errStr = tableErr;
+			for(size_t j=i+1; j<tables.size(); j++)
+				tables[j]->Abort();
+			break;
+		}
+	}
+
+	if(verbose >= 1)
+	{
+		cout << "Nodes: " << livenodes->rowCount << " live, " << oldnodes->rowCount << " old" << endl;
+		cout << "Ways: " << liveways->rowCount << " live, " << oldways->rowCount << " old" << endl;
+		cout << "Relations: " << liverelations->rowCount << " live, " << oldrelations->rowCount << " old" << endl;
+	}
+	return this->ok;
+}
+
+void DataStreamCopyTables::Abort()
+{
+	this->finished = true;
+	this->ok = false;
+	for(size_t i=0; i<tables.size(); i++)
+		tables[i]->Abort();
+	if(this->errStr.size() == 0)
+		this->errStr = "Aborted";
+}
+
+bool DataStreamCopyTables::StoreNode(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, double lat, double lon)
+{
+	bool live = metaData.current and metaData.visible;
+
+	class CopyTextRow row;
+	string line;
+	CopyRowNode(row, objId, metaData, live, tags, lat, lon);
+	row.EndRow(line);
+	if(live)
+		livenodes->AddRow(line);
+	else
+		oldnodes->AddRow(line);
+
+	AddIdRow(*nodeids, objId);
+	return false;
+}
+
+bool DataStreamCopyTables::StoreWay(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, const std::vector<int64_t> &refs)
+{
+	bool live = metaData.current and metaData.visible;
+
+	class CopyTextRow row;
+	string line;
+	CopyRowWay(row, objId, metaData, live, tags, refs);
+	row.EndRow(line);
+	if(live)
+		liveways->AddRow(line);
+	else
+		oldways->AddRow(line);
+
+	AddIdRow(*wayids, objId);
+
+	for(size_t i=0; i<refs.size(); i++)
+		AddMemberRow(*waymems, objId, metaData.version, i, refs[i]);
+	return false;
+}
+
+bool DataStreamCopyTables::StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+	const std::vector<std::string> &refRoles)
+{
+	bool live = metaData.current and metaData.visible;
+
+	class CopyTextRow row;
+	string line;
+	CopyRowRelation(row, objId, metaData, live, tags, refTypeStrs, refIds, refRoles);
+	row.EndRow(line);
+	if(live)
+		liverelations->AddRow(line);
+	else
+		oldrelations->AddRow(line);
+
+	AddIdRow(*relationids, objId);
+
+	for(size_t i=0; i<refIds.size(); i++)
+	{
+		const std::string &refTypeStr = refTypeStrs[i];
+		if(refTypeStr == "node")
+			AddMemberRow(*relationmemsn, objId, metaData.version, i, refIds[i]);
+		else if(refTypeStr == "way")
+			AddMemberRow(*relationmemsw, objId, metaData.version, i, refIds[i]);
+		else if(refTypeStr == "relation")
+			AddMemberRow(*relationmemsr, objId, metaData.version, i, refIds[i]);
+	}
+	return false;
+}
+
+void DataStreamCopyTables::AddIdRow(class DbCopyStreamTable &table, int64_t objId)
+{
+	class CopyTextRow row;
+	string line;
+	CopyRowId(row, objId);
+	row.EndRow(line);
+	table.AddRow(line);
+}
+
+void DataStreamCopyTables::AddMemberRow(class DbCopyStreamTable &table, int64_t objId, int64_t version, size_t index, int64_t memberId)
+{
+	class CopyTextRow row;
+	string line;
+	CopyRowMember(row, objId, version, index, memberId);
+	row.EndRow(line);
+	table.AddRow(line);
+}
+
+// **********************************************
+
+static bool CheckOsmInputFile(const std::string &inputFilename, std::string &errStr)
+{
+	vector<string> filenameSplit = split(inputFilename, '.');
+	size_t filePart = filenameSplit.size()-1;
+	bool gzipped = filenameSplit.size() > 1 && filenameSplit[filePart] == "gz";
+	if(gzipped)
+		filePart --;
+	if(filenameSplit.size() < 2 || (filenameSplit[filePart] != "o5m" && filenameSplit[filePart] != "osm"))
+	{
+		errStr = "File extension not supported: " + inputFilename;
+		return false;
+	}
+
+	std::filebuf fb;
+	if(fb.open(inputFilename, std::ios::in | std::ios::binary) == nullptr)
+	{
+		errStr = "Error opening input file " + inputFilename;
+		return false;
+	}
+	if(fb.in_avail() == 0)
+	{
+		errStr = "Error reading from input file " + inputFilename;
+		return false;
+	}
+	if(gzipped)
+	{
+		class DecodeGzip gzipDec(fb);
+		if(gzipDec.in_avail() == 0)
+		{
+			errStr = "Error reading from input file " + inputFilename;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool DbStreamCopyData(const std::string &connectionString,
+	int verbose,
+	const std::string &inputFilename,
+	const std::string &tablePrefix,
+	std::string &errStr)
+{
+	//LoadOsmFromFile exits the process if the file can't be read, so check it before starting
+	if(!CheckOsmInputFile(inputFilename, errStr))
+		return false;
+
+	std::shared_ptr<class DataStreamCopyTables> copyTables(new class DataStreamCopyTables(connectionString, tablePrefix, verbose));
+
+	try
+	{
+		LoadOsmFromFile(inputFilename, copyTables);
+	}
+	catch (const std::exception &e)
+	{
+		copyTables->Abort();
+		errStr = e.what();
+		return false;
+	}
+
+	errStr = copyTables->errStr;
+	return copyTables->ok;
+}
+
+// **********************************************
+
+//Encodes each changeset as a COPY row as soon as it is decoded. The rows are written to the
+//database on the table's own connection and thread, so parsing and loading overlap.
+class OsmChangesetsCopy : public OsmChangesetsDecodeString
+{
+public:
+	class DbCopyStreamTable &table;
+
+	OsmChangesetsCopy(class DbCopyStreamTable &table): table(table) {};
+	virtual ~OsmChangesetsCopy() {};
+
+	virtual void StoreChangeset(const class PgChangeset &changeset)
+	{
+		string tagsJson, tmp;
+		EncodeTags(changeset.tags, tagsJson);
+
+		stringstream ss;
+		ss.precision(9);
+		ss << changeset.objId << "\t";
+		if(changeset.username.size() > 0)
+		{
+			CopyTextEscape(changeset.username, tmp);
+			ss << tmp;
+		}
+		else
+			ss << "\\N";
+		ss << "\t";
+		if(changeset.uid != 0)
+			ss << changeset.uid;
+		else
+			ss << "\\N";
+		CopyTextEscape(tagsJson, tmp);
+		ss << "\t" << tmp << "\t";
+		if(changeset.open_timestamp != 0)
+			ss << changeset.open_timestamp;
+		else
+			ss << "\\N";
+		ss << "\t";
+		if(changeset.close_timestamp != 0)
+			ss << changeset.close_timestamp;
+		else
+			ss << "\\N";
+		ss << "\t" << (changeset.is_open ? "true" : "false") << "\t";
+		if(changeset.bbox_set)
+		{
+			//Same polygon as ST_MakeEnvelope
+			ss << fixed << "SRID=4326;POLYGON((" << changeset.x1 << " " << changeset.y1 << "," 
+				<< changeset.x1 << " " << changeset.y2 << "," << changeset.x2 << " " << changeset.y2 << ","
+				<< changeset.x2 << " " << changeset.y1 << "," << changeset.x1 << " " << changeset.y1 << "))";
+		}
+		else
+			ss << "\\N";
+		table.AddRow(ss.str());
+	}
+};
+
+bool DbStreamCopyChangesets(const std::string &connectionString,
+	int verbose,
+	const std::string &inputFilename,
+	const std::string &tablePrefix,
+	std::string &errStr)
+{
+	class DbCopyStreamTable table(connectionString, tablePrefix+"changesets", 10000, 16);
+	class OsmChangesetsCopy decoder(table);
+
+	bool ok = DecodeChangesetsFile(inputFilename, decoder, errStr);
+	if(!ok)
+	{
+		table.Abort();
+		return false;
+	}
+	string copyErrStr;
+	bool copyOk = table.Complete(copyErrStr);
+	if(verbose >= 1)
+		cout << inputFilename << ": " << table.rowCount << " changesets" << endl;
+	if(!copyOk)
+	{
+		errStr = copyErrStr;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,108 @@
+#ifndef _DB_COPY_STREAM_H
+#define _DB_COPY_STREAM_H
+
+#include <pqxx/pqxx> //apt install libpqxx-dev
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "cppo5m/o5m.h"
+
+//Streams rows into a single table using COPY FROM STDIN. The table is loaded
+//on its own connection and worker thread, fed by a bounded queue of row batches.
+class DbCopyStreamTable
+{
+private:
+	std::string connectionString;
+	std::string tableName;
+	size_t batchSize, maxQueuedBatches;
+
+	std::shared_ptr<std::vector<std::string> > batch;
+	std::deque<std::shared_ptr<std::vector<std::string> > > queue;
+	std::mutex mtx;
+	std::condition_variable queueChanged;
+	bool inputDone, failed;
+	std::string errStr;
+	std::thread thread;
+
+	void Run();
+	void PushBatch();
+
+public:
+	DbCopyStreamTable(const std::string &connectionString, const std::string &tableName,
+		size_t batchSize, size_t maxQueuedBatches);
+	virtual ~DbCopyStreamTable();
+
+	void AddRow(const std::string &row);
+	bool Complete(std::string &errStrOut);
+	//Stops without committing any rows
+	void Abort();
+	//True if the COPY has already failed or been aborted
+	bool HasFailed(std::string &errStrOut);
+
+	int64_t rowCount;
+};
+
+//Writes decoded OSM objects directly to the static map tables, without intermediate csv files.
+class DataStreamCopyTables : public IDataStreamHandler
+{
+private:
+	std::shared_ptr<class DbCopyStreamTable> livenodes, liveways, liverelations, oldnodes, oldways, oldrelations;
+	std::shared_ptr<class DbCopyStreamTable> nodeids, wayids, relationids;
+	std::shared_ptr<class DbCopyStreamTable> waymems, relationmemsn, relationmemsw, relationmemsr;
+	std::vector<std::shared_ptr<class DbCopyStreamTable> > tables;
+	int verbose;
+	bool finished;
+
+	std::shared_ptr<class DbCopyStreamTable> AddTable(const std::string &connectionString, const std::string &tableName);
+	void AddIdRow(class DbCopyStreamTable &table, int64_t objId);
+	void AddMemberRow(class DbCopyStreamTable &table, int64_t objId, int64_t version, size_t index, int64_t memberId);
+
+public:
+	DataStreamCopyTables(const std::string &connectionString, const std::string &tablePrefix, int verbose);
+	virtual ~DataStreamCopyTables();
+
+	virtual bool Sync() {return false;};
+	virtual bool Reset() {return false;};
+	//Commits the tables. If any table fails, the tables not yet committed are aborted. Returns
+	//false on failure, with the reason in errStr.
+	virtual bool Finish();
+	//Stops every table without committing
+	void Abort();
+
+	virtual bool StoreIsDiff(bool) {return false;};
+	virtual bool StoreBounds(double x1, double y1, double x2, double y2) {return false;};
+	virtual bool StoreNode(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, double lat, double lon);
+	virtual bool StoreWay(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, const std::vector<int64_t> &refs);
+	virtual bool StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+		const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+		const std::vector<std::string> &refRoles);
+
+	bool ok;
+	std::string errStr;
+};
+
+//Loads an OSM file (.o5m, .osm, optionally gzipped) into the tables with prefix tablePrefix. Each
+//table is committed independently, so the tables should be empty and without indices beforehand.
+//Nothing is committed if the file can't be decoded.
+bool DbStreamCopyData(const std::string &connectionString,
+	int verbose,
+	const std::string &inputFilename,
+	const std::string &tablePrefix,
+	std::string &errStr);
+
+//Loads a changesets file (.osm, .osm.gz or .osm.bz2) into the changesets table with COPY. The file is
+//decoded in chunks on this thread while another thread writes the rows. The changesets must not
+//already be in the table.
+bool DbStreamCopyChangesets(const std::string &connectionString,
+	int verbose,
+	const std::string &inputFilename,
+	const std::string &tablePrefix,
+	std::string &errStr);
+
+#endif //_DB_COPY_STREAM_H
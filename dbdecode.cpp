@@ -203,82 +203,74 @@ int WayResultsToEncoder(pqxx::icursorstream &cursor, class DbUsernameLookup &use
 	return count;
 }
 
-void RelationResultsToEncoder(pqxx::icursorstream &cursor, class DbUsernameLookup &usernames, 
+int RelationBatchToEncoder(pqxx::icursorstream &cursor, class DbUsernameLookup &usernames, 
 	const set<int64_t> &skipIds, std::shared_ptr<IDataStreamHandler> enc)
 {
-	uint64_t count = 0;
 	class MetaData metaData;
 	JsonToStringMap tagHandler;
 	JsonToRelMembers relMemHandler;
 	JsonToRelMemberRoles relMemRolesHandler;
-	std::vector<std::string> refRoles;
-	const std::vector<int64_t> refs;
-	double lastUpdateTime = (double)clock() / CLOCKS_PER_SEC;
-	uint64_t lastUpdateCount = 0;
-	bool verbose = false;
-	for ( size_t batch = 0; true; batch ++ )
+
+	pqxx::result rows;
+	cursor.get(rows);
+	if ( rows.empty() ) return 0; // nothing left to read
+
+	MetaDataCols metaDataCols;
+
+	int idCol = rows.column_number("id");
+	metaDataCols.changesetCol = rows.column_number("changeset");
+	metaDataCols.usernameCol = rows.column_number("username");
+	metaDataCols.uidCol = rows.column_number("uid");
+	metaDataCols.timestampCol = rows.column_number("timestamp");
+	metaDataCols.versionCol = rows.column_number("version");
+	metaDataCols.visibleCol = -1;
+	try
 	{
-		pqxx::result rows;
-		cursor.get(rows);
-		if ( rows.empty() ) break; // nothing left to read
-
-		MetaDataCols metaDataCols;
-
-		int idCol = rows.column_number("id");
-		metaDataCols.changesetCol = rows.column_number("changeset");
-		metaDataCols.usernameCol = rows.column_number("username");
-		metaDataCols.uidCol = rows.column_number("uid");
-		metaDataCols.timestampCol = rows.column_number("timestamp");
-		metaDataCols.versionCol = rows.column_number("version");
-		metaDataCols.visibleCol = -1;
-		try
+		metaDataCols.visibleCol = rows.column_number("visible");
+	}
+	catch (invalid_argument &err) {}
+
+	int tagsCol = rows.column_number("tags");
+	int membersCol = rows.column_number("members");
+	int membersRolesCol = rows.column_number("memberroles");
+
+	for (pqxx::result::const_iterator c = rows.begin(); c != rows.end(); ++c) {
+
+		int64_t objId = c[idCol].as<int64_t>();
+		if(skipIds.find(objId) != skipIds.end())
+			continue;
+
+		DecodeMetadata(c, metaDataCols, metaData);
+		if(&usernames != nullptr)
 		{
-			metaDataCols.visibleCol = rows.column_number("visible");
+			string username = usernames.Find(metaData.uid);
+			if(username.length() > 0)
+				metaData.username = username;
 		}
-		catch (invalid_argument &err) {}
-
-		int tagsCol = rows.column_number("tags");
-		int membersCol = rows.column_number("members");
-		int membersRolesCol = rows.column_number("memberroles");
-
-		for (pqxx::result::const_iterator c = rows.begin(); c != rows.end(); ++c) {
-
-			int64_t objId = c[idCol].as<int64_t>();
-			if(skipIds.find(objId) != skipIds.end())
-				continue;
-
-			DecodeMetadata(c, metaDataCols, metaData);
-			if(&usernames != nullptr)
-			{
-				string username = usernames.Find(metaData.uid);
-				if(username.length() > 0)
-					metaData.username = username;
-			}
-			
-			DecodeTags(c, tagsCol, tagHandler);
-
-			DecodeRelMembers(c, membersCol, membersRolesCol, 
-				relMemHandler, relMemRolesHandler);
-			if(relMemHandler.refTypeStrs.size() != relMemHandler.refIds.size() ||
-				relMemHandler.refTypeStrs.size() != relMemRolesHandler.refRoles.size())
-			{
-				throw runtime_error("Decoded relation has inconsistent member data");
-			}
-
-			count ++;
-
-			double timeNow = (double)clock() / CLOCKS_PER_SEC;
-			if (timeNow - lastUpdateTime > 30.0)
-			{
-				lastUpdateCount = count;
-				lastUpdateTime = timeNow;
-			}
-
-			if(enc)
-				enc->StoreRelation(objId, metaData, tagHandler.tagMap, 
-					relMemHandler.refTypeStrs, relMemHandler.refIds, relMemRolesHandler.refRoles);
+		
+		DecodeTags(c, tagsCol, tagHandler);
+
+		DecodeRelMembers(c, membersCol, membersRolesCol, 
+			relMemHandler, relMemRolesHandler);
+		if(relMemHandler.refTypeStrs.size() != relMemHandler.refIds.size() ||
+			relMemHandler.refTypeStrs.size() != relMemRolesHandler.refRoles.size())
+		{
+			throw runtime_error("Decoded relation has inconsistent member data");
 		}
+
+		if(enc)
+			enc->StoreRelation(objId, metaData, tagHandler.tagMap, 
+				relMemHandler.refTypeStrs, relMemHandler.refIds, relMemRolesHandler.refRoles);
 	}
+	return rows.size();
+}
+
+void RelationResultsToEncoder(pqxx::icursorstream &cursor, class DbUsernameLookup &usernames, 
+	const set<int64_t> &skipIds, std::shared_ptr<IDataStreamHandler> enc)
+{
+	int count = 1;
+	while(count > 0)
+		count = RelationBatchToEncoder(cursor, usernames, skipIds, enc);
 }
 
 int ObjectResultsToListIdVer(pqxx::icursorstream &cursor,
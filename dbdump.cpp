@@ -1,5 +1,9 @@
 #include "dbdump.h"
 #include "dbdecode.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+using namespace std;
 
 /**
 * Dump visible nodes. Only current
@@ -105,3 +109,514 @@ void DumpRelations(pqxx::connection &c, pqxx::transaction_base *work, class DbUs
 	RelationResultsToEncoder(cursor, usernames, empty, enc);
 }
 
+// **********************************************
+
+class DumpRange
+{
+public:
+	int64_t startId, endId; //End is exclusive
+	int state; //0 pending, 1 running, 2 done
+	std::shared_ptr<class OsmData> data;
+};
+
+class DumpRangeScheduler
+{
+public:
+	std::vector<class DumpRange> ranges;
+	size_t nextToClaim, nextToEmit, maxAhead;
+	std::mutex mtx;
+	std::condition_variable changed;
+	bool failed;
+	std::string errStr;
+
+	DumpRangeScheduler(size_t maxAhead);
+
+	//Returns the index of the next range to decode, or -1 when done. Workers are held back
+	//if they get too far ahead of the output, to keep memory bounded.
+	int NextRange();
+	void RangeFinished(int index, std::shared_ptr<class OsmData> data);
+	void Fail(const std::string &failErrStr);
+	//Waits for the next range in id order. Returns null when all ranges are emitted.
+	std::shared_ptr<class OsmData> NextResult();
+};
+
+DumpRangeScheduler::DumpRangeScheduler(size_t maxAhead):
+	nextToClaim(0),
+	nextToEmit(0),
+	maxAhead(maxAhead),
+	failed(false)
+{
+
+}
+
+int DumpRangeScheduler::NextRange()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(!this->failed && nextToClaim < ranges.size() && nextToClaim >= nextToEmit + maxAhead)
+		this->changed.wait(lock);
+	if(this->failed || nextToClaim >= ranges.size())
+		return -1;
+	ranges[nextToClaim].state = 1;
+	return nextToClaim++;
+}
+
+void DumpRangeScheduler::RangeFinished(int index, std::shared_ptr<class OsmData> data)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	ranges[index].data = data;
+	ranges[index].state = 2;
+	lock.unlock();
+	this->changed.notify_all();
+}
+
+void DumpRangeScheduler::Fail(const std::string &failErrStr)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	if(!this->failed)
+	{
+		this->failed = true;
+		this->errStr = failErrStr;
+	}
+	lock.unlock();
+	this->changed.notify_all();
+}
+
+std::shared_ptr<class OsmData> DumpRangeScheduler::NextResult()
+{
+	std::shared_ptr<class OsmData> out;
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(!this->failed && nextToEmit < ranges.size() && ranges[nextToEmit].state != 2)
+		this->changed.wait(lock);
+	if(this->failed || nextToEmit >= ranges.size())
+		return out;
+	out.swap(ranges[nextToEmit].data);
+	nextToEmit ++;
+	lock.unlock();
+	this->changed.notify_all();
+	return out;
+}
+
+static void DumpRangeWorker(const std::string &connectionString,
+	const std::string &snapshotId,
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix,
+	const std::string &objType,
+	class DumpRangeScheduler *scheduler)
+{
+	try
+	{
+		pqxx::connection c(connectionString);
+		pqxx::transaction<pqxx::repeatable_read> work(c);
+		//This must be the first query in the transaction
+		work.exec("SET TRANSACTION SNAPSHOT "+work.quote(snapshotId)+";");
+
+		class DbUsernameLookup usernames(c, &work, tableStaticPrefix, tableActivePrefix);
+		string viewName = c.quote_name(tableActivePrefix + "visible" + objType + "s");
+		set<int64_t> empty;
+
+		int index = scheduler->NextRange();
+		while(index >= 0)
+		{
+			const class DumpRange &range = scheduler->ranges[index];
+			stringstream sql;
+			sql << "SELECT " << viewName << ".*";
+			if(objType == "node")
+				sql << ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+			sql << " FROM " << viewName;
+			sql << " WHERE id >= " << range.startId << " AND id < " << range.endId;
+			sql << " ORDER BY id;";
+
+			std::shared_ptr<class OsmData> data(new class OsmData());
+			pqxx::icursorstream cursor(work, sql.str(), "dumprangecursor", 1000);
+			int count = 1;
+			if(objType == "node")
+			{
+				while(count > 0)
+					count = NodeResultsToEncoder(cursor, usernames, data);
+			}
+			else if(objType == "way")
+			{
+				while(count > 0)
+					count = WayResultsToEncoder(cursor, usernames, data);
+			}
+			else
+				RelationResultsToEncoder(cursor, usernames, empty, data);
+
+			scheduler->RangeFinished(index, data);
+			index = scheduler->NextRange();
+		}
+	}
+	catch (const std::exception &e)
+	{
+		scheduler->Fail(e.what());
+	}
+}
+
+//Finds the range of ids in the static and active live tables
+static bool DumpIdRange(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix,
+	const std::string &objType,
+	int64_t &minIdOut, int64_t &maxIdOut)
+{
+	bool found = false;
+	const std::string prefixes[] = {tableStaticPrefix, tableActivePrefix};
+	for(size_t i=0; i<2; i++)
+	{
+		string liveTable = c.quote_name(prefixes[i] + "live" + objType + "s");
+		pqxx::result r = work->exec("SELECT MIN(id), MAX(id) FROM "+liveTable+";");
+		if(r.size() == 0 || r[0][0].is_null() || r[0][1].is_null())
+			continue;
+		int64_t minId = r[0][0].as<int64_t>();
+		int64_t maxId = r[0][1].as<int64_t>();
+		if(!found || minId < minIdOut)
+			minIdOut = minId;
+		if(!found || maxId > maxIdOut)
+			maxIdOut = maxId;
+		found = true;
+	}
+	return found;
+}
+
+static void DumpParallelType(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &connectionString,
+	const std::string &snapshotId,
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	int numWorkers, int64_t rangeSize,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	int64_t minId = 0, maxId = 0;
+	if(!DumpIdRange(c, work, tableStaticPrefix, tableActivePrefix, objType, minId, maxId))
+		return;
+
+	class DumpRangeScheduler scheduler(numWorkers * 2);
+	for(int64_t startId = minId; startId <= maxId; startId += rangeSize)
+	{
+		class DumpRange range;
+		range.startId = startId;
+		range.endId = startId + rangeSize;
+		range.state = 0;
+		scheduler.ranges.push_back(range);
+	}
+
+	std::vector<std::thread> workers;
+	for(int i=0; i<numWorkers; i++)
+		workers.push_back(std::thread(DumpRangeWorker, connectionString, snapshotId, 
+			tableStaticPrefix, tableActivePrefix, objType, &scheduler));
+
+	std::shared_ptr<class OsmData> data = scheduler.NextResult();
+	while(data)
+	{
+		try
+		{
+			StreamObjectsTo(*data, *enc);
+		}
+		catch (const std::exception &e)
+		{
+			scheduler.Fail(e.what());
+			break;
+		}
+		data = scheduler.NextResult();
+	}
+
+	for(size_t i=0; i<workers.size(); i++)
+		workers[i].join();
+	if(scheduler.failed)
+		throw runtime_error(scheduler.errStr);
+}
+
+void DumpParallel(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &connectionString,
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int numWorkers, int64_t rangeSize,
+	bool nodes, bool ways, bool relations,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(numWorkers < 1)
+		numWorkers = 1;
+	if(rangeSize < 1)
+		throw invalid_argument("Range size must be positive");
+
+	//The snapshot remains valid while this transaction is open
+	pqxx::result r = work->exec("SELECT pg_export_snapshot();");
+	string snapshotId = r[0][0].as<string>();
+
+	if(nodes)
+	{
+		DumpParallelType(c, work, connectionString, snapshotId, tableStaticPrefix, tableActivePrefix, 
+			"node", numWorkers, rangeSize, enc);
+		enc->Reset();
+	}
+
+	if(ways)
+	{
+		DumpParallelType(c, work, connectionString, snapshotId, tableStaticPrefix, tableActivePrefix, 
+			"way", numWorkers, rangeSize, enc);
+		enc->Reset();
+	}
+
+	if(relations)
+	{
+		DumpParallelType(c, work, connectionString, snapshotId, tableStaticPrefix, tableActivePrefix, 
+			"relation", numWorkers, rangeSize, enc);
+	}
+}
+
+// **********************************************
+
+//Reads decoded objects of one type from a cursor, one batch at a time
+class DumpMergeSource
+{
+private:
+	pqxx::icursorstream cursor;
+	class DbUsernameLookup &usernames;
+	std::string objType;
+	std::shared_ptr<class OsmData> batch;
+	size_t pos;
+	bool done;
+
+	size_t BatchSize();
+	void Fill();
+
+public:
+	DumpMergeSource(pqxx::transaction_base &work, class DbUsernameLookup &usernames, 
+		const std::string &sql, const std::string &cursorName, const std::string &objType);
+
+	bool Valid() {return !done;};
+	int64_t PeekId();
+	int64_t PeekVersion();
+	void Emit(IDataStreamHandler &enc);
+	void Skip();
+};
+
+DumpMergeSource::DumpMergeSource(pqxx::transaction_base &work, class DbUsernameLookup &usernames, 
+	const std::string &sql, const std::string &cursorName, const std::string &objType):
+	cursor(work, sql, cursorName, 1000),
+	usernames(usernames),
+	objType(objType),
+	pos(0),
+	done(false)
+{
+	batch.reset(new class OsmData());
+	Fill();
+}
+
+size_t DumpMergeSource::BatchSize()
+{
+	if(objType == "node")
+		return batch->nodes.size();
+	if(objType == "way")
+		return batch->ways.size();
+	return batch->relations.size();
+}
+
+void DumpMergeSource::Fill()
+{
+	set<int64_t> empty;
+	while(pos >= BatchSize())
+	{
+		batch->Clear();
+		pos = 0;
+		int count = 0;
+		if(objType == "node")
+			count = NodeResultsToEncoder(cursor, usernames, batch);
+		else if(objType == "way")
+			count = WayResultsToEncoder(cursor, usernames, batch);
+		else
+			count = RelationBatchToEncoder(cursor, usernames, empty, batch);
+		if(count == 0)
+		{
+			done = true;
+			return;
+		}
+	}
+}
+
+int64_t DumpMergeSource::PeekId()
+{
+	if(objType == "node")
+		return batch->nodes[pos].objId;
+	if(objType == "way")
+		return batch->ways[pos].objId;
+	return batch->relations[pos].objId;
+}
+
+int64_t DumpMergeSource::PeekVersion()
+{
+	if(objType == "node")
+		return batch->nodes[pos].metaData.version;
+	if(objType == "way")
+		return batch->ways[pos].metaData.version;
+	return batch->relations[pos].metaData.version;
+}
+
+void DumpMergeSource::Emit(IDataStreamHandler &enc)
+{
+	if(objType == "node")
+	{
+		const class OsmNode &node = batch->nodes[pos];
+		enc.StoreNode(node.objId, node.metaData, node.tags, node.lat, node.lon);
+	}
+	else if(objType == "way")
+	{
+		const class OsmWay &way = batch->ways[pos];
+		enc.StoreWay(way.objId, way.metaData, way.tags, way.refs);
+	}
+	else
+	{
+		const class OsmRelation &relation = batch->relations[pos];
+		enc.StoreRelation(relation.objId, relation.metaData, relation.tags, 
+			relation.refTypeStrs, relation.refIds, relation.refRoles);
+	}
+	Skip();
+}
+
+void DumpMergeSource::Skip()
+{
+	pos ++;
+	Fill();
+}
+
+//Reads ids from a cursor in ascending order
+class DumpIdSource
+{
+private:
+	pqxx::icursorstream cursor;
+	std::vector<int64_t> batch;
+	size_t pos;
+	bool done;
+
+public:
+	DumpIdSource(pqxx::transaction_base &work, const std::string &sql, const std::string &cursorName);
+
+	//Returns true if id is in the source. Calls must be in ascending id order.
+	bool Contains(int64_t id);
+};
+
+DumpIdSource::DumpIdSource(pqxx::transaction_base &work, const std::string &sql, const std::string &cursorName):
+	cursor(work, sql, cursorName, 10000),
+	pos(0),
+	done(false)
+{
+
+}
+
+bool DumpIdSource::Contains(int64_t id)
+{
+	while(!done)
+	{
+		if(pos >= batch.size())
+		{
+			pqxx::result rows;
+			cursor.get(rows);
+			batch.clear();
+			pos = 0;
+			if(rows.empty())
+			{
+				done = true;
+				break;
+			}
+			for (pqxx::result::const_iterator c = rows.begin(); c != rows.end(); ++c)
+				batch.push_back(c[0].as<int64_t>());
+			continue;
+		}
+		if(batch[pos] >= id)
+			return batch[pos] == id;
+		pos ++;
+	}
+	return false;
+}
+
+void DumpMerged(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	string staticLive = c.quote_name(tableStaticPrefix + "live" + objType + "s");
+	string activeLive = c.quote_name(tableActivePrefix + "live" + objType + "s");
+	string activeIds = c.quote_name(tableActivePrefix + objType + "ids");
+	string geomCols;
+	if(objType == "node")
+		geomCols = ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+
+	class DumpMergeSource staticSource(*work, usernames, 
+		"SELECT *"+geomCols+" FROM "+staticLive+" ORDER BY id;", "staticcursor", objType);
+	class DumpMergeSource activeSource(*work, usernames, 
+		"SELECT *"+geomCols+" FROM "+activeLive+" ORDER BY id;", "activecursor", objType);
+	class DumpIdSource excludeIds(*work, "SELECT id FROM "+activeIds+" ORDER BY id;", "excludecursor");
+
+	while(staticSource.Valid() || activeSource.Valid())
+	{
+		if(staticSource.Valid() && (!activeSource.Valid() || staticSource.PeekId() < activeSource.PeekId()))
+		{
+			//Static objects that have been modified in the active tables are replaced
+			if(excludeIds.Contains(staticSource.PeekId()))
+				staticSource.Skip();
+			else
+				staticSource.Emit(*enc);
+		}
+		else
+			activeSource.Emit(*enc);
+	}
+}
+
+void DumpHistory(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	string geomCols;
+	if(objType == "node")
+		geomCols = ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+
+	//Active tables come first, so they take priority if a version is in both prefixes
+	const std::string tables[] = {tableActivePrefix + "live", tableActivePrefix + "old", 
+		tableStaticPrefix + "live", tableStaticPrefix + "old"};
+	std::vector<std::shared_ptr<class DumpMergeSource> > sources;
+	for(size_t i=0; i<4; i++)
+	{
+		string tableName = c.quote_name(tables[i] + objType + "s");
+		string sql = "SELECT *"+geomCols+" FROM "+tableName+" ORDER BY id, version;";
+		sources.push_back(std::shared_ptr<class DumpMergeSource>(new class DumpMergeSource(*work, usernames, 
+			sql, "historycursor"+to_string(i), objType)));
+	}
+
+	bool emitted = false;
+	int64_t lastId = 0, lastVersion = 0;
+	while(true)
+	{
+		//Find the source with the lowest (id, version)
+		int best = -1;
+		int64_t bestId = 0, bestVersion = 0;
+		for(size_t i=0; i<sources.size(); i++)
+		{
+			if(!sources[i]->Valid()) continue;
+			int64_t objId = sources[i]->PeekId();
+			int64_t version = sources[i]->PeekVersion();
+			if(best < 0 || objId < bestId || (objId == bestId && version < bestVersion))
+			{
+				best = i;
+				bestId = objId;
+				bestVersion = version;
+			}
+		}
+		if(best < 0)
+			break;
+
+		if(emitted && bestId == lastId && bestVersion == lastVersion)
+		{
+			sources[best]->Skip();
+			continue;
+		}
+		sources[best]->Emit(*enc);
+		emitted = true;
+		lastId = bestId;
+		lastVersion = bestVersion;
+	}
+}
+
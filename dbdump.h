@@ -20,4 +20,32 @@ void DumpRelations(pqxx::connection &c, pqxx::transaction_base *work, class DbUs
 	bool order,
 	std::shared_ptr<IDataStreamHandler> enc);
 
+//Dumps visible objects of objType ("node", "way" or "relation") in id order without using the
+//visible views. Static and active live tables are read in id order and merged, skipping static 
+//objects that appear in the active ids table.
+void DumpMerged(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	std::shared_ptr<IDataStreamHandler> enc);
+
+//Dumps every version of objType, including deleted versions, in (id, version) order. The old
+//and live tables of both prefixes are read in order and merged.
+void DumpHistory(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	std::shared_ptr<IDataStreamHandler> enc);
+
+//Dumps visible objects in id order using numWorkers additional connections. The coordinating
+//transaction exports its snapshot, which the workers import, so the output is consistent.
+//Each worker decodes ranges of rangeSize ids; decoded ranges are passed to enc in order.
+void DumpParallel(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &connectionString,
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int numWorkers, int64_t rangeSize,
+	bool nodes, bool ways, bool relations,
+	std::shared_ptr<IDataStreamHandler> enc);
+
 #endif //_DB_DUMP_H
@@ -4,6 +4,12 @@
 #include <rapidjson/stringbuffer.h>
 #include <rapidjson/writer.h> //rapidjson-dev
 #include "dbquery.h"
+#include "dbfilters.h"
+#include "dbtagstats.h"
+#include "dbcommon.h"
+#include "util.h"
+#include <algorithm>
+#include <iterator>
 
 /*
 Example queries :
@@ -16,68 +22,184 @@ SELECT id, tags FROM planet_static_livenodes WHERE tags @> '{"natural":"peak"}':
 
 */
 
-std::string DbXapiQueryGenerateSql(pqxx::connection &c, pqxx::transaction_base *work, 
-	const std::string &tablePrefix, 
-	const std::string &objType,
-	const std::string &tagKey,
-	const std::string &tagValue,
-	const std::vector<double> &bbox)
+//Key only and regex conditions can't use a GIN jsonb_path_ops index
+static bool TagQueryIndexable(const class TagQuery &query)
 {
-	string objTable = c.quote_name(tablePrefix+"visible"+objType+"s");
+	if(query.type == TagQuery::ALL_OF)
+	{
+		//The index finds candidates for one part and the rest are rechecked
+		for(size_t i=0; i<query.children.size(); i++)
+			if(TagQueryIndexable(query.children[i]))
+				return true;
+		return false;
+	}
+	if(query.type == TagQuery::ANY_OF)
+	{
+		for(size_t i=0; i<query.children.size(); i++)
+			if(!TagQueryIndexable(query.children[i]))
+				return false;
+		return query.children.size() > 0;
+	}
+	return query.type == TagQuery::VALUE_IN;
+}
 
-	string sql = "SELECT *";
+static std::string TagQuerySql(pqxx::transaction_base *work, const class TagQuery &query)
+{
+	if(query.type == TagQuery::ALL_OF || query.type == TagQuery::ANY_OF)
+	{
+		string sql;
+		for(size_t i=0; i<query.children.size(); i++)
+		{
+			if(i > 0)
+				sql += query.type == TagQuery::ALL_OF ? " AND " : " OR ";
+			sql += TagQuerySql(work, query.children[i]);
+		}
+		if(query.children.size() == 0)
+			return "TRUE";
+		return "("+sql+")";
+	}
+	if(query.type == TagQuery::HAS_KEY)
+		return "tags ? "+work->quote(query.key);
+	if(query.type == TagQuery::REGEX)
+		return "tags->>"+work->quote(query.key)+" ~ "+work->quote(query.values[0]);
+
+	//Written as containment so a GIN index can be used
+	string sql;
+	for(size_t i=0; i<query.values.size(); i++)
+	{
+		StringBuffer buffer;
+		Writer<StringBuffer> writer(buffer);
+
+		writer.StartObject();
+		writer.Key(query.key.c_str(), query.key.size(), true);
+		writer.String(query.values[i].c_str(), query.values[i].size(), true);
+		writer.EndObject(1);
+
+		if(i > 0)
+			sql += " OR ";
+		sql += "tags @> "+work->quote(buffer.GetString())+"::jsonb";
+	}
+	return "("+sql+")";
+}
 
+static std::string BboxSql(const std::string &objType, const std::vector<double> &bbox)
+{
+	stringstream sql;
+	sql.precision(9);
 	if(objType == "node")
-		sql += ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+		sql << "geom";
+	else
+		sql << "bbox";
+	sql << fixed << " && ST_MakeEnvelope("<<bbox[0]<<","<<bbox[1]<<","<<bbox[2]<<","<<bbox[3]<<", 4326)";
+	return sql.str();
+}
 
-	sql += " FROM "+ objTable;
+//Counts matching objects, stopping at limit
+static int64_t CountMatchesUpTo(pqxx::transaction_base *work, const std::string &objTable, 
+	const std::string &condition, int64_t limit)
+{
+	stringstream sql;
+	sql << "SELECT COUNT(*) FROM (SELECT 1 FROM " << objTable << " WHERE " << condition;
+	sql << " LIMIT " << limit << ") AS probe;";
+	pqxx::result r = work->exec(sql.str());
+	return r[0][0].as<int64_t>();
+}
 
-	if(tagKey.size() > 0 or bbox.size() == 4)
+std::string DbXapiQueryGenerateSql(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix, 
+	const std::string &statsPrefix, 
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox,
+	int64_t probeLimit = 10000)
+{
+	string objTable = c.quote_name(tablePrefix+"visible"+objType+"s");
+	string cols = "*";
+	if(objType == "node")
+		cols += ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+
+	string tagSql, bboxSql;
+	if(!query.MatchesAll())
+		tagSql = TagQuerySql(work, query);
+	if(bbox.size() == 4)
+		bboxSql = BboxSql(objType, bbox);
+
+	if(tagSql.size() == 0 && bboxSql.size() == 0)
+		return "SELECT "+cols+" FROM "+objTable+";";
+	if(bboxSql.size() == 0)
+		return "SELECT "+cols+" FROM "+objTable+" WHERE "+tagSql+";";
+	if(tagSql.size() == 0)
+		return "SELECT "+cols+" FROM "+objTable+" WHERE "+bboxSql+";";
+
+	//Postgres has no useful statistics for jsonb containment, so it can pick the wrong index
+	//when there is both a tag and a bbox condition. Estimate how many objects each condition
+	//matches from the tag statistics in statsPrefix, or if they have not been built, by
+	//probing (up to probeLimit). Then apply the more selective one first. Without the GIN tag
+	//index, the tag condition is a full scan, so the bbox goes first. OFFSET 0 stops the
+	//planner merging the inner query into the outer one.
+	bool tagFirst = false;
+	if(TagQueryIndexable(query) && DbCheckIndexExists(c, work, tablePrefix+"live"+objType+"s_tagx"))
 	{
-		sql += " WHERE (";
-
-		if(tagKey.size() > 0)
+		int64_t tagCount = 0, bboxCount = 0;
+		class DbStatsEstimate estimate;
+		if(DbEstimateObjects(c, work, statsPrefix, objType, query, bbox, estimate))
 		{
-			if(tagValue.size() > 0)
-			{
-				StringBuffer buffer;
-				Writer<StringBuffer> writer(buffer);
-
-				writer.StartObject();
-				writer.Key(tagKey.c_str(), tagKey.size(), true);
-				writer.String(tagValue.c_str(), tagValue.size(), true);
-				writer.EndObject(1);
-
-				sql += " tags @> "+work->quote(buffer.GetString())+"::jsonb";
-			}
-			else
-			{
-				sql += " tags ? "+work->quote(tagKey);
-			}
+			tagCount = (int64_t)(estimate.total * estimate.tagSelectivity);
+			bboxCount = (int64_t)(estimate.total * estimate.bboxSelectivity);
 		}
-
-		if(bbox.size() == 4)
+		else
 		{
-			if(tagKey.size() > 0) sql += " AND";
-
-			stringstream sql2;
-			sql2.precision(9);
-			if(objType == "node")
-				sql2 << " geom";
-			else
-				sql2 << " bbox";
-			sql2 << fixed << " && ST_MakeEnvelope("<<bbox[0]<<","<<bbox[1]<<","<<bbox[2]<<","<<bbox[3]<<", 4326)";
-			sql += sql2.str();
+			tagCount = CountMatchesUpTo(work, objTable, tagSql, probeLimit);
+			bboxCount = CountMatchesUpTo(work, objTable, bboxSql, probeLimit);
 		}
-
-		sql += ")";
+		tagFirst = tagCount <= bboxCount;
 	}
 
-	sql += ";";
+	string firstSql = tagFirst ? tagSql : bboxSql;
+	string secondSql = tagFirst ? bboxSql : tagSql;
+	return "SELECT "+cols+" FROM (SELECT * FROM "+objTable+" WHERE "+firstSql+" OFFSET 0) AS candidates WHERE "+secondSql+";";
+}
 
-	return sql;
+bool DbCheckTagQueryRegexes(pqxx::connection &c, pqxx::transaction_base *work, 
+	const class TagQuery &query, std::string &errStr)
+{
+	if(query.type == TagQuery::ALL_OF || query.type == TagQuery::ANY_OF)
+	{
+		for(size_t i=0; i<query.children.size(); i++)
+			if(!DbCheckTagQueryRegexes(c, work, query.children[i], errStr))
+				return false;
+		return true;
+	}
+	if(query.type != TagQuery::REGEX)
+		return true;
+
+	//An invalid pattern aborts the transaction, so it is tried within a savepoint
+	work->exec("SAVEPOINT tagquery_regex;");
+	try
+	{
+		work->exec("SELECT '' ~ "+c.quote(query.values[0])+";");
+	}
+	catch (const pqxx::sql_error &e)
+	{
+		work->exec("ROLLBACK TO SAVEPOINT tagquery_regex;");
+		errStr = "Invalid regular expression for "+query.key+": "+e.what();
+		return false;
+	}
+	work->exec("RELEASE SAVEPOINT tagquery_regex;");
+	return true;
 }
 
+std::string DbXapiQueryGenerateSql(pqxx::connection &c, pqxx::transaction_base *work, 
+	const std::string &tablePrefix, 
+	const std::string &objType,
+	const std::string &tagKey,
+	const std::string &tagValue,
+	const std::vector<double> &bbox)
+{
+	class TagQuery query;
+	TagQueryFromKeyValue(tagKey, tagValue, query);
+	return DbXapiQueryGenerateSql(c, work, tablePrefix, tablePrefix, objType, query, bbox);
+}
 
 void DbXapiQueryIdVisible(pqxx::connection &c, pqxx::transaction_base *work, 
 	const std::string &tablePrefix, 
@@ -111,16 +233,16 @@ void DbXapiQueryObjVisible(pqxx::connection &c, pqxx::transaction_base *work,
 	class DbUsernameLookup &usernames, 
 	const std::string &tablePrefix, 
 	const std::string &objType,
-	const std::string &tagKey,
-	const std::string &tagValue,
+	const class TagQuery &query,
 	const std::vector<double> &bbox, 
-	std::shared_ptr<IDataStreamHandler> enc)
+	std::shared_ptr<IDataStreamHandler> enc,
+	const std::string &statsPrefix)
 {
 	string sql = DbXapiQueryGenerateSql(c, work, 
 		tablePrefix, 
+		statsPrefix.size() > 0 ? statsPrefix : tablePrefix, 
 		objType,
-		tagKey,
-		tagValue,
+		query,
 		bbox);
 
 	cout << sql << endl;
@@ -141,154 +263,221 @@ void DbXapiQueryObjVisible(pqxx::connection &c, pqxx::transaction_base *work,
 	}
 }
 
-void DbXapiQueryVisible(pqxx::connection &c, pqxx::transaction_base *work, 
+//Adds the ids of the members of the relations from index start onwards
+static void CollectRelationMembers(const class OsmData &relations, size_t start,
+	std::set<int64_t> &nodeIds, std::set<int64_t> &wayIds, std::set<int64_t> &relationIds)
+{
+	for(size_t i=start; i<relations.relations.size(); i++)
+	{
+		const OsmRelation &rel = relations.relations[i];
+		for(size_t j=0; j<rel.refTypeStrs.size(); j++)
+		{	
+			const std::string &refType = rel.refTypeStrs[j];
+			if(refType == "node")
+				nodeIds.insert(rel.refIds[j]);
+			else if(refType == "way")
+				wayIds.insert(rel.refIds[j]);
+			else if(refType == "relation")
+				relationIds.insert(rel.refIds[j]);
+		}
+	}
+}
+
+//Matched objects, their members, the members of member relations and the nodes of all 
+//these ways. Ways and relations are held in memory until the nodes have been written.
+static void XapiQueryDown(pqxx::connection &c, pqxx::transaction_base *work, 
 	class DbUsernameLookup &usernames, 
 	const std::string &tablePrefix, 
+	const std::string &statsPrefix, 
 	const std::string &objType,
-	const std::string &tagKey,
-	const std::string &tagValue,
+	const class TagQuery &query,
 	const std::vector<double> &bbox, 
 	std::shared_ptr<IDataStreamHandler> enc)
 {
+	std::shared_ptr<class OsmData> relationObjs(new class OsmData());
+	std::shared_ptr<class OsmData> wayObjs(new class OsmData());
 	std::set<int64_t> relationIdsSet, wayIdsSet, nodeIdsSet;
+	std::set<int64_t> memberNodeIds, memberWayIds, memberRelationIds;
 
 	if(objType == "relation" or objType == "*")
 	{
-		std::shared_ptr<class OsmData> relationObjs(new class OsmData());
 		DbXapiQueryObjVisible(c, work, 
 			usernames, 
 			tablePrefix, 
 			"relation",
-			tagKey,
-			tagValue,
+			query,
 			bbox, 
-			relationObjs);
-
-		//Get object Ids needed to complete relations
+			relationObjs,
+			statsPrefix);
 		for(size_t i=0; i<relationObjs->relations.size(); i++)
-		{
-			OsmRelation &rel = relationObjs->relations[i];
-			for(size_t j=0; j<rel.refTypeStrs.size(); j++)
-			{	
-				const std::string &refType = rel.refTypeStrs[j];
-				if(refType == "node")
-					nodeIdsSet.insert(rel.refIds[j]);
-				else if(refType == "way")
-					wayIdsSet.insert(rel.refIds[j]);
-				else if(refType == "relation")
-					relationIdsSet.insert(rel.refIds[j]);
-			}
-		}
-		relationObjs.reset();
+			relationIdsSet.insert(relationObjs->relations[i].objId);
 
-		//Recursively get child relations
-		std::set<int64_t> pendingRelationIds = relationIdsSet;
+		//Get child relations, one level at a time
+		size_t done = 0;
 		int depth = 0;
-		while(pendingRelationIds.size() > 0 and depth < 10)
+		while(done < relationObjs->relations.size() and depth < 10)
 		{
+			CollectRelationMembers(*relationObjs, done, memberNodeIds, memberWayIds, memberRelationIds);
+			done = relationObjs->relations.size();
+
+			std::set<int64_t> pendingRelationIds;
+			std::set_difference(memberRelationIds.begin(), memberRelationIds.end(), 
+				relationIdsSet.begin(), relationIdsSet.end(),
+				std::inserter(pendingRelationIds, pendingRelationIds.end()));
+			relationIdsSet.insert(pendingRelationIds.begin(), pendingRelationIds.end());
+
 			std::set<int64_t>::const_iterator it = pendingRelationIds.begin();
-			std::shared_ptr<class OsmData> childRelationObjs(new class OsmData());
 			while(it != pendingRelationIds.end())
 				GetVisibleObjectsById(c, work, 
 					usernames, 
 					tablePrefix, 
 					"relation",
 					pendingRelationIds, it, 
-					1000, childRelationObjs);
-
-			pendingRelationIds.clear();
-			for(size_t i=0; i<childRelationObjs->relations.size(); i++)
-			{
-				OsmRelation &rel = childRelationObjs->relations[i];
-				for(size_t j=0; j<rel.refTypeStrs.size(); j++)
-				{	
-					const std::string &refType = rel.refTypeStrs[j];
-					if(refType == "node")
-						nodeIdsSet.insert(rel.refIds[j]);
-					else if(refType == "way")
-						wayIdsSet.insert(rel.refIds[j]);
-					else if(refType == "relation")
-					{
-						if (relationIdsSet.find(rel.refIds[j]) == relationIdsSet.end())
-						{
-							relationIdsSet.insert(rel.refIds[j]);
-							pendingRelationIds.insert(rel.refIds[j]);
-						}					
-					}
-				}
-			}
+					1000, relationObjs);
 
 			depth += 1;
 		}
+		if(done < relationObjs->relations.size())
+			CollectRelationMembers(*relationObjs, done, memberNodeIds, memberWayIds, memberRelationIds);
 	}
 
 	if(objType == "way" or objType == "*")
 	{
-		//Get way IDs
-		std::shared_ptr<class OsmData> wayObjs(new class OsmData());
 		DbXapiQueryObjVisible(c, work, 
 			usernames, 
 			tablePrefix, 
 			"way",
-			tagKey,
-			tagValue,
+			query,
 			bbox, 
-			wayObjs);
-
-		//Get nodes to complete ways
+			wayObjs,
+			statsPrefix);
 		for(size_t i=0; i<wayObjs->ways.size(); i++)
-		{
-			OsmWay &way = wayObjs->ways[i];
-			wayIdsSet.insert(way.objId);
-			for(size_t j=0; j<way.refs.size(); j++)
-			{	
-				nodeIdsSet.insert(way.refs[j]);
-			}
-		}
+			wayIdsSet.insert(wayObjs->ways[i].objId);
+	}
+
+	//Get member ways that were not matched
+	std::set<int64_t> pendingWayIds;
+	std::set_difference(memberWayIds.begin(), memberWayIds.end(), 
+		wayIdsSet.begin(), wayIdsSet.end(),
+		std::inserter(pendingWayIds, pendingWayIds.end()));
+	std::set<int64_t>::const_iterator it = pendingWayIds.begin();
+	while(it != pendingWayIds.end())
+		GetVisibleObjectsById(c, work, usernames,
+			tablePrefix, "way", pendingWayIds, 
+			it, 1000, wayObjs);
+
+	//Nodes needed to complete ways and relations
+	nodeIdsSet = memberNodeIds;
+	for(size_t i=0; i<wayObjs->ways.size(); i++)
+	{
+		const OsmWay &way = wayObjs->ways[i];
+		nodeIdsSet.insert(way.refs.begin(), way.refs.end());
 	}
 
 	if(objType == "node" or objType == "*")
 	{
-		std::shared_ptr<class OsmData> nodeObjs(new class OsmData());
+		class DataStreamRetainIds retainNodes(*enc);
+		std::shared_ptr<IDataStreamHandler> retainNodesPtr(&retainNodes, [](IDataStreamHandler *) {});
 		DbXapiQueryObjVisible(c, work, 
 			usernames, 
 			tablePrefix, 
 			"node",
-			tagKey,
-			tagValue,
+			query,
 			bbox, 
-			nodeObjs);
+			retainNodesPtr,
+			statsPrefix);
 
-		if(objType == "*")
-		{
-			//Merge node ids with previously found data
-			for(size_t i=0; i<nodeObjs->nodes.size(); i++)
-			{
-				OsmNode &node = nodeObjs->nodes[i];
-				nodeIdsSet.insert(node.objId);
-			}
-		}
-		else
-			nodeObjs->StreamTo(*enc);
+		for(auto it2 = retainNodes.nodeIds.begin(); it2 != retainNodes.nodeIds.end(); it2++)
+			nodeIdsSet.erase(*it2);
 	}
 
 	//Output final objects
-	std::set<int64_t>::const_iterator it = nodeIdsSet.begin();
+	it = nodeIdsSet.begin();
 	while(it != nodeIdsSet.end())
 		GetVisibleObjectsById(c, work, usernames,
 			tablePrefix, "node", nodeIdsSet, 
 			it, 1000, enc);
 
-	it = wayIdsSet.begin();
-	while(it != wayIdsSet.end())
-		GetVisibleObjectsById(c, work, usernames,
-			tablePrefix, "way", wayIdsSet, 
-			it, 1000, enc);
+	StreamObjectsTo(*wayObjs, *enc);
+	wayObjs.reset();
+	StreamObjectsTo(*relationObjs, *enc);
+}
 
-	it = relationIdsSet.begin();
-	while(it != relationIdsSet.end())
-		GetVisibleObjectsById(c, work, usernames,
-			tablePrefix, "relation", relationIdsSet, 
-			it, 1000, enc);
+//Matched objects, followed by the ways that contain matched nodes and the relations that 
+//contain any of these, recursively. Nothing is held in memory except object ids.
+static void XapiQueryUp(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::string &statsPrefix, 
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	class DataStreamRetainIds retain(*enc);
+	std::shared_ptr<IDataStreamHandler> retainPtr(&retain, [](IDataStreamHandler *) {});
+
+	if(objType == "node" or objType == "*")
+		DbXapiQueryObjVisible(c, work, usernames, activePrefix, "node", query, bbox, retainPtr, statsPrefix);
+
+	if(objType == "way" or objType == "*")
+		DbXapiQueryObjVisible(c, work, usernames, activePrefix, "way", query, bbox, retainPtr, statsPrefix);
+
+	GetAffectedParentWays(c, work, usernames, 
+		staticPrefix, activePrefix, 
+		retain.nodeIds, retain.wayIds, enc);
+
+	if(objType == "relation" or objType == "*")
+		DbXapiQueryObjVisible(c, work, usernames, activePrefix, "relation", query, bbox, retainPtr, statsPrefix);
+
+	GetAffectedParentRelations(c, work, usernames, 
+		staticPrefix, activePrefix, 
+		retain.nodeIds, retain.wayIds, retain.relationIds, 
+		10, enc);
+}
+
+void DbXapiQueryVisible(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::string &statsPrefix, 
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox, 
+	const std::string &recurse,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(objType != "node" and objType != "way" and objType != "relation" and objType != "*")
+		throw invalid_argument("Unknown object type");
+
+	if(recurse == "down")
+		XapiQueryDown(c, work, usernames, activePrefix, statsPrefix, objType, query, bbox, enc);
+	else if(recurse == "up")
+		XapiQueryUp(c, work, usernames, staticPrefix, activePrefix, statsPrefix, objType, query, bbox, enc);
+	else if(recurse == "none")
+	{
+		if(objType == "node" or objType == "*")
+			DbXapiQueryObjVisible(c, work, usernames, activePrefix, "node", query, bbox, enc, statsPrefix);
+		if(objType == "way" or objType == "*")
+			DbXapiQueryObjVisible(c, work, usernames, activePrefix, "way", query, bbox, enc, statsPrefix);
+		if(objType == "relation" or objType == "*")
+			DbXapiQueryObjVisible(c, work, usernames, activePrefix, "relation", query, bbox, enc, statsPrefix);
+	}
+	else
+		throw invalid_argument("Unknown recurse mode");
 }
 
+void DbXapiQueryObjVisible(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tablePrefix, 
+	const std::string &objType,
+	const std::string &tagKey,
+	const std::string &tagValue,
+	const std::vector<double> &bbox, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	class TagQuery query;
+	TagQueryFromKeyValue(tagKey, tagValue, query);
+	DbXapiQueryObjVisible(c, work, usernames, tablePrefix, objType, query, bbox, enc);
+}
@@ -5,18 +5,42 @@
 #include "cppo5m/o5m.h"
 #include "cppo5m/OsmData.h"
 #include "dbusername.h"
+#include "tagquery.h"
 
-//Returns complete objects
+//Checks that the regular expressions in query are accepted by Postgres, so a bad one is 
+//reported before any objects are written. work must be a transaction, since a savepoint is used.
+bool DbCheckTagQueryRegexes(pqxx::connection &c, pqxx::transaction_base *work, 
+	const class TagQuery &query, std::string &errStr);
+
+//Returns objects matching the query. recurse selects which other objects are added:
+//  "none"  only the matched objects
+//  "down"  members of matched ways and relations, members of those relations to 10 levels,
+//          and the nodes of all these ways, so every object is complete
+//  "up"    ways containing matched nodes and relations containing any of these, to 10 levels
+//Objects are written once each, nodes first then ways then relations. When there is both a
+//tag query and a bbox, the one that matches fewer objects is applied first, estimated from
+//the tag statistics in statsPrefix.
 void DbXapiQueryVisible(pqxx::connection &c, pqxx::transaction_base *work, 
 	class DbUsernameLookup &usernames, 
-	const std::string &tablePrefix, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::string &statsPrefix, 
 	const std::string &objType,
-	const std::string &tagKey,
-	const std::string &tagValue,
+	const class TagQuery &query,
 	const std::vector<double> &bbox, 
+	const std::string &recurse,
 	std::shared_ptr<IDataStreamHandler> enc);
 
-//Returns only objects of specified type
+//Returns only objects of specified type. statsPrefix defaults to tablePrefix.
+void DbXapiQueryObjVisible(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &tablePrefix, 
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox, 
+	std::shared_ptr<IDataStreamHandler> enc,
+	const std::string &statsPrefix = "");
+
 void DbXapiQueryObjVisible(pqxx::connection &c, pqxx::transaction_base *work, 
 	class DbUsernameLookup &usernames, 
 	const std::string &tablePrefix, 
@@ -0,0 +1,247 @@
+#include "dbparallel.h"
+#include "dbcommon.h"
+#include <iostream>
+#include <set>
+#include <thread>
+#include <mutex>
+#include <chrono>
+#include <condition_variable>
+using namespace std;
+
+DbParallelStep::DbParallelStep()
+{
+	state = 0;
+	seconds = 0.0;
+}
+
+DbParallelStep::DbParallelStep(const std::string &name, const std::vector<std::string> &sqls,
+		const std::vector<std::string> &dependsOn):
+	name(name),
+	sqls(sqls),
+	dependsOn(dependsOn)
+{
+	state = 0;
+	seconds = 0.0;
+}
+
+DbParallelStep::DbParallelStep(const DbParallelStep &obj)
+{
+	*this = obj;
+}
+
+DbParallelStep::~DbParallelStep()
+{
+
+}
+
+DbParallelStep& DbParallelStep::operator=(const DbParallelStep &obj)
+{
+	name = obj.name;
+	sqls = obj.sqls;
+	dependsOn = obj.dependsOn;
+	state = obj.state;
+	seconds = obj.seconds;
+	return *this;
+}
+
+// **********************************************
+
+static bool RunStep(pqxx::transaction_base *work, int verbose, class DbParallelStep &step, std::string &errStr)
+{
+	auto startTime = std::chrono::steady_clock::now();
+	bool ok = true;
+	for(size_t i=0; i<step.sqls.size() && ok; i++)
+		ok = DbExec(work, step.sqls[i], errStr, nullptr, verbose);
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - startTime;
+	step.seconds = elapsed.count();
+	if(!ok)
+		errStr = step.name + ": " + errStr;
+	return ok;
+}
+
+bool DbRunSteps(pqxx::transaction_base *work,
+	int verbose,
+	std::vector<class DbParallelStep> &steps,
+	std::string &errStr)
+{
+	for(size_t i=0; i<steps.size(); i++)
+	{
+		steps[i].state = 1;
+		bool ok = RunStep(work, verbose, steps[i], errStr);
+		if(!ok) return ok;
+		steps[i].state = 2;
+	}
+	return true;
+}
+
+// **********************************************
+
+class DbParallelScheduler
+{
+public:
+	std::vector<class DbParallelStep> &steps;
+	std::set<std::string> stepNames;
+	std::mutex mtx;
+	std::condition_variable stepDone;
+	bool failed;
+	std::string errStr;
+
+	DbParallelScheduler(std::vector<class DbParallelStep> &steps);
+
+	//Returns the index of the next ready step, or -1 if no more work can be done
+	int NextStep();
+	void StepFinished(int index, bool ok, const std::string &stepErrStr);
+	void Fail(const std::string &failErrStr);
+};
+
+DbParallelScheduler::DbParallelScheduler(std::vector<class DbParallelStep> &steps):
+	steps(steps)
+{
+	failed = false;
+	for(size_t i=0; i<steps.size(); i++)
+		stepNames.insert(steps[i].name);
+}
+
+int DbParallelScheduler::NextStep()
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(!this->failed)
+	{
+		bool pending = false, running = false;
+		for(size_t i=0; i<steps.size(); i++)
+		{
+			class DbParallelStep &step = steps[i];
+			if(step.state == 1) running = true;
+			if(step.state != 0) continue;
+			pending = true;
+
+			bool ready = true;
+			for(size_t j=0; j<step.dependsOn.size() && ready; j++)
+			{
+				const std::string &dep = step.dependsOn[j];
+				if(stepNames.find(dep) == stepNames.end())
+					continue;
+				for(size_t k=0; k<steps.size(); k++)
+					if(steps[k].name == dep && steps[k].state != 2)
+						ready = false;
+			}
+			if(ready)
+			{
+				step.state = 1;
+				return i;
+			}
+		}
+
+		if(!pending)
+			return -1;
+		if(!running)
+		{
+			this->failed = true;
+			this->errStr = "Step dependencies cannot be satisfied";
+			break;
+		}
+		this->stepDone.wait(lock);
+	}
+	this->stepDone.notify_all();
+	return -1;
+}
+
+void DbParallelScheduler::StepFinished(int index, bool ok, const std::string &stepErrStr)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	steps[index].state = 2;
+	if(!ok && !this->failed)
+	{
+		this->failed = true;
+		this->errStr = stepErrStr;
+	}
+	lock.unlock();
+	this->stepDone.notify_all();
+}
+
+void DbParallelScheduler::Fail(const std::string &failErrStr)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	if(!this->failed)
+	{
+		this->failed = true;
+		this->errStr = failErrStr;
+	}
+	lock.unlock();
+	this->stepDone.notify_all();
+}
+
+static void RunStepsWorker(const std::string &connectionString,
+	int verbose,
+	const std::string &maintenanceWorkMem,
+	class DbParallelScheduler *scheduler)
+{
+	try
+	{
+		pqxx::connection c(connectionString);
+		pqxx::nontransaction work(c);
+
+		if(maintenanceWorkMem.size() > 0)
+		{
+			string errStr;
+			bool ok = DbExec(&work, "SET maintenance_work_mem = "+c.quote(maintenanceWorkMem)+";", errStr, nullptr, verbose);
+			if(!ok)
+			{
+				scheduler->Fail(errStr);
+				return;
+			}
+		}
+
+		int index = scheduler->NextStep();
+		while(index >= 0)
+		{
+			string errStr;
+			bool ok = RunStep(&work, verbose, scheduler->steps[index], errStr);
+			if(verbose >= 1)
+			{
+				std::unique_lock<std::mutex> lock(scheduler->mtx);
+				cout << scheduler->steps[index].name << " took " << scheduler->steps[index].seconds << " sec" << endl;
+			}
+			scheduler->StepFinished(index, ok, errStr);
+			index = scheduler->NextStep();
+		}
+	}
+	catch (const std::exception &e)
+	{
+		scheduler->Fail(e.what());
+	}
+}
+
+bool DbRunStepsParallel(const std::string &connectionString,
+	int verbose,
+	int numConnections,
+	const std::string &maintenanceWorkMem,
+	std::vector<class DbParallelStep> &steps,
+	std::string &errStr)
+{
+	if(numConnections < 1)
+		numConnections = 1;
+	class DbParallelScheduler scheduler(steps);
+
+	std::vector<std::thread> workers;
+	for(int i=0; i<numConnections; i++)
+		workers.push_back(std::thread(RunStepsWorker, connectionString, verbose, maintenanceWorkMem, &scheduler));
+	for(size_t i=0; i<workers.size(); i++)
+		workers[i].join();
+
+	errStr = scheduler.errStr;
+	return !scheduler.failed;
+}
+
+void DbPrintStepTimings(const std::vector<class DbParallelStep> &steps)
+{
+	double total = 0.0;
+	for(size_t i=0; i<steps.size(); i++)
+	{
+		if(steps[i].state != 2) continue;
+		cout << steps[i].name << "\t" << steps[i].seconds << " sec" << endl;
+		total += steps[i].seconds;
+	}
+	cout << "Total step time " << total << " sec" << endl;
+}
+
@@ -0,0 +1,46 @@
+#ifndef _DB_PARALLEL_H
+#define _DB_PARALLEL_H
+
+#include <pqxx/pqxx> //apt install libpqxx-dev
+#include <string>
+#include <vector>
+
+//A unit of admin work. The SQL statements are run in order on a single connection,
+//after all the steps named in dependsOn have completed.
+class DbParallelStep
+{
+public:
+	DbParallelStep();
+	DbParallelStep(const std::string &name, const std::vector<std::string> &sqls,
+		const std::vector<std::string> &dependsOn);
+	DbParallelStep(const DbParallelStep &obj);
+	virtual ~DbParallelStep();
+	DbParallelStep& operator=(const DbParallelStep &obj);
+
+	std::string name;
+	std::vector<std::string> sqls;
+	std::vector<std::string> dependsOn;
+
+	int state; //0 pending, 1 running, 2 done
+	double seconds;
+};
+
+//Runs steps one at a time, in the order given, using an existing transaction
+bool DbRunSteps(pqxx::transaction_base *work,
+	int verbose,
+	std::vector<class DbParallelStep> &steps,
+	std::string &errStr);
+
+//Runs steps across numConnections new connections. Dependencies that do not name a step
+//in the list are considered to be satisfied. maintenanceWorkMem (e.g. "1GB") is set on
+//each session if it is not empty.
+bool DbRunStepsParallel(const std::string &connectionString,
+	int verbose,
+	int numConnections,
+	const std::string &maintenanceWorkMem,
+	std::vector<class DbParallelStep> &steps,
+	std::string &errStr);
+
+void DbPrintStepTimings(const std::vector<class DbParallelStep> &steps);
+
+#endif //_DB_PARALLEL_H
@@ -159,6 +159,122 @@ void GetLiveRelationsForObjects(pqxx::connection &c, pqxx::transaction_base *wor
 	RelationResultsToEncoder(cursor, usernames, skipIds, encUnique);
 }
 
+//Loads ids into a session temporary table, so large sets can be joined rather than written
+//into the query text. Returns the quoted table name.
+static string LoadIdTable(pqxx::connection &c, pqxx::transaction_base *work, 
+	const string &tableName, const set<int64_t> &ids)
+{
+	string table = c.quote_name(tableName);
+	work->exec("CREATE TEMP TABLE IF NOT EXISTS "+table+" (id BIGINT PRIMARY KEY);");
+	work->exec("DELETE FROM "+table+";");
+	if(ids.size() > 0)
+	{
+		pqxx::tablewriter writer(*work, tableName);
+		for(auto it=ids.begin(); it!=ids.end(); it++)
+			writer.write_raw_line(to_string(*it));
+		writer.complete();
+	}
+	work->exec("ANALYZE "+table+";");
+	return table;
+}
+
+//Subquery of (id, member) pairs for the current version of live parent objects, taking
+//the active table in preference to the static table.
+static string LiveParentMembersSql(pqxx::connection &c, 
+	const string &staticPrefix, 
+	const string &activePrefix, 
+	const string &parentType, const string &memTable)
+{
+	string sql = "SELECT m.id, m.member FROM "+c.quote_name(staticPrefix + memTable)+" m"\
+		" INNER JOIN "+c.quote_name(staticPrefix + "live" + parentType + "s")+" o ON m.id = o.id AND m.version = o.version"\
+		" LEFT JOIN "+c.quote_name(activePrefix + parentType + "ids")+" x ON o.id = x.id WHERE x.id IS NULL";
+	sql += " UNION ALL SELECT m.id, m.member FROM "+c.quote_name(activePrefix + memTable)+" m"\
+		" INNER JOIN "+c.quote_name(activePrefix + "live" + parentType + "s")+" o ON m.id = o.id AND m.version = o.version";
+	return "("+sql+")";
+}
+
+static string LiveObjectsSql(pqxx::connection &c, 
+	const string &staticPrefix, 
+	const string &activePrefix, 
+	const string &objType)
+{
+	string sql = "SELECT o.* FROM "+c.quote_name(staticPrefix + "live" + objType + "s")+" o"\
+		" LEFT JOIN "+c.quote_name(activePrefix + objType + "ids")+" x ON o.id = x.id WHERE x.id IS NULL";
+	sql += " UNION ALL SELECT o.* FROM "+c.quote_name(activePrefix + "live" + objType + "s")+" o";
+	return "("+sql+")";
+}
+
+void GetAffectedParentWays(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::set<int64_t> &nodeIds, 
+	const std::set<int64_t> &skipWayIds, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(nodeIds.size() == 0)
+		return;
+
+	string inputNodes = LoadIdTable(c, work, "affected_input_nodes", nodeIds);
+	string skipWays = LoadIdTable(c, work, "affected_skip_ways", skipWayIds);
+
+	string sql = "WITH parentways AS (SELECT DISTINCT p.id FROM "
+		+LiveParentMembersSql(c, staticPrefix, activePrefix, "way", "way_mems")+" p"\
+		" INNER JOIN "+inputNodes+" i ON p.member = i.id)";
+	sql += " SELECT l.* FROM "+LiveObjectsSql(c, staticPrefix, activePrefix, "way")+" l"\
+		" INNER JOIN parentways ON l.id = parentways.id"\
+		" LEFT JOIN "+skipWays+" s ON l.id = s.id WHERE s.id IS NULL;";
+
+	pqxx::icursorstream cursor( *work, sql, "affectedparentways", 1000 );
+
+	int records = 1;
+	while (records>0)
+		records = WayResultsToEncoder(cursor, usernames, enc);
+}
+
+void GetAffectedParentRelations(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::set<int64_t> &nodeIds, 
+	const std::set<int64_t> &wayIds, 
+	const std::set<int64_t> &relationIds, 
+	int maxDepth,
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(nodeIds.size() == 0 && wayIds.size() == 0 && relationIds.size() == 0)
+		return;
+
+	string wayMems = LiveParentMembersSql(c, staticPrefix, activePrefix, "way", "way_mems");
+	string relMemsN = LiveParentMembersSql(c, staticPrefix, activePrefix, "relation", "relation_mems_n");
+	string relMemsW = LiveParentMembersSql(c, staticPrefix, activePrefix, "relation", "relation_mems_w");
+	string relMemsR = LiveParentMembersSql(c, staticPrefix, activePrefix, "relation", "relation_mems_r");
+
+	string inputNodes = LoadIdTable(c, work, "affected_input_nodes", nodeIds);
+	string inputWays = LoadIdTable(c, work, "affected_input_ways", wayIds);
+	string inputRels = LoadIdTable(c, work, "affected_input_relations", relationIds);
+
+	//Ways that are affected are either given or are parents of the given nodes. Relations
+	//are found by walking up the membership graph from these to maxDepth levels.
+	stringstream sql;
+	sql << "WITH RECURSIVE inputnodes AS (SELECT id FROM "<<inputNodes<<"),";
+	sql << " affectedways AS (SELECT id FROM "<<inputWays;
+	sql << " UNION SELECT p.id FROM inputnodes INNER JOIN "<<wayMems<<" p ON p.member = inputnodes.id),";
+	sql << " affectedrels(id, depth) AS (SELECT id, 0 FROM "<<inputRels;
+	sql << " UNION SELECT p.id, 0 FROM inputnodes INNER JOIN "<<relMemsN<<" p ON p.member = inputnodes.id";
+	sql << " UNION SELECT p.id, 0 FROM affectedways INNER JOIN "<<relMemsW<<" p ON p.member = affectedways.id";
+	sql << " UNION SELECT p.id, r.depth + 1 FROM affectedrels r INNER JOIN "<<relMemsR<<" p ON p.member = r.id";
+	sql << " WHERE r.depth < " << maxDepth << ")";
+	sql << " SELECT l.* FROM "<<LiveObjectsSql(c, staticPrefix, activePrefix, "relation")<<" l";
+	sql << " LEFT JOIN "<<inputRels<<" x ON l.id = x.id";
+	sql << " WHERE l.id IN (SELECT id FROM affectedrels) AND x.id IS NULL;";
+
+	pqxx::icursorstream cursor( *work, sql.str(), "affectedparentrelations", 1000 );
+
+	set<int64_t> empty;
+	RelationResultsToEncoder(cursor, usernames, empty, enc);
+}
+
 void GetVisibleObjectsById(pqxx::connection &c, pqxx::transaction_base *work, 
 	class DbUsernameLookup &usernames, 
 	const string &tablePrefix, 
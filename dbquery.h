@@ -36,6 +36,28 @@ void GetLiveRelationsForObjects(pqxx::connection &c, pqxx::transaction_base *wor
 	const std::set<int64_t> &skipIds, 
 	std::shared_ptr<IDataStreamHandler> enc);
 
+//Parent ways of the given nodes, excluding skipWayIds, in a single query. The ids are loaded
+//into temporary tables, so any number can be given.
+void GetAffectedParentWays(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::set<int64_t> &nodeIds, 
+	const std::set<int64_t> &skipWayIds, 
+	std::shared_ptr<IDataStreamHandler> enc);
+
+//All relations that directly or recursively contain the given objects or the parent
+//ways of the given nodes, excluding the given relations. Resolved by one recursive query.
+void GetAffectedParentRelations(pqxx::connection &c, pqxx::transaction_base *work, 
+	class DbUsernameLookup &usernames, 
+	const std::string &staticPrefix, 
+	const std::string &activePrefix, 
+	const std::set<int64_t> &nodeIds, 
+	const std::set<int64_t> &wayIds, 
+	const std::set<int64_t> &relationIds, 
+	int maxDepth,
+	std::shared_ptr<IDataStreamHandler> enc);
+
 void GetVisibleObjectsById(pqxx::connection &c, pqxx::transaction_base *work, 
 	class DbUsernameLookup &usernames, 
 	const std::string &tablePrefix, 
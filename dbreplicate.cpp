@@ -1,103 +1,444 @@
 #include "dbreplicate.h"
 #include "dbdecode.h"
+#include "cppGzip/EncodeGzip.h"
+#include "cppo5m/osmxml.h"
+#include "dbjson.h"
 #include <set>
+#include <map>
+#include <fstream>
+#include <ctime>
+#include <cstdio>
+#include <boost/filesystem.hpp>
 using namespace std;
 
-void GetReplicateDiffNodes(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames,
-	const string &tablePrefix, 
-	bool selectOld,
-	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out)
+//Reads objects of one type from a timestamp ordered cursor
+class ReplicateDiffSource
 {
-	string nodeTable = c.quote_name(tablePrefix + "livenodes");
-	if(selectOld)
-		nodeTable = c.quote_name(tablePrefix + "oldnodes");
+private:
+	pqxx::icursorstream cursor;
+	class DbUsernameLookup &usernames;
+	int objType; //0 node, 1 way, 2 relation
+	std::shared_ptr<class OsmData> batch;
+	size_t pos;
+	bool done;
 
-	//Discourage sequential scans of tables, since they is not necessary and we want to avoid doing a sort
-	work->exec("set enable_seqscan to off;");
+	size_t BatchSize();
+	void Fill();
 
-	stringstream sql;
-	sql << "SELECT "<< nodeTable << ".*, ST_X(geom) as lon, ST_Y(geom) AS lat FROM ";
-	sql << nodeTable;
-	sql << " WHERE timestamp > " << timestampStart << " AND timestamp <= " << timestampEnd;
-	sql << " ORDER BY " << nodeTable << ".timestamp;";
+public:
+	ReplicateDiffSource(pqxx::transaction_base &work, class DbUsernameLookup &usernames, 
+		const std::string &sql, const std::string &cursorName, int objType);
 
-	pqxx::icursorstream cursor( *work, sql.str(), "nodediff", 1000 );	
+	bool Valid() {return !done;};
+	int ObjType() {return objType;};
+	int64_t PeekTimestamp();
+	void Emit(class OsmChange &out);
+};
 
-	std::shared_ptr<class OsmData> data = make_shared<class OsmData>();
-	int count = 1;
-	while(count > 0)
-		count = NodeResultsToEncoder(cursor, usernames, data);
+ReplicateDiffSource::ReplicateDiffSource(pqxx::transaction_base &work, class DbUsernameLookup &usernames, 
+	const std::string &sql, const std::string &cursorName, int objType):
+	cursor(work, sql, cursorName, 1000),
+	usernames(usernames),
+	objType(objType),
+	pos(0),
+	done(false)
+{
+	batch.reset(new class OsmData());
+	Fill();
+}
 
-	for(size_t i=0; i < data->nodes.size(); i++)
+size_t ReplicateDiffSource::BatchSize()
+{
+	if(objType == 0)
+		return batch->nodes.size();
+	if(objType == 1)
+		return batch->ways.size();
+	return batch->relations.size();
+}
+
+void ReplicateDiffSource::Fill()
+{
+	set<int64_t> empty;
+	while(pos >= BatchSize())
 	{
-		const class OsmObject &obj = data->nodes[i];
-		out.StoreOsmData(&obj, false);
+		batch->Clear();
+		pos = 0;
+		int count = 0;
+		if(objType == 0)
+			count = NodeResultsToEncoder(cursor, usernames, batch);
+		else if(objType == 1)
+			count = WayResultsToEncoder(cursor, usernames, batch);
+		else
+			count = RelationBatchToEncoder(cursor, usernames, empty, batch);
+		if(count == 0)
+		{
+			done = true;
+			return;
+		}
 	}
 }
 
-void GetReplicateDiffWays(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames,
-	const string &tablePrefix, 
-	bool selectOld,
-	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out)
+int64_t ReplicateDiffSource::PeekTimestamp()
 {
-	string wayTable = c.quote_name(tablePrefix + "liveways");
-	if(selectOld)
-		wayTable = c.quote_name(tablePrefix + "oldways");
+	if(objType == 0)
+		return batch->nodes[pos].metaData.timestamp;
+	if(objType == 1)
+		return batch->ways[pos].metaData.timestamp;
+	return batch->relations[pos].metaData.timestamp;
+}
 
-	//Discourage sequential scans of tables, since they is not necessary and we want to avoid doing a sort
+void ReplicateDiffSource::Emit(class OsmChange &out)
+{
+	if(objType == 0)
+		out.StoreOsmData(&batch->nodes[pos], false);
+	else if(objType == 1)
+		out.StoreOsmData(&batch->ways[pos], false);
+	else
+		out.StoreOsmData(&batch->relations[pos], false);
+	pos ++;
+	Fill();
+}
+
+static void FlushReplicateDiff(class OsmChange &pending, class IOsmChangeBlock &out)
+{
+	for(size_t i=0; i<pending.blocks.size(); i++)
+		out.StoreOsmData(pending.actions[i], pending.blocks[i], pending.ifunused[i]);
+	pending.Clear();
+}
+
+void GetReplicateDiffStream(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	int64_t timestampStart, int64_t timestampEnd,
+	class IOsmChangeBlock &out,
+	size_t batchSize)
+{
+	//Discourage sequential scans of tables, since they is not necessary and we want to avoid doing a sort.
+	//The setting only needs to be in effect while the cursors are declared.
 	work->exec("set enable_seqscan to off;");
 
-	stringstream sql;
-	sql << "SELECT " << wayTable << ".* FROM ";
-	sql << wayTable;
-	sql << " WHERE timestamp > " << timestampStart << " AND timestamp <= " << timestampEnd;
-	sql << " ORDER BY " << wayTable << ".timestamp;";
+	//Sources are in type order, so objects with equal timestamps are written nodes first
+	const std::string objTypes[] = {"node", "way", "relation"};
+	const std::string prefixes[] = {tableStaticPrefix, tableActivePrefix};
+	std::vector<std::shared_ptr<class ReplicateDiffSource> > sources;
+	for(int i=0; i<3; i++)
+	{
+		string geomCols;
+		if(i == 0)
+			geomCols = ", ST_X(geom) as lon, ST_Y(geom) AS lat";
+
+		for(int j=0; j<2; j++)
+		{
+			for(int k=0; k<2; k++)
+			{
+				string tableName = c.quote_name(prefixes[j] + (k == 0 ? "live" : "old") + objTypes[i] + "s");
+				stringstream sql;
+				sql << "SELECT " << tableName << ".*" << geomCols << " FROM " << tableName;
+				sql << " WHERE timestamp > " << timestampStart << " AND timestamp <= " << timestampEnd;
+				sql << " ORDER BY " << tableName << ".timestamp;";
 
-	pqxx::icursorstream cursor( *work, sql.str(), "waydiff", 1000 );	
+				string cursorName = "replicatediff" + to_string(sources.size());
+				sources.push_back(std::shared_ptr<class ReplicateDiffSource>(new class ReplicateDiffSource(*work, usernames, 
+					sql.str(), cursorName, i)));
+			}
+		}
+	}
 
-	std::shared_ptr<class OsmData> data = make_shared<class OsmData>();
-	int count = 1;
-	while (count > 0)
-		count = WayResultsToEncoder(cursor, usernames, data);
+	work->exec("reset enable_seqscan;");
 
-	for(size_t i=0; i < data->ways.size(); i++)
+	class OsmChange pending;
+	size_t pendingCount = 0;
+	while(true)
 	{
-		const class OsmObject &obj = data->ways[i];
-		out.StoreOsmData(&obj, false);
+		//Find the source with the earliest timestamp
+		int best = -1;
+		int64_t bestTimestamp = 0;
+		for(size_t i=0; i<sources.size(); i++)
+		{
+			if(!sources[i]->Valid()) continue;
+			int64_t timestamp = sources[i]->PeekTimestamp();
+			if(best < 0 || timestamp < bestTimestamp)
+			{
+				best = i;
+				bestTimestamp = timestamp;
+			}
+		}
+		if(best < 0)
+			break;
+
+		sources[best]->Emit(pending);
+		pendingCount ++;
+		if(pendingCount >= batchSize)
+		{
+			FlushReplicateDiff(pending, out);
+			pendingCount = 0;
+		}
 	}
+
+	FlushReplicateDiff(pending, out);
 }
 
-void GetReplicateDiffRelations(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames,
-	const string &tablePrefix, 
-	bool selectOld,
-	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out)
+// **********************************************
+
+OsmChangeToDataStream::OsmChangeToDataStream(std::shared_ptr<IDataStreamHandler> enc):
+	enc(enc),
+	started(false)
 {
-	string relationTable = c.quote_name(tablePrefix + "liverelations");
-	if(selectOld)
-		relationTable = c.quote_name(tablePrefix + "oldrelations");
 
-	//Discourage sequential scans of tables, since they is not necessary and we want to avoid doing a sort
-	work->exec("set enable_seqscan to off;");
+}
 
-	stringstream sql;
-	sql << "SELECT " << relationTable << ".* FROM ";
-	sql << relationTable;
-	sql << " WHERE timestamp > " << timestampStart << " AND timestamp <= " << timestampEnd;
-	sql << " ORDER BY " << relationTable << ".timestamp;";
+OsmChangeToDataStream::~OsmChangeToDataStream()
+{
+
+}
+
+void OsmChangeToDataStream::StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused)
+{
+	if(!started)
+	{
+		enc->StoreIsDiff(true);
+		started = true;
+	}
+
+	if(action != "delete")
+	{
+		StreamObjectsTo(osmData, *enc);
+		return;
+	}
+
+	class OsmData deleted(osmData);
+	for(size_t i=0; i<deleted.nodes.size(); i++)
+		deleted.nodes[i].metaData.visible = false;
+	for(size_t i=0; i<deleted.ways.size(); i++)
+		deleted.ways[i].metaData.visible = false;
+	for(size_t i=0; i<deleted.relations.size(); i++)
+		deleted.relations[i].metaData.visible = false;
+	StreamObjectsTo(deleted, *enc);
+}
+
+void OsmChangeToDataStream::Finish()
+{
+	if(!started)
+	{
+		enc->StoreIsDiff(true);
+		started = true;
+	}
+	enc->Finish();
+}
+
+// **********************************************
+
+//Fetches the given versions of objects of one type from the active live and old tables
+static void FetchObjectVersions(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableActivePrefix, 
+	const std::string &objType,
+	const std::vector<std::pair<int64_t, int64_t> > &idVers,
+	std::shared_ptr<class OsmData> out)
+{
+	if(idVers.size() == 0)
+		return;
+
+	stringstream values;
+	for(size_t i=0; i<idVers.size(); i++)
+	{
+		if(i > 0)
+			values << ",";
+		values << "(" << idVers[i].first << "," << idVers[i].second << ")";
+	}
 
-	pqxx::icursorstream cursor( *work, sql.str(), "relationdiff", 1000 );	
+	string geomCols;
+	if(objType == "node")
+		geomCols = ", ST_X(t.geom) as lon, ST_Y(t.geom) AS lat";
 
-	std::shared_ptr<class OsmData> data = make_shared<class OsmData>();
 	set<int64_t> empty;
-	RelationResultsToEncoder(cursor, usernames, empty, data);
+	const std::string liveOld[] = {"live", "old"};
+	for(int i=0; i<2; i++)
+	{
+		string tableName = c.quote_name(tableActivePrefix + liveOld[i] + objType + "s");
+		stringstream sql;
+		sql << "SELECT t.*" << geomCols << " FROM " << tableName << " AS t";
+		sql << " INNER JOIN (VALUES " << values.str() << ") AS v(id, version)";
+		sql << " ON t.id = v.id AND t.version = v.version;";
+
+		pqxx::icursorstream cursor( *work, sql.str(), "editversions", 1000 );
+		if(objType == "node")
+			while(NodeResultsToEncoder(cursor, usernames, out) > 0) {}
+		else if(objType == "way")
+			while(WayResultsToEncoder(cursor, usernames, out) > 0) {}
+		else
+			RelationResultsToEncoder(cursor, usernames, empty, out);
+	}
+}
+
+static void FlushEditActivityBatch(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableActivePrefix, 
+	std::vector<std::pair<int, std::pair<int64_t, int64_t> > > &pending,
+	class IOsmChangeBlock &out)
+{
+	const std::string objTypes[] = {"node", "way", "relation"};
+	std::shared_ptr<class OsmData> fetched(new class OsmData());
+	for(int i=0; i<3; i++)
+	{
+		std::vector<std::pair<int64_t, int64_t> > idVers;
+		for(size_t j=0; j<pending.size(); j++)
+			if(pending[j].first == i)
+				idVers.push_back(pending[j].second);
+		FetchObjectVersions(c, work, usernames, tableActivePrefix, objTypes[i], idVers, fetched);
+	}
+
+	//Write objects in the order the edits were made
+	std::map<std::pair<int64_t, int64_t>, const class OsmObject *> found[3];
+	for(size_t i=0; i<fetched->nodes.size(); i++)
+		found[0][make_pair(fetched->nodes[i].objId, (int64_t)fetched->nodes[i].metaData.version)] = &fetched->nodes[i];
+	for(size_t i=0; i<fetched->ways.size(); i++)
+		found[1][make_pair(fetched->ways[i].objId, (int64_t)fetched->ways[i].metaData.version)] = &fetched->ways[i];
+	for(size_t i=0; i<fetched->relations.size(); i++)
+		found[2][make_pair(fetched->relations[i].objId, (int64_t)fetched->relations[i].metaData.version)] = &fetched->relations[i];
+
+	class OsmChange change;
+	for(size_t j=0; j<pending.size(); j++)
+	{
+		auto it = found[pending[j].first].find(pending[j].second);
+		if(it == found[pending[j].first].end())
+			continue;
+		change.StoreOsmData(it->second, false);
+	}
+	FlushReplicateDiff(change, out);
+	pending.clear();
+}
+
+void GetReplicateDiffFromEditActivity(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableActivePrefix, 
+	int64_t timestampStart, int64_t timestampEnd,
+	class IOsmChangeBlock &out,
+	size_t batchSize)
+{
+	string activityTable = c.quote_name(tableActivePrefix + "edit_activity");
+	stringstream sql;
+	sql << "SELECT updated FROM " << activityTable;
+	sql << " WHERE timestamp > " << timestampStart << " AND timestamp <= " << timestampEnd;
+	sql << " ORDER BY timestamp, id;";
 
-	for(size_t i=0; i < data->relations.size(); i++)
+	pqxx::icursorstream cursor( *work, sql.str(), "editactivitydiff", 1000 );
+
+	//Pending (type, (id, version)) in edit order, with types 0 node, 1 way, 2 relation
+	std::vector<std::pair<int, std::pair<int64_t, int64_t> > > pending;
+	std::set<std::pair<int, std::pair<int64_t, int64_t> > > seen;
+	while(true)
 	{
-		const class OsmObject &obj = data->relations[i];
-		out.StoreOsmData(&obj, false);
+		pqxx::result rows;
+		cursor.get(rows);
+		if(rows.empty())
+			break;
+
+		for (pqxx::result::const_iterator ci = rows.begin(); ci != rows.end(); ++ci) 
+		{
+			if(ci[0].is_null())
+				continue;
+			string updatedJson = ci[0].as<string>();
+			std::vector<std::string> types;
+			std::vector<std::pair<int64_t, int64_t> > idVers;
+			DecodeObjTypeIdVers(updatedJson, types, idVers);
+
+			for(size_t i=0; i<types.size() && i<idVers.size(); i++)
+			{
+				int objType = -1;
+				if(types[i].size() > 0 && types[i][0] == 'n')
+					objType = 0;
+				else if(types[i].size() > 0 && types[i][0] == 'w')
+					objType = 1;
+				else if(types[i].size() > 0 && types[i][0] == 'r')
+					objType = 2;
+				if(objType < 0)
+					continue;
+
+				std::pair<int, std::pair<int64_t, int64_t> > key(objType, idVers[i]);
+				if(seen.find(key) != seen.end())
+					continue;
+				seen.insert(key);
+				pending.push_back(key);
+			}
+		}
+
+		if(pending.size() >= batchSize)
+			FlushEditActivityBatch(c, work, usernames, tableActivePrefix, pending, out);
 	}
+
+	FlushEditActivityBatch(c, work, usernames, tableActivePrefix, pending, out);
+}
+
+// **********************************************
+
+std::string ReplicateSequencePath(const std::string &basePath, int64_t sequenceNumber)
+{
+	if(sequenceNumber < 0 || sequenceNumber > 999999999)
+		throw invalid_argument("Sequence number out of range");
+	char buff[20];
+	snprintf(buff, sizeof(buff), "%03d/%03d/%03d", (int)(sequenceNumber / 1000000), 
+		(int)((sequenceNumber / 1000) % 1000), (int)(sequenceNumber % 1000));
+	return (boost::filesystem::path(basePath) / buff).string();
+}
+
+static void ReplaceFile(const std::string &tmpFina, const std::string &fina)
+{
+	boost::system::error_code ec;
+	boost::filesystem::rename(tmpFina, fina, ec);
+	if(ec)
+		throw runtime_error("Failed to rename "+tmpFina+" to "+fina+": "+ec.message());
 }
 
+void WriteReplicateState(const std::string &fina, int64_t sequenceNumber, int64_t timestamp)
+{
+	time_t t = timestamp;
+	struct tm tmv;
+	gmtime_r(&t, &tmv);
+	char dateBuff[50], timestampBuff[50];
+	strftime(dateBuff, sizeof(dateBuff), "%a %b %d %H:%M:%S UTC %Y", &tmv);
+	strftime(timestampBuff, sizeof(timestampBuff), "%Y-%m-%dT%H\\:%M\\:%SZ", &tmv);
+
+	string tmpFina = fina + ".tmp";
+	std::ofstream out(tmpFina.c_str(), std::ios::out | std::ios::trunc);
+	if(!out)
+		throw runtime_error("Failed to open "+tmpFina);
+	out << "#" << dateBuff << "\n";
+	out << "sequenceNumber=" << sequenceNumber << "\n";
+	out << "timestamp=" << timestampBuff << "\n";
+	out.close();
+	if(!out)
+		throw runtime_error("Failed to write "+tmpFina);
+
+	ReplaceFile(tmpFina, fina);
+}
+
+void WriteReplicateDiffFile(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &basePath, int64_t sequenceNumber,
+	int64_t timestampStart, int64_t timestampEnd,
+	bool fromEditActivity)
+{
+	string finaBase = ReplicateSequencePath(basePath, sequenceNumber);
+	boost::filesystem::create_directories(boost::filesystem::path(finaBase).parent_path());
+
+	string fina = finaBase + ".osc.gz";
+	string tmpFina = fina + ".tmp";
+	{
+		std::filebuf outfi;
+		if(outfi.open(tmpFina, std::ios::out | std::ios::binary) == nullptr)
+			throw runtime_error("Failed to open "+tmpFina);
+		class EncodeGzip gzipEnc(outfi);
+		{
+			class OsmChangeXmlEncode enc(gzipEnc, false);
+			if(fromEditActivity)
+				GetReplicateDiffFromEditActivity(c, work, usernames, 
+					tableActivePrefix, timestampStart, timestampEnd, enc);
+			else
+				GetReplicateDiffStream(c, work, usernames, 
+					tableStaticPrefix, tableActivePrefix, 
+					timestampStart, timestampEnd, enc);
+		}
+	}
+	ReplaceFile(tmpFina, fina);
+
+	WriteReplicateState(finaBase + ".state.txt", sequenceNumber, timestampEnd);
+}
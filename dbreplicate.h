@@ -7,23 +7,59 @@
 #include "cppo5m/o5m.h"
 #include "cppo5m/OsmData.h"
 
-void GetReplicateDiffNodes(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
-	const std::string &tablePrefix, 
-	bool selectOld,
+//Writes all objects changed in (timestampStart, timestampEnd] to out, in timestamp order. The 12
+//live/old tables of both prefixes are read through cursors and merged, so at most a few
+//batches of objects are held in memory. Objects are passed on in blocks of up to batchSize.
+void GetReplicateDiffStream(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
 	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out);
+	class IOsmChangeBlock &out,
+	size_t batchSize = 1000);
 
-void GetReplicateDiffWays(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
-	const std::string &tablePrefix, 
-	bool selectOld,
+//Writes the object versions created by edits in (timestampStart, timestampEnd], as recorded
+//in the active edit_activity table. Objects are fetched by (id, version) in batches of batchSize,
+//so the cost depends on the number of edits rather than the size of the map tables.
+void GetReplicateDiffFromEditActivity(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableActivePrefix, 
 	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out);
+	class IOsmChangeBlock &out,
+	size_t batchSize = 1000);
 
-void GetReplicateDiffRelations(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
-	const std::string &tablePrefix, 
-	bool selectOld,
+//Path of a diff in an osmosis style replication directory, without a file extension,
+//e.g. sequence 1234567 is basePath/001/234/567
+std::string ReplicateSequencePath(const std::string &basePath, int64_t sequenceNumber);
+
+//Writes an osmosis style state file. The file is written under a temporary name and renamed,
+//so readers never see a partial file.
+void WriteReplicateState(const std::string &fina, int64_t sequenceNumber, int64_t timestamp);
+
+//Writes the changes in (timestampStart, timestampEnd] to sequenceNumber.osc.gz and
+//sequenceNumber.state.txt. Existing files for the sequence are replaced. If fromEditActivity
+//is set, the changes are found using the edit_activity table rather than timestamp scans.
+void WriteReplicateDiffFile(pqxx::connection &c, pqxx::transaction_base *work, class DbUsernameLookup &usernames, 
+	const std::string &tableStaticPrefix, 
+	const std::string &tableActivePrefix, 
+	const std::string &basePath, int64_t sequenceNumber,
 	int64_t timestampStart, int64_t timestampEnd,
-	class OsmChange &out);
+	bool fromEditActivity = false);
+
+//Passes the objects of an osmChange to a data stream encoder, such as O5mEncode to write o5c.
+//Deleted objects are passed with the visible flag cleared.
+class OsmChangeToDataStream : public IOsmChangeBlock
+{
+private:
+	std::shared_ptr<IDataStreamHandler> enc;
+	bool started;
+
+public:
+	OsmChangeToDataStream(std::shared_ptr<IDataStreamHandler> enc);
+	virtual ~OsmChangeToDataStream();
+
+	virtual void StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused);
+	//Call after the last block to finish the output stream
+	void Finish();
+};
 
 #endif //_DB_REPLICATE_H
 
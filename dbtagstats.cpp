@@ -0,0 +1,254 @@
+#include "dbtagstats.h"
+#include "dbcommon.h"
+#include <cmath>
+#include <ctime>
+#include <sstream>
+#include <algorithm>
+using namespace std;
+
+#if PQXX_VERSION_MAJOR >= 6
+#define pqxxrow pqxx::row
+#else
+#define pqxxrow pqxx::result::tuple
+#endif
+
+bool DbBuildTagStats(pqxx::connection &c, pqxx::transaction_base *work,
+	int verbose,
+	const std::string &tablePrefix,
+	int64_t minValueCount,
+	double gridSize,
+	std::string &errStr)
+{
+	int majorVer=0, minorVer=0;
+	DbGetVersion(c, work, majorVer, minorVer);
+	if(majorVer < 9 || (majorVer == 9 && minorVer <= 3))
+	{
+		errStr = "Tag statistics need JSONB, which requires PostgreSQL 9.4 or later";
+		return false;
+	}
+	if(gridSize <= 0.0 || minValueCount < 1)
+	{
+		errStr = "Invalid statistics settings";
+		return false;
+	}
+
+	bool ok = true;
+	string keyTable = c.quote_name(tablePrefix+"tag_key_stats");
+	string valueTable = c.quote_name(tablePrefix+"tag_value_stats");
+	string gridTable = c.quote_name(tablePrefix+"density_grid");
+	string infoTable = c.quote_name(tablePrefix+"stats_info");
+
+	string sql = "CREATE TABLE IF NOT EXISTS "+keyTable+" (obj_type VARCHAR(16), key TEXT, count BIGINT, PRIMARY KEY(obj_type, key));";
+	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	sql = "CREATE TABLE IF NOT EXISTS "+valueTable+" (obj_type VARCHAR(16), key TEXT, value TEXT, count BIGINT, PRIMARY KEY(obj_type, key, value));";
+	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	sql = "CREATE TABLE IF NOT EXISTS "+gridTable+" (obj_type VARCHAR(16), x INTEGER, y INTEGER, count BIGINT, PRIMARY KEY(obj_type, x, y));";
+	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	sql = "CREATE TABLE IF NOT EXISTS "+infoTable+" (obj_type VARCHAR(16), total BIGINT, min_value_count BIGINT, grid_size DOUBLE PRECISION, timestamp BIGINT, PRIMARY KEY(obj_type));";
+	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+
+	sql = "TRUNCATE "+keyTable+", "+valueTable+", "+gridTable+", "+infoTable+";";
+	ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+
+	std::vector<std::string> objTypes = {"node", "way", "relation"};
+	for(size_t i=0; i<objTypes.size(); i++)
+	{
+		const string &objType = objTypes[i];
+		string objTable = c.quote_name(tablePrefix+"visible"+objType+"s");
+		string typeStr = c.quote(objType);
+
+		sql = "INSERT INTO "+keyTable+" (obj_type, key, count) SELECT "+typeStr+", k, COUNT(*) FROM "+objTable+", jsonb_object_keys(tags) AS k GROUP BY k;";
+		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+
+		stringstream ss;
+		ss << "INSERT INTO "<<valueTable<<" (obj_type, key, value, count) SELECT "<<typeStr<<", kv.key, kv.value, COUNT(*)";
+		ss << " FROM "<<objTable<<", jsonb_each_text(tags) AS kv GROUP BY kv.key, kv.value HAVING COUNT(*) >= "<<minValueCount<<";";
+		ok = DbExec(work, ss.str(), errStr, nullptr, verbose); if(!ok) return ok;
+
+		string geomCol = "geom", centre = "geom";
+		if(objType != "node")
+		{
+			geomCol = "bbox";
+			centre = "ST_Centroid(bbox)";
+		}
+		ss.str("");
+		ss.precision(17);
+		ss << "INSERT INTO "<<gridTable<<" (obj_type, x, y, count) SELECT "<<typeStr<<", x, y, COUNT(*) FROM";
+		ss << " (SELECT FLOOR((ST_X("<<centre<<") + 180.0) / "<<gridSize<<")::INTEGER AS x,";
+		ss << " FLOOR((ST_Y("<<centre<<") + 90.0) / "<<gridSize<<")::INTEGER AS y";
+		ss << " FROM "<<objTable<<" WHERE "<<geomCol<<" IS NOT NULL) AS cells GROUP BY x, y;";
+		ok = DbExec(work, ss.str(), errStr, nullptr, verbose); if(!ok) return ok;
+
+		ss.str("");
+		ss << "INSERT INTO "<<infoTable<<" (obj_type, total, min_value_count, grid_size, timestamp) SELECT ";
+		ss << typeStr<<", COUNT(*), "<<minValueCount<<", "<<gridSize<<", "<<(int64_t)time(nullptr)<<" FROM "<<objTable<<";";
+		ok = DbExec(work, ss.str(), errStr, nullptr, verbose); if(!ok) return ok;
+	}
+
+	return ok;
+}
+
+bool DbDropTagStats(pqxx::connection &c, pqxx::transaction_base *work,
+	int verbose,
+	const std::string &tablePrefix,
+	std::string &errStr)
+{
+	bool ok = true;
+	std::vector<std::string> tables = {"tag_key_stats", "tag_value_stats", "density_grid", "stats_info"};
+	for(size_t i=0; i<tables.size(); i++)
+	{
+		string sql = "DROP TABLE IF EXISTS "+c.quote_name(tablePrefix+tables[i])+" CASCADE;";
+		ok = DbExec(work, sql, errStr, nullptr, verbose); if(!ok) return ok;
+	}
+	return ok;
+}
+
+// **********************************************
+
+DbStatsEstimate::DbStatsEstimate():
+	total(0),
+	tagSelectivity(1.0),
+	bboxSelectivity(1.0),
+	timestamp(0)
+{
+
+}
+
+DbStatsEstimate::~DbStatsEstimate()
+{
+
+}
+
+static int64_t GetKeyCount(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tablePrefix,
+	const std::string &objType,
+	const std::string &key)
+{
+	string sql = "SELECT count FROM "+c.quote_name(tablePrefix+"tag_key_stats")+
+		" WHERE obj_type = "+c.quote(objType)+" AND key = "+c.quote(key)+";";
+	pqxx::result r = work->exec(sql);
+	if(r.size() == 0)
+		return 0;
+	return r[0][0].as<int64_t>();
+}
+
+static double TagSelectivity(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tablePrefix,
+	const std::string &objType,
+	const class TagQuery &query,
+	int64_t total, int64_t minValueCount)
+{
+	if(query.type == TagQuery::ALL_OF)
+	{
+		//Assume the parts are independent
+		double sel = 1.0;
+		for(size_t i=0; i<query.children.size(); i++)
+			sel *= TagSelectivity(c, work, tablePrefix, objType, query.children[i], total, minValueCount);
+		return sel;
+	}
+	if(query.type == TagQuery::ANY_OF)
+	{
+		double notSel = 1.0;
+		for(size_t i=0; i<query.children.size(); i++)
+			notSel *= 1.0 - TagSelectivity(c, work, tablePrefix, objType, query.children[i], total, minValueCount);
+		return 1.0 - notSel;
+	}
+	if(total <= 0)
+		return 0.0;
+
+	int64_t keyCount = GetKeyCount(c, work, tablePrefix, objType, query.key);
+	if(query.type != TagQuery::VALUE_IN || keyCount == 0)
+		return (double)keyCount / total;
+
+	stringstream sql;
+	sql << "SELECT value, count FROM " << c.quote_name(tablePrefix+"tag_value_stats");
+	sql << " WHERE obj_type = " << c.quote(objType) << " AND key = " << c.quote(query.key) << " AND value IN (";
+	for(size_t i=0; i<query.values.size(); i++)
+	{
+		if(i > 0)
+			sql << ",";
+		sql << c.quote(query.values[i]);
+	}
+	sql << ");";
+	pqxx::result r = work->exec(sql.str());
+
+	int64_t count = 0;
+	for (unsigned int rownum=0; rownum < r.size(); ++rownum)
+		count += r[rownum][1].as<int64_t>();
+	//Values that are not in the table occur less than minValueCount times
+	int64_t missing = (int64_t)query.values.size() - (int64_t)r.size();
+	if(missing > 0)
+		count += missing * std::min(minValueCount - 1, keyCount);
+	count = std::min(count, keyCount);
+	return (double)count / total;
+}
+
+static double BboxSelectivity(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tablePrefix,
+	const std::string &objType,
+	const std::vector<double> &bbox,
+	double gridSize)
+{
+	string gridTable = c.quote_name(tablePrefix+"density_grid");
+	string sql = "SELECT COALESCE(SUM(count), 0) FROM "+gridTable+" WHERE obj_type = "+c.quote(objType)+";";
+	pqxx::result r = work->exec(sql);
+	int64_t gridTotal = r[0][0].as<int64_t>();
+	if(gridTotal <= 0)
+		return 0.0;
+
+	int x1 = (int)floor((bbox[0] + 180.0) / gridSize);
+	int y1 = (int)floor((bbox[1] + 90.0) / gridSize);
+	int x2 = (int)floor((bbox[2] + 180.0) / gridSize);
+	int y2 = (int)floor((bbox[3] + 90.0) / gridSize);
+
+	stringstream ss;
+	ss << "SELECT x, y, count FROM " << gridTable << " WHERE obj_type = " << c.quote(objType);
+	ss << " AND x BETWEEN " << x1 << " AND " << x2 << " AND y BETWEEN " << y1 << " AND " << y2 << ";";
+	r = work->exec(ss.str());
+
+	//Objects are assumed to be spread evenly within each cell
+	double matched = 0.0;
+	for (unsigned int rownum=0; rownum < r.size(); ++rownum)
+	{
+		const pqxxrow row = r[rownum];
+		int x = row[0].as<int>();
+		int y = row[1].as<int>();
+		double cellLon1 = x * gridSize - 180.0, cellLat1 = y * gridSize - 90.0;
+		double fx = (std::min(bbox[2], cellLon1 + gridSize) - std::max(bbox[0], cellLon1)) / gridSize;
+		double fy = (std::min(bbox[3], cellLat1 + gridSize) - std::max(bbox[1], cellLat1)) / gridSize;
+		if(fx <= 0.0 || fy <= 0.0)
+			continue;
+		matched += row[2].as<int64_t>() * fx * fy;
+	}
+	return std::min(matched / gridTotal, 1.0);
+}
+
+bool DbEstimateObjects(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tablePrefix,
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox,
+	class DbStatsEstimate &out)
+{
+	out = DbStatsEstimate();
+
+	//Reading a missing table would abort the transaction, so check first
+	if(!DbCheckTableExists(c, work, tablePrefix+"stats_info"))
+		return false;
+
+	string sql = "SELECT total, min_value_count, grid_size, timestamp FROM "+c.quote_name(tablePrefix+"stats_info")+
+		" WHERE obj_type = "+c.quote(objType)+";";
+	pqxx::result r = work->exec(sql);
+	if(r.size() == 0)
+		return false;
+	out.total = r[0][0].as<int64_t>();
+	int64_t minValueCount = r[0][1].as<int64_t>();
+	double gridSize = r[0][2].as<double>();
+	out.timestamp = r[0][3].as<int64_t>();
+
+	if(!query.MatchesAll())
+		out.tagSelectivity = TagSelectivity(c, work, tablePrefix, objType, query, out.total, minValueCount);
+	if(bbox.size() == 4)
+		out.bboxSelectivity = BboxSelectivity(c, work, tablePrefix, objType, bbox, gridSize);
+	return true;
+}
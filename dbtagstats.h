@@ -0,0 +1,46 @@
+#ifndef _DB_TAG_STATS_H
+#define _DB_TAG_STATS_H
+
+#include <pqxx/pqxx>
+#include <string>
+#include <vector>
+#include "tagquery.h"
+
+//Statistics of the visible objects of tablePrefix, for estimating how many objects a query
+//matches before running it. The tables hold the number of objects with each key, the number
+//with each key=value that occurs at least minValueCount times, and the number of objects
+//in each cell of a gridSize degree grid (by bbox centre for ways and relations). They are a
+//snapshot, so rebuild them after large imports.
+bool DbBuildTagStats(pqxx::connection &c, pqxx::transaction_base *work,
+	int verbose,
+	const std::string &tablePrefix,
+	int64_t minValueCount,
+	double gridSize,
+	std::string &errStr);
+
+bool DbDropTagStats(pqxx::connection &c, pqxx::transaction_base *work,
+	int verbose,
+	const std::string &tablePrefix,
+	std::string &errStr);
+
+class DbStatsEstimate
+{
+public:
+	DbStatsEstimate();
+	virtual ~DbStatsEstimate();
+
+	int64_t total; //Objects of the type
+	double tagSelectivity, bboxSelectivity; //Fraction of objects matched
+	int64_t timestamp; //When the statistics were built
+};
+
+//Returns false if statistics have not been built for this type. Unknown values of a key are
+//assumed to be just below minValueCount, and a regex to match every object with the key.
+bool DbEstimateObjects(pqxx::connection &c, pqxx::transaction_base *work,
+	const std::string &tablePrefix,
+	const std::string &objType,
+	const class TagQuery &query,
+	const std::vector<double> &bbox,
+	class DbStatsEstimate &out);
+
+#endif //_DB_TAG_STATS_H
@@ -4,20 +4,129 @@
 #include "util.h"
 #include "cppGzip/EncodeGzip.h"
 #include "cppo5m/osmxml.h"
+#include "pbfencodeparallel.h"
+#include "datastreamtee.h"
+#include <thread>
+#include <boost/program_options.hpp>
+#include <boost/iostreams/filtering_streambuf.hpp>
+#include <boost/iostreams/filter/bzip2.hpp>
+namespace po = boost::program_options;
 
-int main(int argc, char **argv)
-{	
+class DumpOutput
+{
+public:
 	std::filebuf outfi;
-	outfi.open("dump.o5m.gz", std::ios::out);
-	EncodeGzip *gzipEnc = new class EncodeGzip(outfi);
+	std::shared_ptr<std::streambuf> compressor;
+	shared_ptr<IDataStreamHandler> enc;
+
+	virtual ~DumpOutput()
+	{
+		enc.reset();
+		compressor.reset();
+		outfi.close();
+	}
+};
+
+//Opens an output file, with the format based on the file extension
+static std::shared_ptr<class DumpOutput> OpenDumpOutput(const std::string &outFina, int numThreads, bool history)
+{
+	std::shared_ptr<class DumpOutput> out(new class DumpOutput());
+	vector<string> outFinaSp = split(outFina, '.');
+	if(outFinaSp.size() < 3)
+		throw invalid_argument("Output file name does not have a recognized extension");
+	const string &ext1 = outFinaSp[outFinaSp.size()-2];
+	const string &ext2 = outFinaSp[outFinaSp.size()-1];
+	TagMap empty;
+
+	out->outfi.open(outFina, std::ios::out | std::ios::binary);
+	if(ext1 == "o5m" && ext2 == "gz")
+	{
+		out->compressor.reset(new class EncodeGzip(out->outfi));
+		out->enc.reset(new O5mEncode(*out->compressor));
+	}
+	else if(ext1 == "osm" && ext2 == "gz")
+	{
+		out->compressor.reset(new class EncodeGzip(out->outfi));
+		out->enc.reset(new OsmXmlEncode(*out->compressor, empty));
+	}
+	else if(ext1 == "osm" && ext2 == "bz2")
+	{
+		boost::iostreams::filtering_ostreambuf *bz2 = new boost::iostreams::filtering_ostreambuf();
+		bz2->push(boost::iostreams::bzip2_compressor());
+		bz2->push(out->outfi);
+		out->compressor.reset(bz2);
+		out->enc.reset(new OsmXmlEncode(*out->compressor, empty));
+	}
+	else if(ext1 == "osm" && ext2 == "pbf")
+	{
+		out->enc.reset(new PbfEncodeParallel(out->outfi, numThreads, 8000, history));
+	}
+	else
+		throw invalid_argument("Output file name does not have a recognized extension");
+	return out;
+}
+
+int main(int argc, char **argv)
+{
+	// Declare the supported options.
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("history", "Dump all versions of objects, including deleted versions")
+		("out", po::value<vector<string> >()->composing(),
+			"Output file name, may be repeated to write several formats in one pass (extension must be .o5m.gz, .osm.gz, .osm.bz2 or .osm.pbf)")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
 
-	shared_ptr<IDataStreamHandler> enc(new O5mEncode(*gzipEnc));
+	if (vm.count("help")) {
+		cout << desc << "\n";
+		return 1;
+	}
 
 	cout << "Reading settings from config.cfg" << endl;
 	std::map<string, string> config;
 	ReadSettingsFile("config.cfg", config);
-	
-	string cstr = GeneratePgConnectionString(config);	
+
+	bool history = vm.count("history") > 0;
+	int numThreads = std::thread::hardware_concurrency();
+	if(config.find("dump_threads") != config.end())
+		numThreads = atoi(config["dump_threads"].c_str());
+
+	vector<string> outFinas;
+	if (vm.count("out"))
+		outFinas = vm["out"].as<vector<string> >();
+	else if(config["dump_format"] == "pbf")
+		outFinas.push_back("dump.osm.pbf");
+	else
+		outFinas.push_back("dump.o5m.gz");
+
+	std::vector<std::shared_ptr<class DumpOutput> > outputs;
+	std::vector<shared_ptr<IDataStreamHandler> > encoders;
+	for(size_t i=0; i<outFinas.size(); i++)
+	{
+		try
+		{
+			outputs.push_back(OpenDumpOutput(outFinas[i], numThreads, history));
+		}
+		catch (invalid_argument &err)
+		{
+			cerr << outFinas[i] << ": " << err.what() << endl;
+			exit(-2);
+		}
+		encoders.push_back(outputs[i]->enc);
+	}
+
+	//Each output format is encoded on its own thread
+	shared_ptr<IDataStreamHandler> enc;
+	if(encoders.size() == 1)
+		enc = encoders[0];
+	else
+		enc.reset(new DataStreamTee(encoders));
+
+	string cstr = GeneratePgConnectionString(config);
 	class PgMap pgMap(cstr, config["dbtableprefix"], config["dbtablemodifyprefix"], config["dbtablemodifyprefix"], config["dbtabletestprefix"]);
 
 	if (pgMap.Ready()) {
@@ -27,13 +136,28 @@ int main(int argc, char **argv)
 		return 1;
 	}
 	bool order = true;
+	int numWorkers = 0;
+	if(config.find("dump_workers") != config.end())
+		numWorkers = atoi(config["dump_workers"].c_str());
+	int64_t rangeSize = 100000;
+	if(config.find("dump_range_size") != config.end())
+		rangeSize = atol(config["dump_range_size"].c_str());
+	bool merge = atoi(config["dump_merge"].c_str()) != 0;
 
 	std::shared_ptr<class PgTransaction> transaction = pgMap.GetTransaction("ACCESS SHARE");
-	transaction->Dump(order, true, true, true, enc);
+	if(history)
+		transaction->DumpHistory(true, true, true, enc);
+	else if(numWorkers > 0)
+		transaction->DumpParallel(numWorkers, rangeSize, true, true, true, enc);
+	else if(merge)
+		transaction->DumpMerged(true, true, true, enc);
+	else
+		transaction->Dump(order, true, true, true, enc);
+
+	enc.reset();
+	encoders.clear();
+	outputs.clear();
 
-	delete gzipEnc;
-	outfi.close();
-	
 	cout << "Add done!" << endl;
 	return 0;
 }
@@ -6,6 +6,8 @@
 #include <sstream>
 #include "dbjson.h"
 #include "util.h"
+#include "spatialsort.h"
+#include "copyrow.h"
 using namespace std;
 
 /*
@@ -31,13 +33,6 @@ Import from fosm.org 2015 dump
 COPY planet_relations TO PROGRAM 'gzip > /home/postgres/dumprelations.gz' WITH (FORMAT 'csv', DELIMITER ',', NULL 'NULL');
 */
 
-inline string Int64ToStr(int64_t val)
-{
-	stringstream ss;
-	ss << val;
-	return ss.str();
-}
-
 class CsvStore : public IDataStreamHandler
 {
 private:
@@ -48,8 +43,31 @@ private:
 	std::shared_ptr<class EncodeGzip> nodeIdsFileGzip, wayIdsFileGzip, relationIdsFileGzip;
 	std::shared_ptr<class EncodeGzip> wayMembersFileGzip, relationMemNodesFileGzip, relationMemWaysFileGzip, relationMemRelsFileGzip;
 
+	//Files are in PostgreSQL binary COPY format, rather than csv
+	bool binaryFormat;
+	std::shared_ptr<class ICopyRowWriter> rowWriter;
+
+	//Spatial sorting of object rows
+	bool spatialSort;
+	std::shared_ptr<class ExternalSort> livenodeSort, livewaySort, liverelationSort, oldnodeSort, oldwaySort, oldrelationSort;
+	std::shared_ptr<class ExternalSort> nodeKeys, nodeRequests, wayKeys, wayRequests;
+
+	void AddWayRow(char reqType, int64_t objId, int64_t version, const std::vector<int64_t> &refs, const std::string &row);
+	void AddRelationRow(char reqType, int64_t objId, int64_t version, const std::vector<std::string> &refTypeStrs, 
+		const std::vector<int64_t> &refIds, const std::string &row);
+	void ResolveRequests(class ExternalSort &keys, class ExternalSort &requests, bool storeWayKeys);
+	void WriteSorted(class ExternalSort &sorted, std::shared_ptr<class EncodeGzip> out);
+
+	std::vector<std::shared_ptr<class EncodeGzip> > AllOutputs();
+	void WriteId(int64_t objId, class EncodeGzip &out);
+	void WriteMember(int64_t objId, int64_t version, size_t index, int64_t memberId, class EncodeGzip &out);
+
 public:
-	CsvStore(const std::string &outPrefix);
+	CsvStore(const std::string &outPrefix, bool binaryFormat);
+	//Rows of objects are written in Hilbert curve order. Nodes are keyed on their position, ways 
+	//on their first node and relations on their first node or way member. Members are referenced
+	//by ID only, so with history input the latest version of the member is used.
+	CsvStore(const std::string &outPrefix, bool binaryFormat, const std::string &sortTempPrefix, size_t sortMemBytes);
 	virtual ~CsvStore();
 
 	virtual bool Sync() {return false;};
@@ -68,43 +86,86 @@ public:
 
 };
 
-CsvStore::CsvStore(const std::string &outPrefix)
+CsvStore::CsvStore(const std::string &outPrefix, bool binaryFormat, const std::string &sortTempPrefix, size_t sortMemBytes):
+	CsvStore(outPrefix, binaryFormat)
 {
-	cout << outPrefix+"livenodes.csv.gz" << endl;
-	livenodeFile.open(outPrefix+"livenodes.csv.gz", std::ios::out | std::ios::binary);
+	//Memory is shared between the sorters
+	size_t mem = sortMemBytes / 10;
+	spatialSort = true;
+	livenodeSort.reset(new class ExternalSort(sortTempPrefix, mem));
+	livewaySort.reset(new class ExternalSort(sortTempPrefix, mem));
+	liverelationSort.reset(new class ExternalSort(sortTempPrefix, mem));
+	oldnodeSort.reset(new class ExternalSort(sortTempPrefix, mem));
+	oldwaySort.reset(new class ExternalSort(sortTempPrefix, mem));
+	oldrelationSort.reset(new class ExternalSort(sortTempPrefix, mem));
+	nodeKeys.reset(new class ExternalSort(sortTempPrefix, mem));
+	nodeRequests.reset(new class ExternalSort(sortTempPrefix, mem));
+	wayKeys.reset(new class ExternalSort(sortTempPrefix, mem));
+	wayRequests.reset(new class ExternalSort(sortTempPrefix, mem));
+}
+
+CsvStore::CsvStore(const std::string &outPrefix, bool binaryFormat):
+	binaryFormat(binaryFormat)
+{
+	spatialSort = false;
+	if(binaryFormat)
+		rowWriter.reset(new class CopyBinaryRow());
+	else
+		rowWriter.reset(new class CsvRow());
+	string ext = binaryFormat ? ".pgcopy.gz" : ".csv.gz";
+	cout << outPrefix+"livenodes"+ext << endl;
+	livenodeFile.open(outPrefix+"livenodes"+ext, std::ios::out | std::ios::binary);
 	if(!livenodeFile.is_open()) throw runtime_error("Error opening output");
 	livenodeFileGzip.reset(new class EncodeGzip(livenodeFile));
-	livewayFile.open(outPrefix+"liveways.csv.gz", std::ios::out | std::ios::binary);
+	livewayFile.open(outPrefix+"liveways"+ext, std::ios::out | std::ios::binary);
 	livewayFileGzip.reset(new class EncodeGzip(livewayFile));
-	liverelationFile.open(outPrefix+"liverelations.csv.gz", std::ios::out | std::ios::binary);
+	liverelationFile.open(outPrefix+"liverelations"+ext, std::ios::out | std::ios::binary);
 	liverelationFileGzip.reset(new class EncodeGzip(liverelationFile));
 
-	oldnodeFile.open(outPrefix+"oldnodes.csv.gz", std::ios::out | std::ios::binary);
+	oldnodeFile.open(outPrefix+"oldnodes"+ext, std::ios::out | std::ios::binary);
 	oldnodeFileGzip.reset(new class EncodeGzip(oldnodeFile));
-	oldwayFile.open(outPrefix+"oldways.csv.gz", std::ios::out | std::ios::binary);
+	oldwayFile.open(outPrefix+"oldways"+ext, std::ios::out | std::ios::binary);
 	oldwayFileGzip.reset(new class EncodeGzip(oldwayFile));
-	oldrelationFile.open(outPrefix+"oldrelations.csv.gz", std::ios::out | std::ios::binary);
+	oldrelationFile.open(outPrefix+"oldrelations"+ext, std::ios::out | std::ios::binary);
 	oldrelationFileGzip.reset(new class EncodeGzip(oldrelationFile));
 
-	nodeIdsFile.open(outPrefix+"nodeids.csv.gz", std::ios::out | std::ios::binary);
+	nodeIdsFile.open(outPrefix+"nodeids"+ext, std::ios::out | std::ios::binary);
 	nodeIdsFileGzip.reset(new class EncodeGzip(nodeIdsFile));
-	wayIdsFile.open(outPrefix+"wayids.csv.gz", std::ios::out | std::ios::binary);
+	wayIdsFile.open(outPrefix+"wayids"+ext, std::ios::out | std::ios::binary);
 	wayIdsFileGzip.reset(new class EncodeGzip(wayIdsFile));
-	relationIdsFile.open(outPrefix+"relationids.csv.gz", std::ios::out | std::ios::binary);
+	relationIdsFile.open(outPrefix+"relationids"+ext, std::ios::out | std::ios::binary);
 	relationIdsFileGzip.reset(new class EncodeGzip(relationIdsFile));
 
-	wayMembersFile.open(outPrefix+"waymems.csv.gz", std::ios::out | std::ios::binary);
+	wayMembersFile.open(outPrefix+"waymems"+ext, std::ios::out | std::ios::binary);
 	wayMembersFileGzip.reset(new class EncodeGzip(wayMembersFile));
-	relationMemNodesFile.open(outPrefix+"relationmems-n.csv.gz", std::ios::out | std::ios::binary);
+	relationMemNodesFile.open(outPrefix+"relationmems-n"+ext, std::ios::out | std::ios::binary);
 	relationMemNodesFileGzip.reset(new class EncodeGzip(relationMemNodesFile));
-	relationMemWaysFile.open(outPrefix+"relationmems-w.csv.gz", std::ios::out | std::ios::binary);
+	relationMemWaysFile.open(outPrefix+"relationmems-w"+ext, std::ios::out | std::ios::binary);
 	relationMemWaysFileGzip.reset(new class EncodeGzip(relationMemWaysFile));
-	relationMemRelsFile.open(outPrefix+"relationmems-r.csv.gz", std::ios::out | std::ios::binary);
+	relationMemRelsFile.open(outPrefix+"relationmems-r"+ext, std::ios::out | std::ios::binary);
 	relationMemRelsFileGzip.reset(new class EncodeGzip(relationMemRelsFile));
+
+	if(binaryFormat)
+	{
+		string header;
+		CopyBinaryHeader(header);
+		std::vector<std::shared_ptr<class EncodeGzip> > outputs = AllOutputs();
+		for(size_t i=0; i<outputs.size(); i++)
+			outputs[i]->sputn(header.c_str(), header.size());
+	}
 }
 
 CsvStore::~CsvStore()
 {
+	if(binaryFormat)
+	{
+		string trailer;
+		CopyBinaryTrailer(trailer);
+		std::vector<std::shared_ptr<class EncodeGzip> > outputs = AllOutputs();
+		for(size_t i=0; i<outputs.size(); i++)
+			outputs[i]->sputn(trailer.c_str(), trailer.size());
+	}
+
 	livenodeFileGzip.reset();
 	livenodeFile.close();
 	livewayFileGzip.reset();
@@ -136,60 +197,187 @@ CsvStore::~CsvStore()
 	relationMemRelsFile.close();
 }
 
+std::vector<std::shared_ptr<class EncodeGzip> > CsvStore::AllOutputs()
+{
+	return {livenodeFileGzip, livewayFileGzip, liverelationFileGzip, oldnodeFileGzip, oldwayFileGzip, oldrelationFileGzip,
+		nodeIdsFileGzip, wayIdsFileGzip, relationIdsFileGzip,
+		wayMembersFileGzip, relationMemNodesFileGzip, relationMemWaysFileGzip, relationMemRelsFileGzip};
+}
+
+void CsvStore::WriteId(int64_t objId, class EncodeGzip &out)
+{
+	string row;
+	CopyRowId(*rowWriter, objId);
+	rowWriter->EndRow(row);
+	out.sputn(row.c_str(), row.size());
+}
+
+void CsvStore::WriteMember(int64_t objId, int64_t version, size_t index, int64_t memberId, class EncodeGzip &out)
+{
+	string row;
+	CopyRowMember(*rowWriter, objId, version, index, memberId);
+	rowWriter->EndRow(row);
+	out.sputn(row.c_str(), row.size());
+}
+
+void CsvStore::AddWayRow(char reqType, int64_t objId, int64_t version, const std::vector<int64_t> &refs, const std::string &row)
+{
+	string payload = reqType + EncodeSortKey(objId) + EncodeSortKey(version) + row;
+	if(refs.size() > 0)
+		this->nodeRequests->Add(refs[0], payload);
+	else
+		this->nodeRequests->Add(UINT64_MAX, payload);
+}
+
+void CsvStore::AddRelationRow(char reqType, int64_t objId, int64_t version, const std::vector<std::string> &refTypeStrs, 
+	const std::vector<int64_t> &refIds, const std::string &row)
+{
+	string payload = reqType + EncodeSortKey(objId) + EncodeSortKey(version) + row;
+	for(size_t i=0; i<refTypeStrs.size(); i++)
+	{
+		if(refTypeStrs[i] != "node") continue;
+		this->nodeRequests->Add(refIds[i], payload);
+		return;
+	}
+	for(size_t i=0; i<refTypeStrs.size(); i++)
+	{
+		if(refTypeStrs[i] != "way") continue;
+		this->wayRequests->Add(refIds[i], payload);
+		return;
+	}
+	//Relations with only relation members go at the end
+	if(reqType == 'r')
+		this->liverelationSort->Add(UINT64_MAX, row);
+	else
+		this->oldrelationSort->Add(UINT64_MAX, row);
+}
+
+//Looks up the sort key of each request, by merging two streams sorted by object ID. Key 
+//payloads are the sort key then the object version.
+void CsvStore::ResolveRequests(class ExternalSort &keys, class ExternalSort &requests, bool storeWayKeys)
+{
+	keys.StartRead();
+	requests.StartRead();
+
+	uint64_t keyId = 0, reqId = 0;
+	string keyPayload, reqPayload;
+	bool keyValid = keys.Next(keyId, keyPayload);
+
+	//Key of the latest version of the member being looked up
+	uint64_t lookupId = 0, lookupKey = UINT64_MAX;
+	bool lookupDone = false;
+
+	while(requests.Next(reqId, reqPayload))
+	{
+		if(!lookupDone || lookupId != reqId)
+		{
+			while(keyValid && keyId < reqId)
+				keyValid = keys.Next(keyId, keyPayload);
+
+			//Objects with missing members go at the end
+			lookupKey = UINT64_MAX;
+			int64_t lookupVersion = 0;
+			bool found = false;
+			while(keyValid && keyId == reqId)
+			{
+				int64_t version = (int64_t)DecodeSortKey(keyPayload, sizeof(uint64_t));
+				if(!found || version > lookupVersion)
+				{
+					lookupKey = DecodeSortKey(keyPayload);
+					lookupVersion = version;
+					found = true;
+				}
+				keyValid = keys.Next(keyId, keyPayload);
+			}
+			lookupId = reqId;
+			lookupDone = true;
+		}
+		uint64_t sortKey = lookupKey;
+
+		//Request payload is a type character, the object ID and version then the row
+		char reqType = reqPayload[0];
+		uint64_t objId = DecodeSortKey(reqPayload, 1);
+		uint64_t version = DecodeSortKey(reqPayload, 1 + sizeof(uint64_t));
+		string row = reqPayload.substr(1 + 2*sizeof(uint64_t));
+		if(reqType == 'w')
+			livewaySort->Add(sortKey, row);
+		else if(reqType == 'W')
+			oldwaySort->Add(sortKey, row);
+		else if(reqType == 'r')
+			liverelationSort->Add(sortKey, row);
+		else if(reqType == 'R')
+			oldrelationSort->Add(sortKey, row);
+
+		if(storeWayKeys && (reqType == 'w' || reqType == 'W'))
+			wayKeys->Add(objId, EncodeSortKey(sortKey) + EncodeSortKey(version));
+	}
+}
+
+void CsvStore::WriteSorted(class ExternalSort &sorted, std::shared_ptr<class EncodeGzip> out)
+{
+	sorted.StartRead();
+	uint64_t key = 0;
+	string row;
+	while(sorted.Next(key, row))
+		out->sputn(row.c_str(), row.size());
+}
+
 bool CsvStore::Finish()
 {
+	if(!spatialSort)
+		return false;
+
+	cout << "Sorting nodes" << endl;
+	WriteSorted(*livenodeSort, livenodeFileGzip);
+	WriteSorted(*oldnodeSort, oldnodeFileGzip);
+	livenodeSort.reset();
+	oldnodeSort.reset();
+
+	cout << "Sorting ways" << endl;
+	ResolveRequests(*nodeKeys, *nodeRequests, true);
+	nodeKeys.reset();
+	nodeRequests.reset();
+	WriteSorted(*livewaySort, livewayFileGzip);
+	WriteSorted(*oldwaySort, oldwayFileGzip);
+	livewaySort.reset();
+	oldwaySort.reset();
+
+	cout << "Sorting relations" << endl;
+	ResolveRequests(*wayKeys, *wayRequests, false);
+	wayKeys.reset();
+	wayRequests.reset();
+	WriteSorted(*liverelationSort, liverelationFileGzip);
+	WriteSorted(*oldrelationSort, oldrelationFileGzip);
+	liverelationSort.reset();
+	oldrelationSort.reset();
+
+	spatialSort = false;
 	return false;
 }
 
 bool CsvStore::StoreNode(int64_t objId, const class MetaData &metaData, 
 	const TagMap &tags, double lat, double lon)
 {
-	string tagsJson;
-	EncodeTags(tags, tagsJson);
-	StrReplaceAll(tagsJson, "\"", "\"\"");
-	
-	string usernameStr = metaData.username;
-	if(metaData.username.size() > 0)
+	bool live = metaData.current and metaData.visible;
+	string row;
+	CopyRowNode(*rowWriter, objId, metaData, live, tags, lat, lon);
+	rowWriter->EndRow(row);
+
+	if(spatialSort)
 	{
-		StrReplaceAll(usernameStr, "\"", "\"\"");
-		usernameStr = "\""+usernameStr+"\"";
+		uint64_t sortKey = HilbertKey(lon, lat);
+		if(live)
+			this->livenodeSort->Add(sortKey, row);
+		else
+			this->oldnodeSort->Add(sortKey, row);
+		this->nodeKeys->Add(objId, EncodeSortKey(sortKey) + EncodeSortKey(metaData.version));
 	}
-	else
-		usernameStr = "NULL";
-	string uidStr;
-	if(metaData.uid!=0)
-		uidStr = Int64ToStr(metaData.uid);
-	else
-		uidStr = "NULL";
-	string changesetStr = Int64ToStr(metaData.changeset);
-	if(metaData.changeset==0)
-		changesetStr="NULL";
-	string timestampStr = Int64ToStr(metaData.timestamp);
-	if(metaData.timestamp==0)
-		timestampStr="NULL";
-	string visibleStr = metaData.visible ? "true" : "false";
-	std::string changesetIndex="NULL";
-	
-	stringstream ss;
-	ss.precision(9);
-	if(metaData.current and metaData.visible)
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< \
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",SRID=4326;POINT("<< fixed << lon<<" "<<lat<<")\n";
-		string row(ss.str());
+	else if(live)
 		this->livenodeFileGzip->sputn(row.c_str(), row.size());
-	}
 	else
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< visibleStr <<","<<\
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",SRID=4326;POINT("<< fixed << lon<<" "<<lat<<")\n";
-		string row(ss.str());
 		this->oldnodeFileGzip->sputn(row.c_str(), row.size());
-	}
 
-	string objIdStr = Int64ToStr(objId);
-	objIdStr += "\n";
-	this->nodeIdsFileGzip->sputn(objIdStr.c_str(), objIdStr.size());
+	WriteId(objId, *this->nodeIdsFileGzip);
 
 	return false;
 }
@@ -197,63 +385,22 @@ bool CsvStore::StoreNode(int64_t objId, const class MetaData &metaData,
 bool CsvStore::StoreWay(int64_t objId, const class MetaData &metaData, 
 	const TagMap &tags, const std::vector<int64_t> &refs)
 {
-	string tagsJson;
-	EncodeTags(tags, tagsJson);
-	StrReplaceAll(tagsJson, "\"", "\"\"");
-	
-	string refsJson;
-	EncodeInt64Vec(refs, refsJson);
-	StrReplaceAll(refsJson, "\"", "\"\"");
-
-	string usernameStr = metaData.username;
-	if(metaData.username.size() > 0)
-	{
-		StrReplaceAll(usernameStr, "\"", "\"\"");
-		usernameStr = "\""+usernameStr+"\"";
-	}
-	else
-		usernameStr = "NULL";
-	string uidStr;
-	if(metaData.uid!=0)
-		uidStr = Int64ToStr(metaData.uid);
-	else
-		uidStr = "NULL";
-	string changesetStr = Int64ToStr(metaData.changeset);
-	if(metaData.changeset==0)
-		changesetStr="NULL";
-	string timestampStr = Int64ToStr(metaData.timestamp);
-	if(metaData.timestamp==0)
-		timestampStr="NULL";
-	string visibleStr = metaData.visible ? "true" : "false";
-	std::string changesetIndex="NULL";
-	
-	stringstream ss;
-	if(metaData.current and metaData.visible)
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< \
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",\""<<refsJson<<"\",NULL\n";
-		string row(ss.str());
+	bool live = metaData.current and metaData.visible;
+	string row;
+	CopyRowWay(*rowWriter, objId, metaData, live, tags, refs);
+	rowWriter->EndRow(row);
+
+	if(spatialSort)
+		AddWayRow(live ? 'w' : 'W', objId, metaData.version, refs, row);
+	else if(live)
 		this->livewayFileGzip->sputn(row.c_str(), row.size());
-	}
 	else
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< visibleStr <<","<<\
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",\""<<refsJson<<"\",NULL\n";
-		string row(ss.str());
 		this->oldwayFileGzip->sputn(row.c_str(), row.size());
-	}
 
-	string objIdStr = Int64ToStr(objId);
-	objIdStr += "\n";
-	this->wayIdsFileGzip->sputn(objIdStr.c_str(), objIdStr.size());
+	WriteId(objId, *this->wayIdsFileGzip);
 
 	for(size_t i=0; i<refs.size(); i++)
-	{
-		stringstream ss2;
-		ss2 << objId <<","<< metaData.version <<","<< i <<","<< refs[i] << "\n";
-		string memStr(ss2.str());
-		this->wayMembersFileGzip->sputn(memStr.c_str(), memStr.size());
-	}
+		WriteMember(objId, metaData.version, i, refs[i], *this->wayMembersFileGzip);
 
 	return false;
 }
@@ -262,79 +409,29 @@ bool CsvStore::StoreRelation(int64_t objId, const class MetaData &metaData, cons
 	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds, 
 	const std::vector<std::string> &refRoles)
 {
-	string tagsJson;
-	EncodeTags(tags, tagsJson);
-	StrReplaceAll(tagsJson, "\"", "\"\"");
-	
-	string refsJson;
-	EncodeRelationMems(refTypeStrs, refIds, refsJson);
-	StrReplaceAll(refsJson, "\"", "\"\"");
-
-	string refRolesJson;
-	EncodeStringVec(refRoles, refRolesJson);
-	StrReplaceAll(refRolesJson, "\"", "\"\"");
-
-	string usernameStr = metaData.username;
-	if(metaData.username.size() > 0)
-	{
-		StrReplaceAll(usernameStr, "\"", "\"\"");
-		usernameStr = "\""+usernameStr+"\"";
-	}
-	else
-		usernameStr = "NULL";
-	string uidStr;
-	if(metaData.uid!=0)
-		uidStr = Int64ToStr(metaData.uid);
-	else
-		uidStr = "NULL";
-	string changesetStr = Int64ToStr(metaData.changeset);
-	if(metaData.changeset==0)
-		changesetStr="NULL";
-	string timestampStr = Int64ToStr(metaData.timestamp);
-	if(metaData.timestamp==0)
-		timestampStr="NULL";
-	string visibleStr = metaData.visible ? "true" : "false";
-	std::string changesetIndex="NULL";
-	
-	stringstream ss;
-	if(metaData.current and metaData.visible)
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< \
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",\""<<refsJson<<"\",\""<<refRolesJson<<"\",NULL\n";
-		string row(ss.str());
+	bool live = metaData.current and metaData.visible;
+	string row;
+	CopyRowRelation(*rowWriter, objId, metaData, live, tags, refTypeStrs, refIds, refRoles);
+	rowWriter->EndRow(row);
+
+	if(spatialSort)
+		AddRelationRow(live ? 'r' : 'R', objId, metaData.version, refTypeStrs, refIds, row);
+	else if(live)
 		this->liverelationFileGzip->sputn(row.c_str(), row.size());
-	}
 	else
-	{
-		ss << objId <<","<< changesetStr <<","<< changesetIndex <<","<< usernameStr <<","<< uidStr <<","<< visibleStr <<","<<\
-			timestampStr <<","<< metaData.version <<",\"" << tagsJson << "\",\""<<refsJson<<"\",\""<<refRolesJson<<"\",NULL\n";
-		string row(ss.str());
 		this->oldrelationFileGzip->sputn(row.c_str(), row.size());
-	}
 
-	string objIdStr = Int64ToStr(objId);
-	objIdStr += "\n";
-	this->relationIdsFileGzip->sputn(objIdStr.c_str(), objIdStr.size());
+	WriteId(objId, *this->relationIdsFileGzip);
 
 	for(size_t i=0; i<refIds.size(); i++)
 	{
 		const std::string &refTypeStr = refTypeStrs[i];
-		stringstream ss2;
-		ss2 << objId <<","<< metaData.version <<","<< i <<","<< refIds[i] << "\n";
-		string memStr(ss2.str());
-
 		if(refTypeStr == "node")
-		{
-			this->relationMemNodesFileGzip->sputn(memStr.c_str(), memStr.size());
-		}
+			WriteMember(objId, metaData.version, i, refIds[i], *this->relationMemNodesFileGzip);
 		else if(refTypeStr == "way")
-		{
-			this->relationMemWaysFileGzip->sputn(memStr.c_str(), memStr.size());
-		}
+			WriteMember(objId, metaData.version, i, refIds[i], *this->relationMemWaysFileGzip);
 		else if(refTypeStr == "relation")
-		{
-			this->relationMemRelsFileGzip->sputn(memStr.c_str(), memStr.size());
-		}
+			WriteMember(objId, metaData.version, i, refIds[i], *this->relationMemRelsFileGzip);
 	}
 
 	return false;
@@ -347,7 +444,21 @@ int main(int argc, char **argv)
 	ReadSettingsFile("config.cfg", config);
 
 	cout << "Writing output to " << config["csv_absolute_path"] << endl;
-	shared_ptr<class IDataStreamHandler> csvStore(new class CsvStore(config["csv_absolute_path"]));
+	bool binaryFormat = atoi(config["csv_binary_format"].c_str()) != 0;
+	shared_ptr<class IDataStreamHandler> csvStore;
+	if(atoi(config["csv_spatial_sort"].c_str()) != 0)
+	{
+		string sortTempPrefix = config["csv_absolute_path"];
+		if(config["csv_sort_temp_path"].size() > 0)
+			sortTempPrefix = config["csv_sort_temp_path"];
+		size_t sortMemMb = 1024;
+		if(config["csv_sort_memory_mb"].size() > 0)
+			sortMemMb = atol(config["csv_sort_memory_mb"].c_str());
+		cout << "Sorting rows spatially using " << sortMemMb << " MB" << endl;
+		csvStore.reset(new class CsvStore(config["csv_absolute_path"], binaryFormat, sortTempPrefix, sortMemMb * 1024 * 1024));
+	}
+	else
+		csvStore.reset(new class CsvStore(config["csv_absolute_path"], binaryFormat));
 	LoadOsmFromFile(config["dump_path"], csvStore);
 
 	csvStore.reset();
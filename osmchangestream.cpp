@@ -0,0 +1,384 @@
+#include "osmchangestream.h"
+#include "cppo5m/iso8601lib/iso8601.h"
+#include "cppGzip/DecodeGzip.h"
+#include <fstream>
+#include <stdexcept>
+#include <sstream>
+#include <cstring>
+#include <ctime>
+using namespace std;
+
+static void StartElement(void *userData, const XML_Char *name, const XML_Char **atts)
+{
+	((class OsmChangeStreamDecode *)userData)->StartElement(name, atts);
+}
+
+static void EndElement(void *userData, const XML_Char *name)
+{
+	((class OsmChangeStreamDecode *)userData)->EndElement(name);
+}
+
+static int64_t ParseOsmTimestamp(const std::string &str)
+{
+	struct tm dt;
+	int timezoneOffsetMin = 0;
+	memset(&dt, 0x00, sizeof(dt));
+	ParseIso8601Datetime(str.c_str(), &dt, &timezoneOffsetMin);
+	TmToUtc(&dt, timezoneOffsetMin);
+	return (int64_t)timegm(&dt);
+}
+
+OsmChangeStreamDecode::OsmChangeStreamDecode(std::shared_ptr<IOsmChangeBlock> output, size_t maxObjects):
+	maxObjects(maxObjects),
+	output(output)
+{
+	xmlDepth = 0;
+	parseCompletedOk = false;
+	currentIfUnused = false;
+	blockCount = 0;
+	currentType = 0;
+	currentId = 0;
+	currentLat = 0.0;
+	currentLon = 0.0;
+	if(this->maxObjects < 1)
+		this->maxObjects = 1;
+	parser = XML_ParserCreate(NULL);
+	XML_SetUserData(parser, this);
+	XML_SetElementHandler(parser, ::StartElement, ::EndElement);
+}
+
+OsmChangeStreamDecode::~OsmChangeStreamDecode()
+{
+	XML_ParserFree(parser);
+}
+
+void OsmChangeStreamDecode::FlushBlock()
+{
+	//Exceptions must not pass through expat, so an output error stops the parser instead
+	if(blockCount > 0 && errString.size() == 0)
+	{
+		try
+		{
+			output->StoreOsmData(currentAction, block, currentIfUnused);
+		}
+		catch (const std::exception &e)
+		{
+			errString = e.what();
+			XML_StopParser(parser, XML_FALSE);
+		}
+	}
+	block.Clear();
+	blockCount = 0;
+}
+
+void OsmChangeStreamDecode::StartElement(const XML_Char *name, const XML_Char **atts)
+{
+	this->xmlDepth ++;
+
+	std::map<std::string, std::string> attribs;
+	XmlAttsToMap(atts, attribs);
+
+	if(this->xmlDepth == 2)
+	{
+		if(currentAction != name)
+			FlushBlock();
+		currentAction = name;
+		currentIfUnused = attribs.find("if-unused") != attribs.end();
+	}
+	else if(this->xmlDepth == 3)
+	{
+		currentType = 0;
+		if(strcmp(name, "node")==0)
+			currentType = 1;
+		else if(strcmp(name, "way")==0)
+			currentType = 2;
+		else if(strcmp(name, "relation")==0)
+			currentType = 3;
+
+		class MetaData emptyMeta;
+		currentMeta = emptyMeta;
+		currentId = atoll(attribs["id"].c_str());
+		if(attribs.find("version") != attribs.end())
+			currentMeta.version = atoll(attribs["version"].c_str());
+		if(attribs.find("changeset") != attribs.end())
+			currentMeta.changeset = atoll(attribs["changeset"].c_str());
+		if(attribs.find("uid") != attribs.end())
+			currentMeta.uid = atoll(attribs["uid"].c_str());
+		if(attribs.find("user") != attribs.end())
+			currentMeta.username = attribs["user"];
+		if(attribs.find("timestamp") != attribs.end())
+			currentMeta.timestamp = ParseOsmTimestamp(attribs["timestamp"]);
+		currentMeta.visible = true;
+		if(attribs.find("visible") != attribs.end())
+			currentMeta.visible = attribs["visible"] != "false";
+		currentLat = atof(attribs["lat"].c_str());
+		currentLon = atof(attribs["lon"].c_str());
+
+		currentTags.clear();
+		currentRefs.clear();
+		currentRefTypeStrs.clear();
+		currentRefRoles.clear();
+	}
+	else if(this->xmlDepth == 4)
+	{
+		if(strcmp(name, "tag")==0)
+			currentTags[attribs["k"]] = attribs["v"];
+		else if(strcmp(name, "nd")==0)
+			currentRefs.push_back(atoll(attribs["ref"].c_str()));
+		else if(strcmp(name, "member")==0)
+		{
+			currentRefTypeStrs.push_back(attribs["type"]);
+			currentRefs.push_back(atoll(attribs["ref"].c_str()));
+			currentRefRoles.push_back(attribs["role"]);
+		}
+	}
+}
+
+void OsmChangeStreamDecode::EndElement(const XML_Char *name)
+{
+	if(this->xmlDepth == 3 && currentType != 0)
+	{
+		if(currentType == 1)
+			block.StoreNode(currentId, currentMeta, currentTags, currentLat, currentLon);
+		else if(currentType == 2)
+			block.StoreWay(currentId, currentMeta, currentTags, currentRefs);
+		else
+			block.StoreRelation(currentId, currentMeta, currentTags, 
+				currentRefTypeStrs, currentRefs, currentRefRoles);
+		blockCount ++;
+		currentType = 0;
+
+		if(blockCount >= maxObjects)
+			FlushBlock();
+	}
+	else if(this->xmlDepth == 2)
+		FlushBlock();
+
+	this->xmlDepth --;
+}
+
+bool OsmChangeStreamDecode::DecodeSubString(const char *xml, size_t len, bool done)
+{
+	if (XML_Parse(parser, xml, len, done) == XML_STATUS_ERROR)
+	{
+		if(errString.size() > 0)
+			return false; //Stopped by an output error
+		stringstream ss;
+		ss << XML_ErrorString(XML_GetErrorCode(parser))
+			<< " at line " << XML_GetCurrentLineNumber(parser) << endl;
+		errString = ss.str();
+		return false;
+	}
+	if(done)
+	{
+		FlushBlock();
+		if(errString.size() > 0)
+			return false;
+		parseCompletedOk = true;
+	}
+	return !done;
+}
+
+void OsmChangeStreamDecode::XmlAttsToMap(const XML_Char **atts, std::map<std::string, std::string> &attribs)
+{
+	size_t i=0;
+	while(atts[i] != NULL)
+	{
+		attribs[atts[i]] = atts[i+1];
+		i += 2;
+	}
+}
+
+// **********************************************
+
+bool DecodeOsmChangeStream(std::streambuf &fi, class OsmChangeStreamDecode &decoder)
+{
+	std::vector<char> buff(1024*64);
+	while(true)
+	{
+		std::streamsize len = fi.sgetn(&buff[0], buff.size());
+		bool done = len < (std::streamsize)buff.size();
+		decoder.DecodeSubString(&buff[0], len, done);
+		if(decoder.errString.size() > 0)
+			return false;
+		if(done)
+			break;
+	}
+	return decoder.parseCompletedOk;
+}
+
+// **********************************************
+
+//Collects decoded blocks into an OsmChange
+class OsmChangeCollect : public IOsmChangeBlock
+{
+public:
+	class OsmChange &out;
+
+	OsmChangeCollect(class OsmChange &out): out(out) {};
+	virtual ~OsmChangeCollect() {};
+
+	virtual void StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused)
+	{
+		out.blocks.push_back(osmData);
+		out.actions.push_back(action);
+		out.ifunused.push_back(ifunused);
+	}
+};
+
+void DecodeOsmChangeFile(const std::string &fina, std::shared_ptr<IOsmChangeBlock> output, size_t maxObjects)
+{
+	std::filebuf fi;
+	if(fi.open(fina, std::ios::in | std::ios::binary) == nullptr)
+		throw runtime_error("Failed to open "+fina);
+	class DecodeGzip gzipDec(fi);
+	class OsmChangeStreamDecode decoder(output, maxObjects);
+	bool ok = DecodeOsmChangeStream(gzipDec, decoder);
+	if(!ok)
+		throw runtime_error(fina + ": " + decoder.errString);
+}
+
+void DecodeOsmChangeFile(const std::string &fina, class OsmChange &out)
+{
+	std::shared_ptr<class OsmChangeCollect> collect(new class OsmChangeCollect(out));
+	DecodeOsmChangeFile(fina, collect, 10000);
+}
+
+// **********************************************
+
+void OsmChangePrefetch::PrefetchSink::StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused)
+{
+	//Throwing stops the decoder
+	if(!owner->AddBlock(index, action, osmData))
+		throw runtime_error("Prefetch stopped");
+}
+
+OsmChangePrefetch::OsmChangePrefetch(const std::vector<std::string> &filenames, size_t lookAhead, int numThreads,
+		size_t maxObjects, size_t maxQueuedObjects):
+	filenames(filenames),
+	lookAhead(lookAhead),
+	nextDecode(0),
+	nextReturn(0),
+	maxObjects(maxObjects),
+	maxQueuedObjects(maxQueuedObjects),
+	queuedObjects(0),
+	stopping(false)
+{
+	if(this->lookAhead < 1)
+		this->lookAhead = 1;
+	if(numThreads < 1)
+		numThreads = 1;
+	for(size_t i=0; i<filenames.size(); i++)
+	{
+		std::shared_ptr<class PrefetchSlot> slot(new class PrefetchSlot());
+		slot->done = false;
+		slots.push_back(slot);
+	}
+	for(int i=0; i<numThreads; i++)
+		workers.push_back(std::thread(&OsmChangePrefetch::Worker, this));
+}
+
+OsmChangePrefetch::~OsmChangePrefetch()
+{
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	for(size_t i=0; i<workers.size(); i++)
+		workers[i].join();
+}
+
+void OsmChangePrefetch::Worker()
+{
+	while(true)
+	{
+		size_t index = 0;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			while(!this->stopping && nextDecode < filenames.size() && nextDecode >= nextReturn + lookAhead)
+				this->changed.wait(lock);
+			if(this->stopping || nextDecode >= filenames.size())
+				return;
+			index = nextDecode;
+			nextDecode ++;
+		}
+
+		std::shared_ptr<class PrefetchSink> sink(new class PrefetchSink(this, index));
+		string errStr;
+		try
+		{
+			DecodeOsmChangeFile(filenames[index], sink, maxObjects);
+		}
+		catch (const std::exception &e)
+		{
+			errStr = e.what();
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			slots[index]->errStr = errStr;
+			slots[index]->done = true;
+		}
+		this->changed.notify_all();
+	}
+}
+
+bool OsmChangePrefetch::AddBlock(size_t index, const std::string &action, const class OsmData &osmData)
+{
+	class PrefetchBlock block;
+	block.action = action;
+	block.data.reset(new class OsmData(osmData));
+	block.count = osmData.nodes.size() + osmData.ways.size() + osmData.relations.size();
+
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		class PrefetchSlot &slot = *slots[index];
+		while(!this->stopping && queuedObjects > 0 && queuedObjects + block.count > maxQueuedObjects
+			&& !(index == nextReturn && slot.blocks.size() == 0))
+			this->changed.wait(lock);
+		if(this->stopping)
+			return false;
+		slot.blocks.push_back(block);
+		queuedObjects += block.count;
+	}
+	this->changed.notify_all();
+	return true;
+}
+
+bool OsmChangePrefetch::Next(std::string &fina, std::string &action, std::shared_ptr<class OsmData> &out)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(nextReturn < filenames.size())
+	{
+		class PrefetchSlot &slot = *slots[nextReturn];
+		while(slot.blocks.size() == 0 && !slot.done)
+			this->changed.wait(lock);
+
+		if(slot.blocks.size() > 0)
+		{
+			class PrefetchBlock &block = slot.blocks.front();
+			fina = filenames[nextReturn];
+			action = block.action;
+			out = block.data;
+			queuedObjects -= block.count;
+			slot.blocks.pop_front();
+			lock.unlock();
+			this->changed.notify_all();
+			return true;
+		}
+
+		//Every block of this file has been returned
+		string errStr = slot.errStr;
+		slots[nextReturn].reset();
+		nextReturn ++;
+		if(errStr.size() > 0)
+		{
+			lock.unlock();
+			this->changed.notify_all();
+			throw runtime_error(errStr);
+		}
+		this->changed.notify_all();
+	}
+	return false;
+}
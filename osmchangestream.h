@@ -0,0 +1,124 @@
+#ifndef _OSM_CHANGE_STREAM_H
+#define _OSM_CHANGE_STREAM_H
+
+#include <string>
+#include <map>
+#include <memory>
+#include <streambuf>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <expat.h>
+#include "cppo5m/OsmData.h"
+
+//Incrementally decodes osmChange XML. Objects are passed to output in blocks of at most
+//maxObjects objects, which all have the same action. A block is passed on when it is full,
+//when the action changes or at the end of each action element, so memory use does not
+//depend on the size of the file. If output throws, parsing stops and the exception message
+//is returned in errString.
+class OsmChangeStreamDecode
+{
+private:
+	XML_Parser parser;
+	int xmlDepth;
+	size_t maxObjects;
+	std::string currentAction;
+	bool currentIfUnused;
+	class OsmData block;
+	size_t blockCount;
+
+	int currentType; //0 none, 1 node, 2 way, 3 relation
+	int64_t currentId;
+	class MetaData currentMeta;
+	TagMap currentTags;
+	double currentLat, currentLon;
+	std::vector<int64_t> currentRefs;
+	std::vector<std::string> currentRefTypeStrs;
+	std::vector<std::string> currentRefRoles;
+
+	void FlushBlock();
+
+public:
+	bool parseCompletedOk;
+	std::string errString;
+	std::shared_ptr<IOsmChangeBlock> output;
+
+	OsmChangeStreamDecode(std::shared_ptr<IOsmChangeBlock> output, size_t maxObjects);
+	virtual ~OsmChangeStreamDecode();
+
+	void StartElement(const XML_Char *name, const XML_Char **atts);
+	void EndElement(const XML_Char *name);
+	bool DecodeSubString(const char *xml, size_t len, bool done);
+	void XmlAttsToMap(const XML_Char **atts, std::map<std::string, std::string> &attribs);
+};
+
+//Reads all of fi through the decoder, in chunks. Returns false on a parse error.
+bool DecodeOsmChangeStream(std::streambuf &fi, class OsmChangeStreamDecode &decoder);
+
+//Decompresses and decodes a .osc.gz file
+void DecodeOsmChangeFile(const std::string &fina, class OsmChange &out);
+
+//Decompresses and decodes a .osc.gz file, passing blocks of at most maxObjects objects to output.
+//Throws runtime_error if the file could not be decoded.
+void DecodeOsmChangeFile(const std::string &fina, std::shared_ptr<IOsmChangeBlock> output, size_t maxObjects);
+
+//Decodes a list of .osc.gz files on numThreads background threads, at most lookAhead files ahead
+//of the file being returned. Files are decoded in blocks of at most maxObjects objects, and
+//decoded blocks waiting to be returned hold at most maxQueuedObjects objects (plus one block, 
+//so the file being returned can always make progress). Blocks are returned in file order.
+class OsmChangePrefetch
+{
+private:
+	class PrefetchBlock
+	{
+	public:
+		std::string action;
+		std::shared_ptr<class OsmData> data;
+		size_t count;
+	};
+
+	class PrefetchSlot
+	{
+	public:
+		std::deque<class PrefetchBlock> blocks;
+		std::string errStr;
+		bool done;
+	};
+
+	class PrefetchSink : public IOsmChangeBlock
+	{
+	public:
+		class OsmChangePrefetch *owner;
+		size_t index;
+
+		PrefetchSink(class OsmChangePrefetch *owner, size_t index): owner(owner), index(index) {};
+		virtual ~PrefetchSink() {};
+		virtual void StoreOsmData(const std::string &action, const class OsmData &osmData, bool ifunused);
+	};
+
+	std::vector<std::string> filenames;
+	std::vector<std::shared_ptr<class PrefetchSlot> > slots;
+	size_t lookAhead, nextDecode, nextReturn;
+	size_t maxObjects, maxQueuedObjects, queuedObjects;
+	bool stopping;
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable changed;
+
+	void Worker();
+	//Waits for space in the queue. Returns false if the prefetch is being stopped.
+	bool AddBlock(size_t index, const std::string &action, const class OsmData &osmData);
+
+public:
+	OsmChangePrefetch(const std::vector<std::string> &filenames, size_t lookAhead, int numThreads,
+		size_t maxObjects, size_t maxQueuedObjects);
+	virtual ~OsmChangePrefetch();
+
+	//Waits for the next decoded block and the name of the file it is from. Returns false after 
+	//the last block of the last file. Throws runtime_error if a file could not be decoded.
+	bool Next(std::string &fina, std::string &action, std::shared_ptr<class OsmData> &out);
+};
+
+#endif //_OSM_CHANGE_STREAM_H
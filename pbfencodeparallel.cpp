@@ -0,0 +1,384 @@
+#include "pbfencodeparallel.h"
+#include "cppo5m/pbf/fileformat.pb.h"
+#include "cppo5m/pbf/osmformat.pb.h"
+#include <zlib.h>
+#include <map>
+#include <cmath>
+#include <stdexcept>
+using namespace std;
+
+// Based on https://wiki.openstreetmap.org/wiki/PBF_Format
+
+//Wraps data in a blob header and zlib compressed blob
+static void PbfEncodeBlob(const std::string &type, const std::string &data, std::string &out)
+{
+	uLongf compressedSize = compressBound(data.size());
+	string compressed;
+	compressed.resize(compressedSize);
+	int ret = compress2((Bytef *)&compressed[0], &compressedSize, (const Bytef *)data.c_str(), data.size(),
+		Z_DEFAULT_COMPRESSION);
+	if(ret != Z_OK)
+		throw runtime_error("zlib compression failed");
+	compressed.resize(compressedSize);
+
+	OSMPBF::Blob blob;
+	blob.set_raw_size(data.size());
+	blob.set_zlib_data(compressed);
+	string blobStr;
+	blob.SerializeToString(&blobStr);
+
+	OSMPBF::BlobHeader blobHeader;
+	blobHeader.set_type(type);
+	blobHeader.set_datasize(blobStr.size());
+	string blobHeaderStr;
+	blobHeader.SerializeToString(&blobHeaderStr);
+
+	uint32_t headerLen = blobHeaderStr.size();
+	out.clear();
+	out += (char)((headerLen >> 24) & 0xff);
+	out += (char)((headerLen >> 16) & 0xff);
+	out += (char)((headerLen >> 8) & 0xff);
+	out += (char)(headerLen & 0xff);
+	out += blobHeaderStr;
+	out += blobStr;
+}
+
+class PbfStringTable
+{
+public:
+	std::map<std::string, uint32_t> index;
+	OSMPBF::StringTable *table;
+
+	PbfStringTable(OSMPBF::StringTable *table):
+		table(table)
+	{
+		//Entry zero is used as a delimiter, so is left empty
+		Get("");
+	}
+
+	uint32_t Get(const std::string &str)
+	{
+		auto it = index.find(str);
+		if(it != index.end())
+			return it->second;
+		uint32_t i = index.size();
+		index[str] = i;
+		table->add_s(str);
+		return i;
+	}
+};
+
+static void PbfEncodeInfo(const class MetaData &metaData, bool historical, PbfStringTable &strings, OSMPBF::Info *info)
+{
+	if(historical)
+		info->set_visible(metaData.visible);
+	info->set_version(metaData.version);
+	info->set_timestamp(metaData.timestamp);
+	info->set_changeset(metaData.changeset);
+	info->set_uid(metaData.uid);
+	info->set_user_sid(strings.Get(metaData.username));
+}
+
+static void PbfEncodePrimitiveBlock(const class OsmData &data, bool historical, std::string &out)
+{
+	OSMPBF::PrimitiveBlock block;
+	PbfStringTable strings(block.mutable_stringtable());
+	OSMPBF::PrimitiveGroup *group = block.add_primitivegroup();
+
+	if(data.nodes.size() > 0)
+	{
+		OSMPBF::DenseNodes *dense = group->mutable_dense();
+		OSMPBF::DenseInfo *denseInfo = dense->mutable_denseinfo();
+		int64_t lastId = 0, lastLat = 0, lastLon = 0, lastTimestamp = 0, lastChangeset = 0;
+		int64_t lastUid = 0, lastUserSid = 0;
+		for(size_t i=0; i<data.nodes.size(); i++)
+		{
+			const class OsmNode &node = data.nodes[i];
+			//Default granularity of 100 nanodegrees
+			int64_t lat = (int64_t)round(node.lat * 1e7);
+			int64_t lon = (int64_t)round(node.lon * 1e7);
+			int64_t userSid = strings.Get(node.metaData.username);
+
+			dense->add_id(node.objId - lastId);
+			dense->add_lat(lat - lastLat);
+			dense->add_lon(lon - lastLon);
+			denseInfo->add_version(node.metaData.version);
+			denseInfo->add_timestamp(node.metaData.timestamp - lastTimestamp);
+			denseInfo->add_changeset(node.metaData.changeset - lastChangeset);
+			denseInfo->add_uid(node.metaData.uid - lastUid);
+			denseInfo->add_user_sid(userSid - lastUserSid);
+			if(historical)
+				denseInfo->add_visible(node.metaData.visible);
+			lastId = node.objId;
+			lastLat = lat;
+			lastLon = lon;
+			lastTimestamp = node.metaData.timestamp;
+			lastChangeset = node.metaData.changeset;
+			lastUid = node.metaData.uid;
+			lastUserSid = userSid;
+
+			for(auto it=node.tags.begin(); it!=node.tags.end(); it++)
+			{
+				dense->add_keys_vals(strings.Get(it->first));
+				dense->add_keys_vals(strings.Get(it->second));
+			}
+			dense->add_keys_vals(0);
+		}
+	}
+
+	for(size_t i=0; i<data.ways.size(); i++)
+	{
+		const class OsmWay &way = data.ways[i];
+		OSMPBF::Way *pbfWay = group->add_ways();
+		pbfWay->set_id(way.objId);
+		for(auto it=way.tags.begin(); it!=way.tags.end(); it++)
+		{
+			pbfWay->add_keys(strings.Get(it->first));
+			pbfWay->add_vals(strings.Get(it->second));
+		}
+		PbfEncodeInfo(way.metaData, historical, strings, pbfWay->mutable_info());
+		int64_t lastRef = 0;
+		for(size_t j=0; j<way.refs.size(); j++)
+		{
+			pbfWay->add_refs(way.refs[j] - lastRef);
+			lastRef = way.refs[j];
+		}
+	}
+
+	for(size_t i=0; i<data.relations.size(); i++)
+	{
+		const class OsmRelation &relation = data.relations[i];
+		OSMPBF::Relation *pbfRelation = group->add_relations();
+		pbfRelation->set_id(relation.objId);
+		for(auto it=relation.tags.begin(); it!=relation.tags.end(); it++)
+		{
+			pbfRelation->add_keys(strings.Get(it->first));
+			pbfRelation->add_vals(strings.Get(it->second));
+		}
+		PbfEncodeInfo(relation.metaData, historical, strings, pbfRelation->mutable_info());
+		int64_t lastMemId = 0;
+		for(size_t j=0; j<relation.refIds.size(); j++)
+		{
+			pbfRelation->add_roles_sid(strings.Get(relation.refRoles[j]));
+			pbfRelation->add_memids(relation.refIds[j] - lastMemId);
+			lastMemId = relation.refIds[j];
+			const std::string &refType = relation.refTypeStrs[j];
+			if(refType == "node")
+				pbfRelation->add_types(OSMPBF::Relation::NODE);
+			else if(refType == "way")
+				pbfRelation->add_types(OSMPBF::Relation::WAY);
+			else
+				pbfRelation->add_types(OSMPBF::Relation::RELATION);
+		}
+	}
+
+	string blockStr;
+	block.SerializeToString(&blockStr);
+	PbfEncodeBlob("OSMData", blockStr, out);
+}
+
+// **********************************************
+
+PbfEncodeParallel::PbfEncodeParallel(std::streambuf &handle, int numThreads, size_t blockSize, bool historical):
+	handle(handle),
+	blockSize(blockSize),
+	currentCount(0),
+	currentType(0),
+	headerWritten(false),
+	finished(false),
+	historical(historical),
+	stopping(false)
+{
+	if(numThreads < 1)
+		numThreads = 1;
+	maxQueuedBlocks = numThreads * 4;
+	current.reset(new class OsmData());
+	for(int i=0; i<numThreads; i++)
+		workers.push_back(std::thread(&PbfEncodeParallel::Worker, this));
+}
+
+PbfEncodeParallel::~PbfEncodeParallel()
+{
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->stopping = true;
+	}
+	this->changed.notify_all();
+	for(size_t i=0; i<workers.size(); i++)
+		workers[i].join();
+}
+
+void PbfEncodeParallel::Worker()
+{
+	while(true)
+	{
+		std::shared_ptr<class PbfBlockJob> job;
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			while(this->pending.size() == 0 && !this->stopping)
+				this->changed.wait(lock);
+			if(this->pending.size() == 0)
+				return;
+			job = this->pending.front();
+			this->pending.pop_front();
+		}
+
+		string out;
+		try
+		{
+			PbfEncodePrimitiveBlock(*job->data, this->historical, out);
+		}
+		catch (const std::exception &e)
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			if(this->errStr.size() == 0)
+				this->errStr = e.what();
+		}
+
+		{
+			std::unique_lock<std::mutex> lock(this->mtx);
+			job->output.swap(out);
+			job->data.reset();
+			job->done = true;
+		}
+		this->changed.notify_all();
+	}
+}
+
+void PbfEncodeParallel::WriteHeader()
+{
+	if(this->headerWritten)
+		return;
+	this->headerWritten = true;
+
+	OSMPBF::HeaderBlock header;
+	header.add_required_features("OsmSchema-V0.6");
+	header.add_required_features("DenseNodes");
+	if(this->historical)
+		header.add_required_features("HistoricalInformation");
+	header.set_writingprogram("pgmap");
+	if(this->bbox.size() == 4)
+	{
+		OSMPBF::HeaderBBox *headerBbox = header.mutable_bbox();
+		headerBbox->set_left((int64_t)round(this->bbox[0] * 1e9));
+		headerBbox->set_bottom((int64_t)round(this->bbox[1] * 1e9));
+		headerBbox->set_right((int64_t)round(this->bbox[2] * 1e9));
+		headerBbox->set_top((int64_t)round(this->bbox[3] * 1e9));
+	}
+
+	string headerStr, out;
+	header.SerializeToString(&headerStr);
+	PbfEncodeBlob("OSMHeader", headerStr, out);
+	this->handle.sputn(out.c_str(), out.size());
+}
+
+//Writes completed blocks in order, until no more than maxRemaining are queued
+void PbfEncodeParallel::WriteJobs(size_t maxRemaining)
+{
+	std::unique_lock<std::mutex> lock(this->mtx);
+	while(this->jobs.size() > maxRemaining)
+	{
+		std::shared_ptr<class PbfBlockJob> job = this->jobs.front();
+		while(!job->done)
+			this->changed.wait(lock);
+		if(this->errStr.size() > 0)
+			throw runtime_error(this->errStr);
+		this->jobs.pop_front();
+
+		lock.unlock();
+		this->handle.sputn(job->output.c_str(), job->output.size());
+		lock.lock();
+	}
+}
+
+void PbfEncodeParallel::FlushBlock()
+{
+	if(this->currentCount == 0)
+		return;
+	WriteHeader();
+
+	std::shared_ptr<class PbfBlockJob> job(new class PbfBlockJob());
+	job->data = this->current;
+	job->done = false;
+	{
+		std::unique_lock<std::mutex> lock(this->mtx);
+		this->jobs.push_back(job);
+		this->pending.push_back(job);
+	}
+	this->changed.notify_all();
+
+	this->current.reset(new class OsmData());
+	this->currentCount = 0;
+	this->currentType = 0;
+
+	WriteJobs(this->maxQueuedBlocks);
+}
+
+//Blocks contain a single object type
+void PbfEncodeParallel::StartObject(int objType)
+{
+	if(this->finished)
+		throw runtime_error("Encoder already finished");
+	if(this->currentType != objType || this->currentCount >= this->blockSize)
+		FlushBlock();
+	this->currentType = objType;
+	this->currentCount ++;
+}
+
+bool PbfEncodeParallel::Sync()
+{
+	FlushBlock();
+	WriteJobs(0);
+	return false;
+}
+
+bool PbfEncodeParallel::Reset()
+{
+	FlushBlock();
+	return false;
+}
+
+bool PbfEncodeParallel::Finish()
+{
+	if(this->finished)
+		return false;
+	FlushBlock();
+	WriteHeader();
+	WriteJobs(0);
+	this->finished = true;
+	return false;
+}
+
+bool PbfEncodeParallel::StoreIsDiff(bool)
+{
+	return false;
+}
+
+bool PbfEncodeParallel::StoreBounds(double x1, double y1, double x2, double y2)
+{
+	this->bbox = {x1, y1, x2, y2};
+	return false;
+}
+
+bool PbfEncodeParallel::StoreNode(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, double lat, double lon)
+{
+	StartObject(1);
+	return this->current->StoreNode(objId, metaData, tags, lat, lon);
+}
+
+bool PbfEncodeParallel::StoreWay(int64_t objId, const class MetaData &metaData,
+	const TagMap &tags, const std::vector<int64_t> &refs)
+{
+	StartObject(2);
+	return this->current->StoreWay(objId, metaData, tags, refs);
+}
+
+bool PbfEncodeParallel::StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+	const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+	const std::vector<std::string> &refRoles)
+{
+	StartObject(3);
+	return this->current->StoreRelation(objId, metaData, tags, refTypeStrs, refIds, refRoles);
+}
+
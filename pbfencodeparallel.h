@@ -0,0 +1,70 @@
+#ifndef _PBF_ENCODE_PARALLEL_H
+#define _PBF_ENCODE_PARALLEL_H
+
+#include <streambuf>
+#include <string>
+#include <vector>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include "cppo5m/OsmData.h"
+
+//Writes OSM PBF. Objects are grouped into blocks of up to blockSize entities of a single type.
+//Blocks are encoded and zlib compressed on numThreads worker threads, then written in the
+//order the objects were stored. At most maxQueuedBlocks blocks are held in memory.
+//If historical is set, the visible flag of each object is written.
+class PbfEncodeParallel : public IDataStreamHandler
+{
+private:
+	class PbfBlockJob
+	{
+	public:
+		std::shared_ptr<class OsmData> data;
+		std::string output;
+		bool done;
+	};
+
+	std::streambuf &handle;
+	size_t blockSize, maxQueuedBlocks;
+	std::shared_ptr<class OsmData> current;
+	size_t currentCount;
+	int currentType; //0 none, 1 node, 2 way, 3 relation
+	bool headerWritten, finished, historical;
+	std::vector<double> bbox;
+
+	std::deque<std::shared_ptr<class PbfBlockJob> > jobs; //In output order
+	std::deque<std::shared_ptr<class PbfBlockJob> > pending; //Waiting for a worker
+	std::vector<std::thread> workers;
+	std::mutex mtx;
+	std::condition_variable changed;
+	bool stopping;
+	std::string errStr;
+
+	void WriteHeader();
+	void StartObject(int objType);
+	void FlushBlock();
+	void WriteJobs(size_t maxRemaining);
+	void Worker();
+
+public:
+	PbfEncodeParallel(std::streambuf &handle, int numThreads, size_t blockSize = 8000, bool historical = false);
+	virtual ~PbfEncodeParallel();
+
+	virtual bool Sync();
+	virtual bool Reset();
+	virtual bool Finish();
+
+	virtual bool StoreIsDiff(bool);
+	virtual bool StoreBounds(double x1, double y1, double x2, double y2);
+	virtual bool StoreNode(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, double lat, double lon);
+	virtual bool StoreWay(int64_t objId, const class MetaData &metaData,
+		const TagMap &tags, const std::vector<int64_t> &refs);
+	virtual bool StoreRelation(int64_t objId, const class MetaData &metaData, const TagMap &tags,
+		const std::vector<std::string> &refTypeStrs, const std::vector<int64_t> &refIds,
+		const std::vector<std::string> &refRoles);
+};
+
+#endif //_PBF_ENCODE_PARALLEL_H
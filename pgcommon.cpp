@@ -1,5 +1,6 @@
 #include "pgcommon.h"
 #include "dbquery.h"
+#include "tileexpiry.h"
 #include <stdexcept>
 #include <iostream>
 using namespace std;
@@ -60,47 +61,6 @@ bool PgCommon::IsAdminMode()
 	return false;
 }
 
-void PgCommon::GetWaysForNodes(const std::set<int64_t> &objectIds, 
-	std::shared_ptr<IDataStreamHandler> out)
-{
-	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
-	if(!work)
-		throw runtime_error("Transaction has been deleted");
-
-	GetLiveWaysThatContainNodes(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, this->tableActivePrefix, objectIds, out);
-
-	GetLiveWaysThatContainNodes(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, "", objectIds, out);
-}
-
-void PgCommon::GetRelationsForObjs(const std::string &type, const std::set<int64_t> &objectIds, 
-	std::shared_ptr<IDataStreamHandler> out)
-{
-	if(type.size() == 0)
-		throw invalid_argument("Type string cannot be zero length");
-	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
-	if(!work)
-		throw runtime_error("Transaction has been deleted");
-
-	set<int64_t> empty;
-	std::set<int64_t>::const_iterator it = objectIds.begin();
-	while(it != objectIds.end())
-	{
-		GetLiveRelationsForObjects(*dbconn, work.get(), this->dbUsernameLookup,
-			this->tableStaticPrefix, 
-			this->tableActivePrefix, 
-			type[0], objectIds, it, 1000, empty, out);
-	}
-	it = objectIds.begin();
-	while(it != objectIds.end())
-	{
-		GetLiveRelationsForObjects(*dbconn, work.get(), this->dbUsernameLookup,
-			this->tableActivePrefix, "", 
-			type[0], objectIds, it, 1000, empty, out);
-	}
-}
-
 void PgCommon::GetAffectedParents(std::shared_ptr<class OsmData> inputObjects,
 	std::shared_ptr<class OsmData> outputObjects)
 {
@@ -127,58 +87,19 @@ void PgCommon::GetAffectedParents2(const class OsmData &inputObjects,
 	for(size_t i=0; i<inputObjects.relations.size(); i++)
 		inputRelationIds.insert(inputObjects.relations[i].objId);
 
-	//For all nodes affected, find all parent ways and relations affected
-	std::shared_ptr<class OsmData> parentObjs(new class OsmData());
-	GetWaysForNodes(inputNodeIds, parentObjs);
-	for(size_t i=0; i<parentObjs->ways.size(); i++)
-	{
-		class OsmWay &way = parentObjs->ways[i];
-		auto it = inputWayIds.find(way.objId);
-		if(it == inputWayIds.end())
-		{
-			inputWayIds.insert(way.objId);
-			outAffectedObjects->ways.push_back(way);
-		}
-	}
-	parentObjs->Clear();
-
-	//For all ways affected, find all parent relations affected
-	GetRelationsForObjs("node", inputNodeIds, parentObjs);
-	GetRelationsForObjs("way", inputWayIds, parentObjs);
-	for(size_t i=0; i<parentObjs->relations.size(); i++)
-	{
-		class OsmRelation &relation = parentObjs->relations[i];
-		auto it = inputRelationIds.find(relation.objId);
-		if(it == inputRelationIds.end())
-		{
-			inputRelationIds.insert(relation.objId);
-			outAffectedObjects->relations.push_back(relation);
-		}
-	}
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
 
-	//For all relations affected, recusively find parent relations
-	std::set<int64_t> currentRelationIds = inputRelationIds;
-	int depth = 0;
-	while(currentRelationIds.size() > 0 and depth < 10)
-	{
-		std::shared_ptr<class OsmData> parentRelationObjs(new class OsmData());
-		GetRelationsForObjs("relation", currentRelationIds, parentRelationObjs);
-		
-		currentRelationIds.clear();
-		for(size_t i=0; i<parentRelationObjs->relations.size(); i++)
-		{
-			class OsmRelation &relation = parentRelationObjs->relations[i];
-			auto it = inputRelationIds.find(relation.objId);
-			if(it == inputRelationIds.end())
-			{
-				outAffectedObjects->relations.push_back(relation);
-				currentRelationIds.insert(relation.objId);
-				inputRelationIds.insert(relation.objId);
-			}
-		}
-		depth ++;
-	}
+	//For all nodes affected, find parent ways. Then find all relations that contain the
+	//affected objects, recursing up through parent relations on the server.
+	GetAffectedParentWays(*dbconn, work.get(), this->dbUsernameLookup,
+		this->tableStaticPrefix, this->tableActivePrefix, 
+		inputNodeIds, inputWayIds, outAffectedObjects);
 
+	GetAffectedParentRelations(*dbconn, work.get(), this->dbUsernameLookup,
+		this->tableStaticPrefix, this->tableActivePrefix, 
+		inputNodeIds, inputWayIds, inputRelationIds, 10, outAffectedObjects);
 }
 
 void PgCommon::GetObjectBboxes(const std::string &type, const std::set<int64_t> &objectIds,
@@ -192,4 +113,37 @@ void PgCommon::GetObjectBboxes(const std::string &type, const std::set<int64_t>
 		this->tableActivePrefix, type, objectIds, out);
 }
 
+void PgCommon::ExpireObjectTiles(const std::string &type, const std::set<int64_t> &objectIds,
+	class TileExpiry &expiry)
+{
+	std::set<int64_t> batch;
+	for(auto it=objectIds.begin(); it!=objectIds.end(); )
+	{
+		batch.insert(*it);
+		it++;
+		if(batch.size() < 1000 && it != objectIds.end())
+			continue;
+
+		std::map<int64_t, vector<double> > bboxes;
+		this->GetObjectBboxes(type, batch, bboxes);
+		for(auto it2=bboxes.begin(); it2!=bboxes.end(); it2++)
+			expiry.ExpireBbox(it2->second);
+		batch.clear();
+	}
+}
+
+void PgCommon::ExpireObjectTiles(const class OsmData &objs, class TileExpiry &expiry)
+{
+	std::set<int64_t> nodeIds, wayIds, relationIds;
+	for(size_t i=0; i<objs.nodes.size(); i++)
+		nodeIds.insert(objs.nodes[i].objId);
+	for(size_t i=0; i<objs.ways.size(); i++)
+		wayIds.insert(objs.ways[i].objId);
+	for(size_t i=0; i<objs.relations.size(); i++)
+		relationIds.insert(objs.relations[i].objId);
+	this->ExpireObjectTiles("node", nodeIds, expiry);
+	this->ExpireObjectTiles("way", wayIds, expiry);
+	this->ExpireObjectTiles("relation", relationIds, expiry);
+}
+
 // **********************************************
@@ -42,10 +42,6 @@ public:
 
 	virtual bool IsAdminMode();
 
-	void GetWaysForNodes(const std::set<int64_t> &objectIds, 
-		std::shared_ptr<IDataStreamHandler> out);	
-	void GetRelationsForObjs(const std::string &type, const std::set<int64_t> &objectIds, 
-		std::shared_ptr<IDataStreamHandler> out);
 	void GetAffectedParents(std::shared_ptr<class OsmData> inputObjects,
 		std::shared_ptr<class OsmData> outputObjects);	
 	void GetAffectedParents2(const class OsmData &inputObjects,
@@ -53,6 +49,10 @@ public:
 
 	void GetObjectBboxes(const std::string &type, const std::set<int64_t> &objectIds,
 		std::map<int64_t, std::vector<double> > &out);
+	//Adds the current envelopes of visible objects to the expiry list
+	void ExpireObjectTiles(const std::string &type, const std::set<int64_t> &objectIds,
+		class TileExpiry &expiry);
+	void ExpireObjectTiles(const class OsmData &objs, class TileExpiry &expiry);
 
 };
 
@@ -11,9 +11,16 @@
 #include "dbmeta.h"
 #include "dbcommon.h"
 #include "dboverpass.h"
+#include "dbtagstats.h"
+#include "dbcopystream.h"
+#include "dbparallel.h"
+#include "tileexpiry.h"
+#include "changesetbbox.h"
 #include "util.h"
 #include "cppo5m/OsmData.h"
 #include <algorithm>
+#include <ctime>
+#include <boost/filesystem.hpp>
 using namespace std;
 
 PgMapError::PgMapError()
@@ -123,6 +130,53 @@ PgChangeset& PgChangeset::operator=(const PgChangeset &obj)
 
 // **********************************************
 
+PgChangesetFilter::PgChangesetFilter()
+{
+	user_uid = 0;
+	openedBeforeTimestamp = -1;
+	closedAfterTimestamp = -1;
+	is_open_only = false;
+	is_closed_only = false;
+}
+
+PgChangesetFilter::~PgChangesetFilter()
+{
+
+}
+
+// **********************************************
+
+PgChangesetCursor::PgChangesetCursor():
+	closeKey(0),
+	id(0)
+{
+
+}
+
+PgChangesetCursor::~PgChangesetCursor()
+{
+
+}
+
+// **********************************************
+
+PgQueryEstimate::PgQueryEstimate():
+	totalObjects(0),
+	tagMatches(0),
+	bboxMatches(0),
+	matches(0),
+	statsTimestamp(0)
+{
+
+}
+
+PgQueryEstimate::~PgQueryEstimate()
+{
+
+}
+
+// **********************************************
+
 PgMapQuery::PgMapQuery(const string &tableStaticPrefixIn, 
 		const string &tableActivePrefixIn,
 		shared_ptr<pqxx::connection> &db,
@@ -535,10 +589,18 @@ PgTransaction::PgTransaction(shared_ptr<pqxx::connection> dbconnIn,
 	const string &tableStaticPrefixIn, 
 	const string &tableActivePrefixIn,
 	std::shared_ptr<class PgWork> sharedWorkIn,
-	const std::string &shareMode):
-
-	PgCommon(dbconnIn, tableStaticPrefixIn, tableActivePrefixIn, sharedWorkIn, shareMode)
-{
+	const std::string &shareMode,
+	const std::string &connectionStringIn,
+	std::shared_ptr<class ChangesetBboxAccumulator> bboxAccumulatorIn,
+	const std::string &tableStatsPrefixIn):
+
+	PgCommon(dbconnIn, tableStaticPrefixIn, tableActivePrefixIn, sharedWorkIn, shareMode),
+	connectionString(connectionStringIn),
+	tableStatsPrefix(tableStatsPrefixIn),
+	bboxAccumulator(bboxAccumulatorIn)
+{
+	if(this->tableStatsPrefix.size() == 0)
+		this->tableStatsPrefix = this->tableActivePrefix;
 	string errStr;
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
@@ -727,7 +789,8 @@ bool PgTransaction::StoreObjects(class OsmData &data,
 	std::map<int64_t, int64_t> &createdWayIds,
 	std::map<int64_t, int64_t> &createdRelationIds,
 	bool saveToStaticTables,
-	class PgMapError &errStr)
+	class PgMapError &errStr,
+	class TileExpiry *expiry)
 {
 	std::string nativeErrStr;
 	if(this->shareMode != "EXCLUSIVE")
@@ -745,9 +808,21 @@ bool PgTransaction::StoreObjects(class OsmData &data,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
+	//Expire the old envelopes, and the new positions of nodes. The new envelopes of ways
+	//and relations are expired when their bboxes are updated.
+	if(expiry != nullptr)
+		this->ExpireObjectTiles(data, *expiry);
+
 	bool ok = ::StoreObjects(*dbconn, work.get(), tablePrefix, data, createdNodeIds, createdWayIds, createdRelationIds, nativeErrStr);
 	errStr.errStr = nativeErrStr;
 
+	if(ok && expiry != nullptr)
+	{
+		for(size_t i=0; i<data.nodes.size(); i++)
+			if(data.nodes[i].metaData.visible)
+				expiry->ExpirePoint(data.nodes[i].lon, data.nodes[i].lat);
+	}
+
 	return ok;
 }
 
@@ -755,7 +830,8 @@ int PgTransaction::UpdateObjectBboxesById(
 	const std::string &objType,
 	const std::set<int64_t> &objectIds, int verbose, 
 	bool saveToStaticTables,
-	class PgMapError &errStr)
+	class PgMapError &errStr,
+	class TileExpiry *expiry)
 {
 	std::string nativeErrStr;
 	if(this->shareMode != "EXCLUSIVE")
@@ -789,6 +865,9 @@ int PgTransaction::UpdateObjectBboxesById(
 			nativeErrStr);
 	}
 
+	if(expiry != nullptr)
+		this->ExpireObjectTiles(objType, objectIds, *expiry);
+
 	errStr.errStr = nativeErrStr;
 
 	return ok;
@@ -830,6 +909,11 @@ bool PgTransaction::ResetActiveTables(class PgMapError &errStr)
 }
 
 void PgTransaction::GetReplicateDiff(int64_t timestampStart, int64_t timestampEnd, class OsmChange &out)
+{
+	this->GetReplicateDiffStream(timestampStart, timestampEnd, out);
+}
+
+void PgTransaction::GetReplicateDiffStream(int64_t timestampStart, int64_t timestampEnd, class IOsmChangeBlock &out)
 {
 	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
 		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
@@ -837,43 +921,37 @@ void PgTransaction::GetReplicateDiff(int64_t timestampStart, int64_t timestampEn
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
-	std::shared_ptr<class OsmData> osmData(new class OsmData);
-
-	GetReplicateDiffNodes(*dbconn, work.get(), this->dbUsernameLookup, 
-		this->tableStaticPrefix, false, timestampStart, timestampEnd, out);
-
-	GetReplicateDiffNodes(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, true, timestampStart, timestampEnd, out);
-
-	GetReplicateDiffNodes(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, false, timestampStart, timestampEnd, out);
 
-	GetReplicateDiffNodes(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, true, timestampStart, timestampEnd, out);
-
-	GetReplicateDiffWays(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, false, timestampStart, timestampEnd, out);
-
-	GetReplicateDiffWays(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, true, timestampStart, timestampEnd, out);
+	::GetReplicateDiffStream(*dbconn, work.get(), this->dbUsernameLookup, 
+		this->tableStaticPrefix, this->tableActivePrefix, timestampStart, timestampEnd, out);
+}
 
-	GetReplicateDiffWays(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, false, timestampStart, timestampEnd, out);
+void PgTransaction::GetReplicateDiffFromEditActivity(int64_t timestampStart, int64_t timestampEnd, class IOsmChangeBlock &out)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
 
-	GetReplicateDiffWays(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, true, timestampStart, timestampEnd, out);
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
 
-	GetReplicateDiffRelations(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, false, timestampStart, timestampEnd, out);
+	::GetReplicateDiffFromEditActivity(*dbconn, work.get(), this->dbUsernameLookup, 
+		this->tableActivePrefix, timestampStart, timestampEnd, out);
+}
 
-	GetReplicateDiffRelations(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix, true, timestampStart, timestampEnd, out);
+void PgTransaction::WriteReplicateDiff(const std::string &basePath, int64_t sequenceNumber,
+	int64_t timestampStart, int64_t timestampEnd, bool fromEditActivity)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
 
-	GetReplicateDiffRelations(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, false, timestampStart, timestampEnd, out);
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
 
-	GetReplicateDiffRelations(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix, true, timestampStart, timestampEnd, out);
+	WriteReplicateDiffFile(*dbconn, work.get(), this->dbUsernameLookup, 
+		this->tableStaticPrefix, this->tableActivePrefix, 
+		basePath, sequenceNumber, timestampStart, timestampEnd, fromEditActivity);
 }
 
 /**
@@ -912,6 +990,91 @@ void PgTransaction::Dump(bool order, bool nodes, bool ways, bool relations,
 	enc->Finish();
 }
 
+void PgTransaction::DumpMerged(bool nodes, bool ways, bool relations, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	enc->StoreIsDiff(false);
+
+	if(nodes)
+	{
+		::DumpMerged(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"node", enc);
+		enc->Reset();
+	}
+
+	if(ways)
+	{
+		::DumpMerged(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"way", enc);
+		enc->Reset();
+	}
+
+	if(relations)
+	{
+		::DumpMerged(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"relation", enc);
+	}
+
+	enc->Finish();
+}
+
+void PgTransaction::DumpHistory(bool nodes, bool ways, bool relations, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	enc->StoreIsDiff(false);
+
+	if(nodes)
+	{
+		::DumpHistory(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"node", enc);
+		enc->Reset();
+	}
+
+	if(ways)
+	{
+		::DumpHistory(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"way", enc);
+		enc->Reset();
+	}
+
+	if(relations)
+	{
+		::DumpHistory(*dbconn, work.get(), this->dbUsernameLookup, this->tableStaticPrefix, this->tableActivePrefix, 
+			"relation", enc);
+	}
+
+	enc->Finish();
+}
+
+void PgTransaction::DumpParallel(int numWorkers, int64_t rangeSize, bool nodes, bool ways, bool relations, 
+	std::shared_ptr<IDataStreamHandler> enc)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	enc->StoreIsDiff(false);
+
+	::DumpParallel(*dbconn, work.get(), this->connectionString, this->tableStaticPrefix, this->tableActivePrefix, 
+		numWorkers, rangeSize, nodes, ways, relations, enc);
+
+	enc->Finish();
+}
+
 int64_t PgTransaction::GetAllocatedId(const string &type)
 {
 	if(this->shareMode != "EXCLUSIVE")
@@ -982,56 +1145,67 @@ int PgTransaction::GetChangeset(int64_t objId,
 			errStrNative);
 	}
 
+	//Include envelopes that have not been written yet
+	if(ret == 1 && this->bboxAccumulator)
+	{
+		std::map<int64_t, std::vector<double> > pending;
+		std::map<int64_t, uint64_t> generations;
+		this->bboxAccumulator->GetPending(objId, INT64_MAX, pending, generations);
+		auto it = this->uncommittedBboxes.find(objId);
+		if(it != this->uncommittedBboxes.end())
+			MergeBbox(pending[objId], it->second);
+
+		auto it2 = pending.find(objId);
+		if(it2 != pending.end())
+		{
+			std::vector<double> bbox;
+			if(changesetOut.bbox_set)
+			{
+				bbox.push_back(changesetOut.x1);
+				bbox.push_back(changesetOut.y1);
+				bbox.push_back(changesetOut.x2);
+				bbox.push_back(changesetOut.y2);
+			}
+			MergeBbox(bbox, it2->second);
+			changesetOut.x1 = bbox[0];
+			changesetOut.y1 = bbox[1];
+			changesetOut.x2 = bbox[2];
+			changesetOut.y2 = bbox[3];
+			changesetOut.bbox_set = true;
+		}
+	}
+
 	errStr.errStr = errStrNative;
 	return ret;
 }
 
 int PgTransaction::GetChangesetOsmChange(int64_t changesetId,
 	std::shared_ptr<class IOsmChangeBlock> output,
-	class PgMapError &errStr)
+	class PgMapError &errStr,
+	const std::string &cachePath)
 {
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
-	std::shared_ptr<class OsmData> data(new class OsmData());
-	GetAllNodesByChangeset(*dbconn, work.get(), this->dbUsernameLookup, 
-		this->tableStaticPrefix,
-		"", changesetId,
-		data);
-	GetAllNodesByChangeset(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix,
-		"", changesetId,
-		data);
 
-	GetAllWaysByChangeset(*dbconn, work.get(), this->dbUsernameLookup,	
-		this->tableStaticPrefix,
-		"", changesetId,
-		data);
-	GetAllWaysByChangeset(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix,
-		"", changesetId,
-		data);
+	//Closed changesets never change, so their output can be cached
+	bool useCache = false;
+	if(cachePath.size() > 0)
+	{
+		class PgChangeset changeset;
+		class PgMapError csErrStr;
+		int ret = this->GetChangeset(changesetId, changeset, csErrStr);
+		useCache = ret == 1 && !changeset.is_open;
+	}
 
-	GetAllRelationsByChangeset(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableStaticPrefix,
-		"", changesetId,
-		data);
-	GetAllRelationsByChangeset(*dbconn, work.get(), this->dbUsernameLookup,
-		this->tableActivePrefix,
-		"", changesetId,
-		data);
-
-	class OsmData created, modified, deleted;
-	FilterObjectsInOsmChange(1, *data, created);
-	FilterObjectsInOsmChange(2, *data, modified);
-	FilterObjectsInOsmChange(3, *data, deleted);
-
-	if(!created.IsEmpty())
-		output->StoreOsmData("create", created, false);
-	if(!modified.IsEmpty())
-		output->StoreOsmData("modify", modified, false);
-	if(!deleted.IsEmpty())	
-		output->StoreOsmData("delete", deleted, false);
+	if(useCache)
+		GetChangesetOsmChangeCached(*dbconn, work.get(), this->dbUsernameLookup, 
+			this->tableStaticPrefix, this->tableActivePrefix, 
+			changesetId, cachePath, *output);
+	else
+		GetChangesetOsmChangeFromDb(*dbconn, work.get(), this->dbUsernameLookup, 
+			this->tableStaticPrefix, this->tableActivePrefix, 
+			changesetId, *output);
 	return 1;
 }
 
@@ -1094,6 +1268,66 @@ bool PgTransaction::GetChangesets(std::vector<class PgChangeset> &changesetsOut,
 	return true;
 }
 
+static bool ChangesetPageOrder(const class PgChangeset &a, const class PgChangeset &b)
+{
+	int64_t keyA = ChangesetSortKey(a), keyB = ChangesetSortKey(b);
+	if(keyA != keyB)
+		return keyA > keyB;
+	return a.objId > b.objId;
+}
+
+bool PgTransaction::GetChangesetsPage(const class PgChangesetFilter &filter, size_t pageSize,
+	const class PgChangesetCursor &after,
+	std::vector<class PgChangeset> &changesetsOut,
+	class PgChangesetCursor &next,
+	class PgMapError &errStr)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+	if(pageSize == 0)
+		throw invalid_argument("Page size must be more than zero");
+
+	string errStrNative;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	next.closeKey = 0;
+	next.id = 0;
+
+	//Get a page from each table set, then merge them
+	std::vector<class PgChangeset> changesets;
+	bool ok = GetChangesetsPageFromDb(*dbconn, work.get(),
+		this->tableActivePrefix, "",
+		this->dbUsernameLookup, 
+		filter, pageSize, after.closeKey, after.id,
+		changesets,
+		errStrNative);
+	if(ok)
+		ok = GetChangesetsPageFromDb(*dbconn, work.get(),
+			this->tableStaticPrefix, this->tableActivePrefix,
+			this->dbUsernameLookup, 
+			filter, pageSize, after.closeKey, after.id,
+			changesets,
+			errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
+	sort(changesets.begin(), changesets.end(), ChangesetPageOrder);
+	if(changesets.size() > pageSize)
+		changesets.resize(pageSize);
+	changesetsOut.insert(changesetsOut.end(), changesets.begin(), changesets.end());
+
+	if(changesets.size() == pageSize)
+	{
+		next.closeKey = ChangesetSortKey(changesets.back());
+		next.id = changesets.back().objId;
+	}
+	return true;
+}
+
 int64_t PgTransaction::CreateChangeset(const class PgChangeset &changeset,
 	class PgMapError &errStr)
 {
@@ -1198,6 +1432,23 @@ bool PgTransaction::ExpandChangesetBbox(int64_t cid,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
+	bool accumulate = this->bboxAccumulator && this->bboxAccumulator->GetFlushInterval() > 0;
+	if(accumulate && (this->uncommittedTracked.find(cid) != this->uncommittedTracked.end() 
+		|| this->bboxAccumulator->IsTracked(cid)))
+	{
+		MergeBbox(this->uncommittedBboxes[cid], bbox);
+
+		//Write envelopes that have waited long enough
+		int64_t addedBefore = (int64_t)time(nullptr) - this->bboxAccumulator->GetFlushInterval();
+		bool ok = this->WriteChangesetBboxes(0, addedBefore, errStrNative);
+		if(!ok)
+		{
+			errStr.errStr = errStrNative;
+			return false;
+		}
+		return true;
+	}
+
 	//Attempt to update in active table
 	int rowsAffected = DbExpandChangesetBbox(*dbconn, work.get(),
 		this->tableActivePrefix,
@@ -1211,9 +1462,68 @@ bool PgTransaction::ExpandChangesetBbox(int64_t cid,
 		return false;
 	}
 
+	if(accumulate && rowsAffected > 0)
+		this->uncommittedTracked.insert(cid);
 	return rowsAffected > 0;
 }
 
+bool PgTransaction::FlushChangesetBboxes(int64_t maxAge, class PgMapError &errStr)
+{
+	//Only changeset rows are updated, which are locked by the update itself
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+	string errStrNative;	
+	if(atoi(this->GetMetaValue("readonly", errStr).c_str()) == 1)
+	{
+		errStr.errStr = "Database is in READ ONLY mode";
+		return false;
+	}
+
+	bool ok = this->WriteChangesetBboxes(0, (int64_t)time(nullptr) - maxAge, errStrNative);
+	errStr.errStr = errStrNative;
+	return ok;
+}
+
+bool PgTransaction::WriteChangesetBboxes(int64_t cid, int64_t addedBefore, std::string &errStr)
+{
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	std::map<int64_t, std::vector<double> > pending;
+	std::map<int64_t, uint64_t> generations;
+	if(this->bboxAccumulator)
+		this->bboxAccumulator->GetPending(cid, addedBefore, pending, generations);
+
+	//Envelopes from this transaction are written along with them
+	for(auto it = this->uncommittedBboxes.begin(); it != this->uncommittedBboxes.end(); )
+	{
+		if(cid != 0 && it->first != cid)
+		{
+			it++;
+			continue;
+		}
+		MergeBbox(pending[it->first], it->second);
+		it = this->uncommittedBboxes.erase(it);
+	}
+
+	for(auto it = pending.begin(); it != pending.end(); it++)
+	{
+		int rowsAffected = DbExpandChangesetBbox(*dbconn, work.get(),
+			this->tableActivePrefix,
+			it->first,
+			it->second,
+			errStr);
+		if(rowsAffected < 0)
+			return false;
+	}
+
+	//Only released from the accumulator once this transaction commits
+	for(auto it = generations.begin(); it != generations.end(); it++)
+		this->writtenBboxes[it->first] = it->second;
+	return true;
+}
+
 bool PgTransaction::CloseChangeset(int64_t changesetId,
 	int64_t closedTimestamp,
 	class PgMapError &errStr)
@@ -1232,7 +1542,14 @@ bool PgTransaction::CloseChangeset(int64_t changesetId,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
-	bool ok = CloseChangesetInDb(*dbconn, work.get(),
+	bool ok = this->WriteChangesetBboxes(changesetId, INT64_MAX, errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
+	ok = CloseChangesetInDb(*dbconn, work.get(),
 		this->tableActivePrefix,
 		changesetId,
 		closedTimestamp,
@@ -1276,6 +1593,15 @@ bool PgTransaction::CloseChangeset(int64_t changesetId,
 			errStrNative);
 	}
 
+	//Include envelopes that were held by a process that ended without writing them
+	if(ok)
+		ok = DbExpandChangesetBboxFromObjects(*dbconn, work.get(),
+			this->tableActivePrefix,
+			changesetId, 0,
+			errStrNative);
+
+	if(ok)
+		this->closedChangesets.insert(changesetId);
 	errStr.errStr = errStrNative;
 	return ok;
 }
@@ -1298,9 +1624,17 @@ bool PgTransaction::CloseChangesetsOlderThan(int64_t whereBeforeTimestamp,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
+	//Write all held envelopes, since any of them might be about to close
+	bool ok = this->WriteChangesetBboxes(0, INT64_MAX, errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
 	//Find changesets in static that have not been closed in active tables
 	std::vector<class PgChangeset> openStaticChangesets;
-	bool ok = GetChangesetsFromDb(*dbconn, work.get(),
+	ok = GetChangesetsFromDb(*dbconn, work.get(),
 		this->tableStaticPrefix, this->tableActivePrefix,
 		this->dbUsernameLookup, 
 		0, //Get all
@@ -1336,6 +1670,17 @@ bool PgTransaction::CloseChangesetsOlderThan(int64_t whereBeforeTimestamp,
 		}
 	}
 
+	//Include envelopes that were held by a process that ended without writing them
+	ok = DbExpandChangesetBboxFromObjects(*dbconn, work.get(),
+		this->tableActivePrefix,
+		0, whereBeforeTimestamp,
+		errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
 	//Close changesets in active table
 	ok = CloseChangesetsOlderThanInDb(*dbconn, work.get(),
 		this->tableActivePrefix,
@@ -1463,7 +1808,8 @@ void PgTransaction::XapiQuery(const std::string &objType,
 	const std::string &tagKey,
 	const std::string &tagValue,
 	const std::vector<double> &bbox, 
-	std::shared_ptr<IDataStreamHandler> enc)
+	std::shared_ptr<IDataStreamHandler> enc,
+	const std::string &recurse)
 {
 	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
 		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
@@ -1471,19 +1817,27 @@ void PgTransaction::XapiQuery(const std::string &objType,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
+	class TagQuery query;
+	TagQueryFromKeyValue(tagKey, tagValue, query);
+
 	DbXapiQueryVisible(*dbconn, work.get(), 
 		this->dbUsernameLookup, 
+		this->tableStaticPrefix, 
 		this->tableActivePrefix, 
+		this->tableStatsPrefix, 
 		objType,
-		tagKey,
-		tagValue,
+		query,
 		bbox, 
+		recurse,
 		enc);
 }
 
-void PgTransaction::GetMostActiveUsers(int64_t startTimestamp,
-	std::vector<int64_t> &uidOut,
-	std::vector<std::vector<int64_t> > &objectCountOut)
+bool PgTransaction::XapiQueryExpr(const std::string &objType,
+	const std::string &tagQuery,
+	const std::vector<double> &bbox, 
+	std::shared_ptr<IDataStreamHandler> enc,
+	class PgMapError &errStr,
+	const std::string &recurse)
 {
 	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
 		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
@@ -1491,20 +1845,117 @@ void PgTransaction::GetMostActiveUsers(int64_t startTimestamp,
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
-	DbGetMostActiveUsers(*dbconn, work.get(), 
-		this->tableActivePrefix, 
-		startTimestamp,
-		uidOut,
-		objectCountOut);
-}
-
-void PgTransaction::Commit()
+	class TagQuery query;
+	string errStrNative;
+	bool ok = ParseTagQuery(tagQuery, query, errStrNative);
+	if(ok)
+		ok = DbCheckTagQueryRegexes(*dbconn, work.get(), query, errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
+	DbXapiQueryVisible(*dbconn, work.get(), 
+		this->dbUsernameLookup, 
+		this->tableStaticPrefix, 
+		this->tableActivePrefix, 
+		this->tableStatsPrefix, 
+		objType,
+		query,
+		bbox, 
+		recurse,
+		enc);
+	return true;
+}
+
+bool PgTransaction::EstimateXapiQuery(const std::string &objType,
+	const std::string &tagQuery,
+	const std::vector<double> &bbox, 
+	class PgQueryEstimate &estimateOut,
+	class PgMapError &errStr)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	class TagQuery query;
+	string errStrNative;
+	bool ok = ParseTagQuery(tagQuery, query, errStrNative);
+	if(!ok)
+	{
+		errStr.errStr = errStrNative;
+		return false;
+	}
+
+	estimateOut = PgQueryEstimate();
+	std::vector<std::string> objTypes = {"node", "way", "relation"};
+	for(size_t i=0; i<objTypes.size(); i++)
+	{
+		if(objType != "*" && objType != objTypes[i])
+			continue;
+
+		class DbStatsEstimate estimate;
+		ok = DbEstimateObjects(*dbconn, work.get(), this->tableStatsPrefix, objTypes[i], 
+			query, bbox, estimate);
+		if(!ok)
+		{
+			errStr.errStr = "Tag statistics have not been built";
+			return false;
+		}
+
+		estimateOut.totalObjects += estimate.total;
+		estimateOut.tagMatches += (int64_t)(estimate.total * estimate.tagSelectivity);
+		estimateOut.bboxMatches += (int64_t)(estimate.total * estimate.bboxSelectivity);
+		estimateOut.matches += (int64_t)(estimate.total * estimate.tagSelectivity * estimate.bboxSelectivity);
+		estimateOut.statsTimestamp = estimate.timestamp;
+	}
+	return true;
+}
+
+void PgTransaction::GetMostActiveUsers(int64_t startTimestamp,
+	std::vector<int64_t> &uidOut,
+	std::vector<std::vector<int64_t> > &objectCountOut)
+{
+	if(this->shareMode != "ACCESS SHARE" && this->shareMode != "EXCLUSIVE")
+		throw runtime_error("Database must be locked in ACCESS SHARE or EXCLUSIVE mode");
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	DbGetMostActiveUsers(*dbconn, work.get(), 
+		this->tableActivePrefix, 
+		startTimestamp,
+		uidOut,
+		objectCountOut);
+}
+
+void PgTransaction::Commit()
 {
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 	//Release locks
 	work->commit();
+
+	if(this->bboxAccumulator)
+	{
+		int64_t now = (int64_t)time(nullptr);
+		this->bboxAccumulator->Written(this->writtenBboxes);
+		this->bboxAccumulator->Forget(this->closedChangesets);
+		for(auto it = this->uncommittedTracked.begin(); it != this->uncommittedTracked.end(); it++)
+			if(this->closedChangesets.find(*it) == this->closedChangesets.end())
+				this->bboxAccumulator->Track(*it, now);
+		for(auto it = this->uncommittedBboxes.begin(); it != this->uncommittedBboxes.end(); it++)
+			if(this->closedChangesets.find(it->first) == this->closedChangesets.end())
+				this->bboxAccumulator->Add(it->first, it->second, now);
+	}
+	this->uncommittedBboxes.clear();
+	this->uncommittedTracked.clear();
+	this->closedChangesets.clear();
+	this->writtenBboxes.clear();
 }
 
 void PgTransaction::Abort()
@@ -1513,6 +1964,12 @@ void PgTransaction::Abort()
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 	work->abort();
+
+	//Held envelopes that this transaction wrote are still held
+	this->uncommittedBboxes.clear();
+	this->uncommittedTracked.clear();
+	this->closedChangesets.clear();
+	this->writtenBboxes.clear();
 }
 
 // **********************************************
@@ -1522,11 +1979,13 @@ PgAdmin::PgAdmin(shared_ptr<pqxx::connection> dbconnIn,
 		const string &tableModPrefixIn,
 		const string &tableTestPrefixIn,
 		std::shared_ptr<class PgWork> sharedWorkIn,
-		const string &shareModeIn):
+		const string &shareModeIn,
+		const string &connectionStringIn):
 
 	PgCommon(dbconnIn, tableStaticPrefixIn, tableModPrefixIn, sharedWorkIn, shareMode),
 	tableModPrefix(tableModPrefixIn),
-	tableTestPrefix(tableTestPrefixIn)
+	tableTestPrefix(tableTestPrefixIn),
+	connectionString(connectionStringIn)
 {
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
@@ -1596,14 +2055,24 @@ bool PgAdmin::DropMapTables(int verbose, class PgMapError &errStr)
 	return ok;
 }
 
-bool PgAdmin::CopyMapData(int verbose, const std::string &filePrefix, class PgMapError &errStr)
+bool PgAdmin::CopyMapData(int verbose, const std::string &filePrefix, class PgMapError &errStr, bool binaryFormat)
 {
 	std::string nativeErrStr;
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
 
-	bool ok = DbCopyData(*dbconn, work.get(), verbose, filePrefix, this->tableStaticPrefix, nativeErrStr);
+	bool ok = DbCopyData(*dbconn, work.get(), verbose, filePrefix, this->tableStaticPrefix, binaryFormat, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+
+	return ok;
+}
+
+bool PgAdmin::StreamMapData(int verbose, const std::string &inputFilename, class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+
+	bool ok = DbStreamCopyData(this->connectionString, verbose, inputFilename, this->tableStaticPrefix, nativeErrStr);
 	errStr.errStr = nativeErrStr;
 
 	return ok;
@@ -1628,7 +2097,33 @@ bool PgAdmin::CreateMapIndices(int verbose, class PgMapError &errStr)
 	return ok;
 }
 
-bool PgAdmin::ApplyDiffs(const std::string &diffPath, int verbose, class PgMapError &errStr)
+bool PgAdmin::ParallelCopyAndIndex(int verbose, const std::string &filePrefix, bool binaryFormat, 
+	int numConnections, const std::string &maintenanceWorkMem, 
+	class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	std::vector<class DbParallelStep> steps;
+	if(filePrefix.size() > 0)
+		DbCopyDataSteps(*dbconn, filePrefix, this->tableStaticPrefix, binaryFormat, steps);
+	DbCreateIndicesSteps(*dbconn, work.get(), this->tableStaticPrefix, steps);
+	DbCreateIndicesSteps(*dbconn, work.get(), this->tableModPrefix, steps);
+	DbCreateIndicesSteps(*dbconn, work.get(), this->tableTestPrefix, steps);
+
+	bool ok = DbRunStepsParallel(this->connectionString, verbose, numConnections, 
+		maintenanceWorkMem, steps, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	if(verbose >= 1)
+		DbPrintStepTimings(steps);
+
+	return ok;
+}
+
+bool PgAdmin::ApplyDiffs(const std::string &diffPath, int verbose, class PgMapError &errStr, size_t maxObjects,
+	class TileExpiry *expiry)
 {
 	std::string nativeErrStr;
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
@@ -1636,13 +2131,245 @@ bool PgAdmin::ApplyDiffs(const std::string &diffPath, int verbose, class PgMapEr
 		throw runtime_error("Transaction has been deleted");
 
 	bool ok = DbApplyDiffs(*dbconn, work.get(), verbose, this->tableStaticPrefix, 
-		this->tableModPrefix, this->tableTestPrefix, diffPath, this, nativeErrStr);
+		this->tableModPrefix, this->tableTestPrefix, diffPath, maxObjects, this, nativeErrStr, expiry);
 	errStr.errStr = nativeErrStr;
 	if(!ok) return ok;
 
 	return true;
 }
 
+bool PgAdmin::ApplyDiffsPipelined(const std::string &diffPath, int verbose, size_t maxObjects, size_t prefetchBlocks, 
+	int numThreads, class PgMapError &errStr, class TileExpiry *expiry)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	vector<string> filenames;
+	DbListDiffFiles(diffPath, filenames);
+	bool ok = DbApplyDiffsPipelined(*dbconn, work.get(), verbose, this->tableModPrefix, 
+		filenames, maxObjects, prefetchBlocks, numThreads, this, nativeErrStr, nullptr, expiry);
+	errStr.errStr = nativeErrStr;
+	return ok;
+}
+
+bool PgAdmin::ApplyDiffsBulk(const std::string &diffPath, int verbose, int numConnections, 
+	class PgMapError &errStr, class TileExpiry *expiry)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	if(dynamic_cast<pqxx::nontransaction *>(work.get()) == nullptr)
+		throw runtime_error("Bulk diff application needs an admin object from GetAdmin() without a lock");
+
+	vector<string> filenames;
+	DbListDiffFiles(diffPath, filenames);
+	if(verbose >= 1)
+		cout << "Collapsing " << filenames.size() << " diffs" << endl;
+
+	class OsmData collapsed;
+	bool ok = DbCollapseDiffs(filenames, numConnections, numConnections, collapsed, nativeErrStr);
+	if(!ok)
+	{
+		errStr.errStr = nativeErrStr;
+		return false;
+	}
+	if(verbose >= 1)
+		cout << "Storing " << collapsed.nodes.size() << " nodes, " << collapsed.ways.size() << " ways, " 
+			<< collapsed.relations.size() << " relations" << endl;
+
+	//If an earlier run stored these diffs but did not finish updating bboxes, only do that
+	string pending;
+	try
+	{
+		pending = DbGetMetaValue(*dbconn, work.get(), "diffs_bulk_bbox_pending", this->tableModPrefix, nativeErrStr);
+	}
+	catch(runtime_error &err)
+	{
+		pending = "";
+	}
+	bool resumeBboxes = pending.size() > 0 && pending == diffPath;
+	if(pending.size() > 0 && !resumeBboxes)
+	{
+		errStr.errStr = "Bbox update for bulk diffs " + pending + " has not been completed";
+		return false;
+	}
+
+	if(expiry != nullptr)
+		this->ExpireObjectTiles(collapsed, *expiry);
+
+	if(resumeBboxes)
+	{
+		if(verbose >= 1)
+			cout << "Objects already stored, resuming bbox update" << endl;
+	}
+	else
+	{
+		//Recorded first, so the bbox pass can be re-run if this process stops after the store commits
+		ok = DbSetMetaValue(*dbconn, work.get(), "diffs_bulk_bbox_pending", diffPath, this->tableModPrefix, nativeErrStr);
+		if(ok)
+			ok = DbStoreObjectsParallel(this->connectionString, this->tableModPrefix, collapsed, 
+				numConnections, nativeErrStr);
+		if(!ok)
+		{
+			//Nothing was stored, so there is nothing to resume
+			string ignored;
+			DbSetMetaValue(*dbconn, work.get(), "diffs_bulk_bbox_pending", "", this->tableModPrefix, ignored);
+			errStr.errStr = nativeErrStr;
+			return false;
+		}
+	}
+
+	//Update bboxes once for the union of changed objects and their parents, in one transaction
+	//that also clears the pending record
+	std::set<int64_t> waysToUpdate, relsToUpdate;
+	for(size_t i=0; i<collapsed.ways.size(); i++)
+		waysToUpdate.insert(collapsed.ways[i].objId);
+	for(size_t i=0; i<collapsed.relations.size(); i++)
+		relsToUpdate.insert(collapsed.relations[i].objId);
+
+	std::shared_ptr<class OsmData> affectedParents = make_shared<class OsmData>();
+	work->exec("BEGIN;");
+	try
+	{
+		this->GetAffectedParents2(collapsed, affectedParents);
+		if(expiry != nullptr)
+			this->ExpireObjectTiles(*affectedParents, *expiry);
+
+		//Ensure a copy of affected parents is in the active table
+		std::map<int64_t, int64_t> unusedNodeIds, unusedWayIds, unusedRelationIds;
+		ok = ::StoreObjects(*dbconn, work.get(), this->tableModPrefix, *affectedParents.get(), 
+			unusedNodeIds, unusedWayIds, unusedRelationIds, nativeErrStr);
+		if(ok)
+		{
+			for(size_t i=0; i<affectedParents->ways.size(); i++)
+				waysToUpdate.insert(affectedParents->ways[i].objId);
+			for(size_t i=0; i<affectedParents->relations.size(); i++)
+				relsToUpdate.insert(affectedParents->relations[i].objId);
+
+			if(verbose >= 1)
+				cout << "Updating " << waysToUpdate.size() << " way and " << relsToUpdate.size() << " relation bboxes" << endl;
+			ok = ::UpdateWayBboxesById(*dbconn, work.get(), waysToUpdate, 0, this->tableModPrefix, nativeErrStr) == 0;
+			if(ok)
+				ok = ::UpdateRelationBboxesById(*dbconn, work.get(), relsToUpdate, 0, this->tableModPrefix, nativeErrStr) == 0;
+		}
+		if(ok)
+			ok = DbSetMetaValue(*dbconn, work.get(), "diffs_bulk_bbox_pending", "", this->tableModPrefix, nativeErrStr);
+	}
+	catch (const std::exception &e)
+	{
+		nativeErrStr = e.what();
+		ok = false;
+	}
+	if(!ok)
+	{
+		work->exec("ROLLBACK;");
+		errStr.errStr = nativeErrStr;
+		return false;
+	}
+	work->exec("COMMIT;");
+
+	if(expiry != nullptr)
+	{
+		for(size_t i=0; i<collapsed.nodes.size(); i++)
+			if(collapsed.nodes[i].metaData.visible)
+				expiry->ExpirePoint(collapsed.nodes[i].lon, collapsed.nodes[i].lat);
+		this->ExpireObjectTiles("way", waysToUpdate, *expiry);
+		this->ExpireObjectTiles("relation", relsToUpdate, *expiry);
+	}
+
+	return true;
+}
+
+bool PgAdmin::ApplyDiffFiles(const std::string &diffPath, const std::vector<std::string> &filenames, 
+	size_t maxObjects, size_t prefetchBlocks, int numThreads, int verbose, 
+	class PgMapError &errStr, class TileExpiry *expiry)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+	if(filenames.size() == 0)
+		return true;
+
+	std::map<std::string, int64_t> maxIds;
+	if(prefetchBlocks > 0)
+	{
+		bool ok = DbApplyDiffsPipelined(*dbconn, work.get(), verbose, this->tableModPrefix, 
+			filenames, maxObjects, prefetchBlocks, numThreads, this, nativeErrStr, &maxIds, expiry);
+		if(!ok)
+		{
+			errStr.errStr = nativeErrStr;
+			return false;
+		}
+	}
+	else
+	{
+		for(size_t i=0; i<filenames.size(); i++)
+		{
+			if(verbose >= 1)
+				cout << "   " << filenames[i] << endl;
+			bool ok = DbApplyDiffFile(*dbconn, work.get(), this->tableModPrefix, filenames[i], maxObjects, 
+				this, nativeErrStr, &maxIds, expiry, verbose);
+			if(!ok)
+			{
+				errStr.errStr = nativeErrStr;
+				return false;
+			}
+		}
+	}
+
+	//Keep next ids up to date, so a full refresh of the max ids is not needed
+	bool ok = DbRaiseNextIds(*dbconn, work.get(), this->tableModPrefix, maxIds, nativeErrStr);
+	if(ok)
+		ok = DbSetMetaValue(*dbconn, work.get(), "diffs_last_applied", 
+			DbDiffRelativePath(diffPath, filenames[filenames.size()-1]), 
+			this->tableModPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	return ok;
+}
+
+std::string PgAdmin::GetDiffCheckpoint()
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	try
+	{
+		return DbGetMetaValue(*dbconn, work.get(), "diffs_last_applied", this->tableModPrefix, nativeErrStr);
+	}
+	catch(runtime_error &err)
+	{
+		return "";
+	}
+}
+
+int64_t PgAdmin::FindDiffResumeIndex(const std::string &diffPath, const std::vector<std::string> &filenames, 
+	class PgMapError &errStr)
+{
+	string checkpoint = this->GetDiffCheckpoint();
+	if(checkpoint.size() == 0)
+		return 0;
+
+	//Only an exact match is safe, since file names don't necessarily sort in the order they were applied
+	for(size_t i=0; i<filenames.size(); i++)
+	{
+		if(DbDiffRelativePath(diffPath, filenames[i]) == checkpoint)
+			return i+1;
+	}
+	errStr.errStr = "Last applied diff " + checkpoint + " is not in " + diffPath;
+	return -1;
+}
+
+void PgAdmin::ListDiffFiles(const std::string &diffPath, std::vector<std::string> &out)
+{
+	DbListDiffFiles(diffPath, out);
+}
+
 bool PgAdmin::RefreshMapIds(int verbose, class PgMapError &errStr)
 {
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
@@ -1671,54 +2398,24 @@ bool PgAdmin::RefreshMapIds(int verbose, class PgMapError &errStr)
 
 bool PgAdmin::ImportChangesetMetadata(const std::string &fina, int verbose, class PgMapError &errStr)
 {
+	std::string nativeErrStr;
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
 	if(!work)
 		throw runtime_error("Transaction has been deleted");
-	class OsmChangesetsDecodeString osmChangesetsDecodeString;
 
-	std::string content;
-	try
-	{
-		int ret = ReadFileContents(fina.c_str(), 0, content);
-		if(ret < 1)
-		{
-			errStr.errStr = "Error reading file";
-			return false;
-		}
-	}
-	catch(const std::bad_alloc &err)
-	{
-		errStr.errStr = "Failed to allocate buffer: ";
-		errStr.errStr += err.what();
-		return false;
-	}
-	cout << fina << "," << content.length() << endl;
-
-	osmChangesetsDecodeString.DecodeSubString(content.c_str(), content.length(), 1);
-
-	if(!osmChangesetsDecodeString.parseCompletedOk)
-	{
-		errStr = osmChangesetsDecodeString.errString;
-		return false;
-	}
-
-	bool ok = true;
-	for(size_t i=0; i<osmChangesetsDecodeString.outChangesets.size(); i++)
-	{
-		int rowsAffected = UpdateChangesetInDb(*dbconn, work.get(), 
-			this->tableStaticPrefix,
-			osmChangesetsDecodeString.outChangesets[i],
-			errStr.errStr);
-
-		if(rowsAffected==0)
-			ok = InsertChangesetInDb(*dbconn, work.get(), 
-				this->tableStaticPrefix,
-				osmChangesetsDecodeString.outChangesets[i],
-				errStr.errStr);
-		if(!ok)
-			break;
-	}
+	int64_t count = 0;
+	bool ok = DbImportChangesets(*dbconn, work.get(), this->tableStaticPrefix, fina, count, nativeErrStr);
+	cout << fina << "," << count << endl;
+	errStr.errStr = nativeErrStr;
+	return ok;
+}
 
+bool PgAdmin::StreamChangesetMetadata(const std::string &fina, int verbose, class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+	bool ok = DbStreamCopyChangesets(this->connectionString, verbose, fina, 
+		this->tableStaticPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
 	return ok;
 }
 
@@ -1831,6 +2528,57 @@ bool PgAdmin::DropBboxIndices(int verbose, class PgMapError &errStr)
 	return ok;
 }
 
+bool PgAdmin::CreateTagIndices(int verbose, class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	bool ok = DbCreateTagIndices(*dbconn, work.get(), verbose, this->tableStaticPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	if(!ok) return ok;
+	ok = DbCreateTagIndices(*dbconn, work.get(), verbose, this->tableModPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	if(!ok) return ok;
+	ok = DbCreateTagIndices(*dbconn, work.get(), verbose, this->tableTestPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+
+	return ok;
+}
+
+bool PgAdmin::DropTagIndices(int verbose, class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	bool ok = DbDropTagIndices(*dbconn, work.get(), verbose, this->tableStaticPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	if(!ok) return ok;
+	ok = DbDropTagIndices(*dbconn, work.get(), verbose, this->tableModPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	if(!ok) return ok;
+	ok = DbDropTagIndices(*dbconn, work.get(), verbose, this->tableTestPrefix, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+
+	return ok;
+}
+
+bool PgAdmin::BuildTagStats(int verbose, int64_t minValueCount, double gridSize, class PgMapError &errStr)
+{
+	std::string nativeErrStr;
+	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
+	if(!work)
+		throw runtime_error("Transaction has been deleted");
+
+	bool ok = DbBuildTagStats(*dbconn, work.get(), verbose, this->tableModPrefix, 
+		minValueCount, gridSize, nativeErrStr);
+	errStr.errStr = nativeErrStr;
+	return ok;
+}
+
 bool PgAdmin::CheckNodesExistForWays(class PgMapError &errStr)
 {
 	std::shared_ptr<pqxx::transaction_base> work(this->sharedWork->work);
@@ -1902,10 +2650,32 @@ PgMap::PgMap(const string &connection, const string &tableStaticPrefixIn,
 	tableActivePrefix = tableActivePrefixIn;
 	tableModPrefix = tableModPrefixIn;
 	tableTestPrefix = tableTestPrefixIn;
+	changesetBboxes.reset(new class ChangesetBboxAccumulator(60));
 }
 
 PgMap::~PgMap()
 {
+	//Write any held changeset envelopes. If this fails, or the process ends without getting
+	//here, the envelopes are recovered from the changed objects when the changesets are closed.
+	//The map is not locked exclusively and lock waits are limited, so shutdown is not held up 
+	//by other writers.
+	if(changesetBboxes && changesetBboxes->CountPending() > 0 && dbconn->is_open())
+	{
+		try
+		{
+			std::shared_ptr<class PgTransaction> transaction = this->GetTransaction("ACCESS SHARE");
+			this->sharedWork->work->exec("SET LOCAL lock_timeout = '5s';");
+			class PgMapError errStr;
+			if(transaction->FlushChangesetBboxes(0, errStr))
+				transaction->Commit();
+			transaction.reset();
+		}
+		catch (const std::exception &e)
+		{
+			cerr << "Failed to write changeset bboxes: " << e.what() << endl;
+		}
+	}
+
 	if(this->sharedWork)
 		this->sharedWork->work.reset();
 	this->sharedWork.reset();
@@ -1925,17 +2695,23 @@ std::shared_ptr<class PgTransaction> PgMap::GetTransaction(const std::string &sh
 	if(this->sharedWork)
 		this->sharedWork->work.reset();
 	this->sharedWork.reset(new class PgWork(new pqxx::transaction<pqxx::repeatable_read>(*dbconn)));
-	shared_ptr<class PgTransaction> out(new class PgTransaction(dbconn, tableStaticPrefix, tableActivePrefix, this->sharedWork, shareMode));
+	shared_ptr<class PgTransaction> out(new class PgTransaction(dbconn, tableStaticPrefix, tableActivePrefix, this->sharedWork, shareMode, connectionString,
+		this->changesetBboxes, this->tableModPrefix));
 	return out;
 }
 
+void PgMap::SetChangesetBboxFlushInterval(int64_t seconds)
+{
+	this->changesetBboxes->SetFlushInterval(seconds);
+}
+
 std::shared_ptr<class PgAdmin> PgMap::GetAdmin()
 {
 	dbconn->cancel_query();
 	if(this->sharedWork)
 		this->sharedWork->work.reset();
 	this->sharedWork.reset(new class PgWork(new pqxx::nontransaction(*dbconn)));
-	shared_ptr<class PgAdmin> out(new class PgAdmin(dbconn, tableStaticPrefix, tableModPrefix, tableTestPrefix, this->sharedWork, ""));
+	shared_ptr<class PgAdmin> out(new class PgAdmin(dbconn, tableStaticPrefix, tableModPrefix, tableTestPrefix, this->sharedWork, "", connectionString));
 	return out;
 }
 
@@ -1945,7 +2721,86 @@ std::shared_ptr<class PgAdmin> PgMap::GetAdmin(const std::string &shareMode)
 	if(this->sharedWork)
 		this->sharedWork->work.reset();
 	this->sharedWork.reset(new class PgWork(new pqxx::transaction<pqxx::repeatable_read>(*dbconn)));
-	shared_ptr<class PgAdmin> out(new class PgAdmin(dbconn, tableStaticPrefix, tableModPrefix, tableTestPrefix, this->sharedWork, shareMode));
+	shared_ptr<class PgAdmin> out(new class PgAdmin(dbconn, tableStaticPrefix, tableModPrefix, tableTestPrefix, this->sharedWork, shareMode, connectionString));
 	return out;
 }
 
+int PgMap::PublishReplicateDiffs(const std::string &basePath, int64_t interval,
+	int64_t startTimestamp, int64_t untilTimestamp, bool fromEditActivity, int verbose,
+	class PgMapError &errStr)
+{
+	if(interval <= 0)
+	{
+		errStr.errStr = "Replication interval must be positive";
+		return -1;
+	}
+
+	int count = 0;
+	while(true)
+	{
+		//Progress is read from the meta table, so re-running continues where the last run stopped.
+		//If a previous run stopped after writing a diff but before recording it, the same diff is
+		//written again.
+		int64_t sequenceNumber = 0, timestamp = 0;
+		std::shared_ptr<class PgTransaction> transaction = this->GetTransaction("ACCESS SHARE");
+		try
+		{
+			sequenceNumber = atol(transaction->GetMetaValue("replicate_sequence", errStr).c_str());
+			timestamp = atol(transaction->GetMetaValue("replicate_timestamp", errStr).c_str());
+		}
+		catch(runtime_error &err)
+		{
+			if(startTimestamp <= 0)
+			{
+				errStr.errStr = "Start timestamp is needed to publish the first diff";
+				return -1;
+			}
+			sequenceNumber = 0;
+			timestamp = startTimestamp - (startTimestamp % interval);
+		}
+
+		//Keep the top level state consistent with the meta table
+		if(sequenceNumber > 0)
+			WriteReplicateState((boost::filesystem::path(basePath) / "state.txt").string(), sequenceNumber, timestamp);
+
+		int64_t timestampEnd = timestamp + interval;
+		if(timestampEnd > untilTimestamp)
+			break;
+
+		if(verbose >= 1)
+			cout << "Writing diff " << sequenceNumber+1 << " (" << timestamp << " to " << timestampEnd << ")" << endl;
+		transaction->WriteReplicateDiff(basePath, sequenceNumber+1, timestamp, timestampEnd, fromEditActivity);
+		transaction->Commit();
+		transaction.reset();
+
+		//Record progress, checking that another publisher has not done so already
+		transaction = this->GetTransaction("EXCLUSIVE");
+		int64_t checkSequenceNumber = 0;
+		try
+		{
+			checkSequenceNumber = atol(transaction->GetMetaValue("replicate_sequence", errStr).c_str());
+		}
+		catch(runtime_error &err) {}
+		if(checkSequenceNumber != sequenceNumber)
+		{
+			transaction->Abort();
+			errStr.errStr = "Replication sequence was changed by another process";
+			return -1;
+		}
+
+		bool ok = transaction->SetMetaValue("replicate_sequence", to_string(sequenceNumber+1), errStr);
+		if(ok)
+			ok = transaction->SetMetaValue("replicate_timestamp", to_string(timestampEnd), errStr);
+		if(!ok)
+		{
+			transaction->Abort();
+			return -1;
+		}
+		transaction->Commit();
+
+		WriteReplicateState((boost::filesystem::path(basePath) / "state.txt").string(), sequenceNumber+1, timestampEnd);
+		count ++;
+	}
+
+	return count;
+}
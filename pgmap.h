@@ -38,6 +38,47 @@ public:
 	double x1, y1, x2, y2;
 };
 
+//Filters for listing changesets
+class PgChangesetFilter
+{
+public:
+	PgChangesetFilter();
+	virtual ~PgChangesetFilter();
+
+	int64_t user_uid; //0 means don't filter
+	int64_t openedBeforeTimestamp; //-1 means don't filter
+	int64_t closedAfterTimestamp; //-1 means don't filter
+	bool is_open_only, is_closed_only;
+	std::vector<double> bbox; //Empty means don't filter, otherwise min lon, min lat, max lon, max lat
+};
+
+//Position in the list of changesets returned by PgTransaction::GetChangesetsPage. A zero id 
+//is the start of the list, or no more pages when returned as the next position.
+class PgChangesetCursor
+{
+public:
+	PgChangesetCursor();
+	virtual ~PgChangesetCursor();
+
+	int64_t closeKey; //Close timestamp, or the maximum value for open changesets
+	int64_t id;
+};
+
+//Estimated number of objects matched by a query, from the statistics built by 
+//PgAdmin::BuildTagStats. Tag and bbox conditions are assumed to be independent.
+class PgQueryEstimate
+{
+public:
+	PgQueryEstimate();
+	virtual ~PgQueryEstimate();
+
+	int64_t totalObjects; //Objects of the queried types
+	int64_t tagMatches; //Objects matching the tag query
+	int64_t bboxMatches; //Objects in the bbox
+	int64_t matches; //Objects matching both, not including members added by recursion
+	int64_t statsTimestamp; //When the statistics were built
+};
+
 class PgMapQuery
 {
 private:
@@ -81,14 +122,27 @@ public:
 class PgTransaction : public PgCommon
 {
 private:
+	std::string connectionString;
+	std::string tableStatsPrefix; //Where PgAdmin::BuildTagStats stores the statistics
 
+	//Changeset envelopes are held by bboxAccumulator between uploads. The changes made by this
+	//transaction are passed to it on commit.
+	std::shared_ptr<class ChangesetBboxAccumulator> bboxAccumulator;
+	std::map<int64_t, std::vector<double> > uncommittedBboxes;
+	std::set<int64_t> uncommittedTracked, closedChangesets;
+	std::map<int64_t, uint64_t> writtenBboxes;
+
+	bool WriteChangesetBboxes(int64_t cid, int64_t addedBefore, std::string &errStr);
 
 public:
 	PgTransaction(std::shared_ptr<pqxx::connection> dbconnIn,
 		const std::string &tableStaticPrefixIn, 
 		const std::string &tableActivePrefixIn,
 		std::shared_ptr<class PgWork> sharedWorkIn,
-		const std::string &shareMode);
+		const std::string &shareMode,
+		const std::string &connectionStringIn,
+		std::shared_ptr<class ChangesetBboxAccumulator> bboxAccumulatorIn = nullptr,
+		const std::string &tableStatsPrefixIn = "");
 	virtual ~PgTransaction();
 
 	std::shared_ptr<class PgMapQuery> GetQueryMgr();
@@ -102,25 +156,46 @@ public:
 	void GetObjectsHistoryById(const std::string &type, const std::set<int64_t> &objectIds, 
 		std::shared_ptr<IDataStreamHandler> out);
 
+	//If expiry is set, the old and new envelopes of the objects are added to it
 	bool StoreObjects(class OsmData &data, 
 		std::map<int64_t, int64_t> &createdNodeIds, 
 		std::map<int64_t, int64_t> &createdWaysIds,
 		std::map<int64_t, int64_t> &createdRelationsIds,
 		bool saveToStaticTables,
-		class PgMapError &errStr);
+		class PgMapError &errStr,
+		class TileExpiry *expiry = nullptr);
 	int UpdateObjectBboxesById(
 		const std::string &objType,
 		const std::set<int64_t> &objectIds, int verbose, 
 		bool saveToStaticTables,
-		class PgMapError &errStr);
+		class PgMapError &errStr,
+		class TileExpiry *expiry = nullptr);
 	bool InsertEditActivity(const class EditActivity &activity,
 		class PgMapError &errStr);
 
 	bool ResetActiveTables(class PgMapError &errStr);
 	void GetReplicateDiff(int64_t timestampStart, int64_t timestampEnd,
 		class OsmChange &out);
+	//Write changes in timestamp order without holding the whole diff in memory
+	void GetReplicateDiffStream(int64_t timestampStart, int64_t timestampEnd,
+		class IOsmChangeBlock &out);
+	//Write the object versions recorded in edit_activity, rather than scanning the map tables
+	void GetReplicateDiffFromEditActivity(int64_t timestampStart, int64_t timestampEnd,
+		class IOsmChangeBlock &out);
+	//Write a diff and its state file to an osmosis style replication directory
+	void WriteReplicateDiff(const std::string &basePath, int64_t sequenceNumber,
+		int64_t timestampStart, int64_t timestampEnd, bool fromEditActivity = false);
 	void Dump(bool order, bool nodes, bool ways, bool relations, 
 		std::shared_ptr<IDataStreamHandler> enc);
+	//Dump in id order by merging the static and active tables, rather than using the visible views
+	void DumpMerged(bool nodes, bool ways, bool relations, 
+		std::shared_ptr<IDataStreamHandler> enc);
+	//Dump all versions of objects in (id, version) order
+	void DumpHistory(bool nodes, bool ways, bool relations, 
+		std::shared_ptr<IDataStreamHandler> enc);
+	//Dump in id order using numWorkers extra connections that share this transaction's snapshot
+	void DumpParallel(int numWorkers, int64_t rangeSize, bool nodes, bool ways, bool relations, 
+		std::shared_ptr<IDataStreamHandler> enc);
 
 	int64_t GetAllocatedId(const std::string &type);
 	int64_t PeekNextAllocatedId(const std::string &type);
@@ -128,9 +203,11 @@ public:
 	int GetChangeset(int64_t objId,
 		class PgChangeset &changesetOut,
 		class PgMapError &errStr);
+	//If cachePath is set, the output for closed changesets is cached in files under that path
 	int GetChangesetOsmChange(int64_t changesetId,
 		std::shared_ptr<class IOsmChangeBlock> output,
-		class PgMapError &errStr);
+		class PgMapError &errStr,
+		const std::string &cachePath = "");
 	bool GetChangesets(std::vector<class PgChangeset> &changesetsOut,
 		int64_t user_uid, //0 means don't filter
 		int64_t openedBeforeTimestamp, //-1 means don't filter
@@ -138,13 +215,28 @@ public:
 		bool is_open_only,
 		bool is_closed_only,
 		class PgMapError &errStr);
+	//Lists changesets, most recently closed first (open changesets before all closed ones). Pass
+	//a default cursor for the first page. For the following pages, pass the next cursor of the 
+	//previous page, which has a zero id after the last page.
+	bool GetChangesetsPage(const class PgChangesetFilter &filter, size_t pageSize,
+		const class PgChangesetCursor &after,
+		std::vector<class PgChangeset> &changesetsOut,
+		class PgChangesetCursor &next,
+		class PgMapError &errStr);
 	int64_t CreateChangeset(const class PgChangeset &changeset,
 		class PgMapError &errStr);
 	bool UpdateChangeset(const class PgChangeset &changeset,
 		class PgMapError &errStr);
+	//The first expansion of a changeset in this process updates the row directly. Later ones
+	//are held in memory until the changeset is closed or they have waited the flush interval.
+	//Closing a changeset also expands its bbox to cover its live objects, in case held envelopes
+	//were lost.
 	bool ExpandChangesetBbox(int64_t cid,
 		const std::vector<double> &bbox,
 		class PgMapError &errStr);
+	//Writes held changeset envelopes that have waited at least maxAge seconds. Call periodically
+	//so changesets that are never closed through this process get their bbox.
+	bool FlushChangesetBboxes(int64_t maxAge, class PgMapError &errStr);
 	bool CloseChangeset(int64_t changesetId,
 		int64_t closedTimestamp,
 		class PgMapError &errStr);
@@ -168,11 +260,32 @@ public:
 	bool UpdateUsername(int uid, const std::string &username,
 		class PgMapError &errStr);
 
+	//recurse is "down" to add the members needed to complete the matched objects, "up" to add 
+	//the ways and relations that contain them or "none". See DbXapiQueryVisible.
 	void XapiQuery(const std::string &objType,
 		const std::string &tagKey,
 		const std::string &tagValue,
 		const std::vector<double> &bbox, 
-		std::shared_ptr<IDataStreamHandler> enc);
+		std::shared_ptr<IDataStreamHandler> enc,
+		const std::string &recurse = "down");
+	//Returns objects matching a tag query such as "[amenity=hospital|clinic][name~^St]".
+	//See tagquery.h for the syntax. Returns false if the query can't be parsed or has a regular
+	//expression Postgres does not accept.
+	bool XapiQueryExpr(const std::string &objType,
+		const std::string &tagQuery,
+		const std::vector<double> &bbox, 
+		std::shared_ptr<IDataStreamHandler> enc,
+		class PgMapError &errStr,
+		const std::string &recurse = "down");
+	//Estimates the objects matched by XapiQueryExpr without running it. Use objType "*", no tag 
+	//query and the map bbox to estimate a map query. Uses the statistics built by 
+	//PgAdmin::BuildTagStats for the mod tables, even when the test tables are active. Returns 
+	//false if the statistics have not been built or the query can't be parsed.
+	bool EstimateXapiQuery(const std::string &objType,
+		const std::string &tagQuery,
+		const std::vector<double> &bbox, 
+		class PgQueryEstimate &estimateOut,
+		class PgMapError &errStr);
 	void GetMostActiveUsers(int64_t startTimestamp,
 		std::vector<int64_t> &uidOut,
 		std::vector<std::vector<int64_t> > &objectCountOut);
@@ -186,6 +299,7 @@ class PgAdmin : public PgCommon
 private:
 	std::string tableModPrefix;
 	std::string tableTestPrefix;
+	std::string connectionString;
 
 public:
 	PgAdmin(std::shared_ptr<pqxx::connection> dbconnIn,
@@ -193,24 +307,69 @@ public:
 		const std::string &tableModPrefixIn,
 		const std::string &tableTestPrefixIn,
 		std::shared_ptr<class PgWork> sharedWorkIn,
-		const std::string &shareModeIn);
+		const std::string &shareModeIn,
+		const std::string &connectionStringIn);
 	virtual ~PgAdmin();
 
 	virtual bool IsAdminMode();
 
 	bool CreateMapTables(int verbose, int targetVer, bool latest, class PgMapError &errStr);
 	bool DropMapTables(int verbose, class PgMapError &errStr);
-	bool CopyMapData(int verbose, const std::string &filePrefix, class PgMapError &errStr);
+	//Set binaryFormat to load the .pgcopy.gz files written by osm2csv rather than csv files
+	bool CopyMapData(int verbose, const std::string &filePrefix, class PgMapError &errStr, bool binaryFormat = false);
+	//Loads an OSM file directly into the static tables, using one connection per table
+	bool StreamMapData(int verbose, const std::string &inputFilename, class PgMapError &errStr);
 	bool CreateMapIndices(int verbose, class PgMapError &errStr);
-	bool ApplyDiffs(const std::string &diffPath, int verbose, class PgMapError &errStr);
+	//Copies csv files (skipped if filePrefix is empty) then builds indices, spread over numConnections
+	bool ParallelCopyAndIndex(int verbose, const std::string &filePrefix, bool binaryFormat, 
+		int numConnections, const std::string &maintenanceWorkMem, 
+		class PgMapError &errStr);
+	//If maxObjects is more than zero, diffs are decoded incrementally and applied in blocks of that size.
+	//If expiry is set, the tiles covered by the old and new envelopes of changed objects are added to it.
+	bool ApplyDiffs(const std::string &diffPath, int verbose, class PgMapError &errStr, size_t maxObjects = 0,
+		class TileExpiry *expiry = nullptr);
+	//Applies diffs in blocks of maxObjects objects, while up to prefetchBlocks later blocks are
+	//decoded on background threads
+	bool ApplyDiffsPipelined(const std::string &diffPath, int verbose, size_t maxObjects, size_t prefetchBlocks, 
+		int numThreads, class PgMapError &errStr, class TileExpiry *expiry = nullptr);
+	//Catch up on a range of diffs by storing only the latest version of each changed object, over
+	//numConnections connections, then updating bboxes once. Use an admin object from GetAdmin()
+	//without a lock, since the other connections need to write to the map tables.
+	//If the bbox update fails after the objects are stored, it is recorded in the meta table and 
+	//running again with the same diffPath only repeats the bbox update.
+	bool ApplyDiffsBulk(const std::string &diffPath, int verbose, int numConnections, 
+		class PgMapError &errStr, class TileExpiry *expiry = nullptr);
+	//Applies the files listed under diffPath in order, raises the next ids above the applied objects 
+	//and records the last file as the checkpoint, all in this transaction. If prefetchBlocks is more 
+	//than zero, later blocks are decoded on numThreads background threads, as in ApplyDiffsPipelined.
+	bool ApplyDiffFiles(const std::string &diffPath, const std::vector<std::string> &filenames, 
+		size_t maxObjects, size_t prefetchBlocks, int numThreads, int verbose, 
+		class PgMapError &errStr, class TileExpiry *expiry = nullptr);
+	//Path relative to the diff directory of the last diff recorded by ApplyDiffFiles, or an empty string
+	std::string GetDiffCheckpoint();
+	//Index in filenames of the first diff after the checkpoint, or zero if there is no checkpoint.
+	//Returns -1 if the checkpoint is not in the list, since the diffs can't then be safely resumed.
+	int64_t FindDiffResumeIndex(const std::string &diffPath, const std::vector<std::string> &filenames, 
+		class PgMapError &errStr);
+	//Lists the diff files under diffPath, in the order they are applied
+	void ListDiffFiles(const std::string &diffPath, std::vector<std::string> &out);
 	bool RefreshMapIds(int verbose, class PgMapError &errStr);
 	bool ImportChangesetMetadata(const std::string &fina, int verbose, class PgMapError &errStr);
+	//Bulk loads a changesets dump into the static changesets table over a separate connection.
+	//Faster than ImportChangesetMetadata, but the changesets must not already be in the table.
+	bool StreamChangesetMetadata(const std::string &fina, int verbose, class PgMapError &errStr);
 	bool RefreshMaxChangesetUid(int verbose, class PgMapError &errStr);
 	bool GenerateUsernameTable(int verbose, class PgMapError &errStr);
 
 	bool UpdateBboxes(int verbose, class PgMapError &errStr);
 	bool CreateBboxIndices(int verbose, class PgMapError &errStr);
 	bool DropBboxIndices(int verbose, class PgMapError &errStr);
+	//GIN indices on the tags of live objects, so tag=value queries don't scan whole tables
+	bool CreateTagIndices(int verbose, class PgMapError &errStr);
+	bool DropTagIndices(int verbose, class PgMapError &errStr);
+	//Counts tag keys, common key=value pairs (at least minValueCount objects) and objects per 
+	//gridSize degree cell, for query estimates. Built for the visible objects of the mod tables.
+	bool BuildTagStats(int verbose, int64_t minValueCount, double gridSize, class PgMapError &errStr);
 
 	bool CheckNodesExistForWays(class PgMapError &errStr);
 	bool CheckObjectIdTables(class PgMapError &errStr);
@@ -229,6 +388,7 @@ private:
 	std::string tableTestPrefix;
 	std::string connectionString;
 	std::shared_ptr<class PgWork> sharedWork;
+	std::shared_ptr<class ChangesetBboxAccumulator> changesetBboxes;
 
 public:
 	PgMap(const std::string &connection, const std::string &tableStaticPrefixIn, 
@@ -244,6 +404,17 @@ public:
 	std::shared_ptr<class PgTransaction> GetTransaction(const std::string &shareMode);
 	std::shared_ptr<class PgAdmin> GetAdmin();
 	std::shared_ptr<class PgAdmin> GetAdmin(const std::string &shareMode);
+
+	//Seconds that changeset envelopes are held in memory before being written, default 60.
+	//Zero updates the changesets row on every upload.
+	void SetChangesetBboxFlushInterval(int64_t seconds);
+
+	//Writes a diff for each interval that ends at or before untilTimestamp, continuing from the
+	//sequence number recorded in the meta table. startTimestamp is only used for the first diff.
+	//Returns the number of diffs written, or -1 on error.
+	int PublishReplicateDiffs(const std::string &basePath, int64_t interval,
+		int64_t startTimestamp, int64_t untilTimestamp, bool fromEditActivity, int verbose,
+		class PgMapError &errStr);
 };
 
 #endif //_PGMAP_H
@@ -17,6 +17,7 @@ using std::string;
 %{
 /* Put header files here */
 #include "pgmap.h"
+#include "tileexpiry.h"
 #include "cppo5m/OsmData.h"
 #include "cppo5m/utils.h"
 %}
@@ -102,6 +103,10 @@ namespace std {
 	%template(vectorsharedptreditactivity) vector<shared_ptr<class EditActivity> >;
 };
 
+%ignore TileExpiry::callback;
+%ignore TileExpiry::GetTiles;
+%include "tileexpiry.h"
+
 %shared_ptr(EditActivity)
 %shared_ptr(PgWork)
 %shared_ptr(PgCommon)
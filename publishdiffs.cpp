@@ -0,0 +1,88 @@
+#include <iostream>
+#include <ctime>
+#include <thread>
+#include <chrono>
+#include "util.h"
+#include "pgmap.h"
+#include <boost/program_options.hpp>
+namespace po = boost::program_options;
+
+int main(int argc, char **argv)
+{
+	// Declare the supported options.
+	po::options_description desc("Allowed options");
+	desc.add_options()
+		("help", "produce help message")
+		("out", po::value<string>(), "replication directory (default is replicate_path in config.cfg)")
+		("start", po::value<int64_t>(), "unix timestamp of the start of the first diff, only used if none have been published")
+		("loop", "keep running and publish each diff once its interval has passed")
+		("verbose", po::value<int>(), "verbosity level (default is 1)")
+	;
+
+	po::variables_map vm;
+	po::store(po::parse_command_line(argc, argv, desc), vm);
+	po::notify(vm);
+
+	if (vm.count("help")) {
+		cout << desc << "\n";
+		return 1;
+	}
+
+	cout << "Reading settings from config.cfg" << endl;
+	std::map<string, string> config;
+	ReadSettingsFile("config.cfg", config);
+
+	string outPath = config["replicate_path"];
+	if (vm.count("out"))
+		outPath = vm["out"].as<string>();
+	if(outPath.size() == 0)
+	{
+		cerr << "Output path must be specified" << endl;
+		cout << desc << "\n";
+		return -1;
+	}
+
+	int64_t interval = 60;
+	if(config.find("replicate_interval") != config.end())
+		interval = atol(config["replicate_interval"].c_str());
+	//Objects are timestamped before their transaction commits, so wait before publishing an interval
+	int64_t lag = 60;
+	if(config.find("replicate_lag") != config.end())
+		lag = atol(config["replicate_lag"].c_str());
+	//Find changed objects using the edit_activity table, rather than timestamp scans of the map tables
+	bool fromEditActivity = config["replicate_source"] == "edit_activity";
+	int64_t startTimestamp = 0;
+	if (vm.count("start"))
+		startTimestamp = vm["start"].as<int64_t>();
+	int verbose = 1;
+	if (vm.count("verbose"))
+		verbose = vm["verbose"].as<int>();
+
+	string cstr = GeneratePgConnectionString(config);
+	class PgMap pgMap(cstr, config["dbtableprefix"], config["dbtablemodifyprefix"], config["dbtablemodifyprefix"], config["dbtabletestprefix"]);
+	if (!pgMap.Ready()) {
+		cout << "Can't open database" << endl;
+		return 1;
+	}
+
+	while(true)
+	{
+		class PgMapError errStr;
+		int64_t untilTimestamp = (int64_t)time(nullptr) - lag;
+		int count = pgMap.PublishReplicateDiffs(outPath, interval, startTimestamp, untilTimestamp, fromEditActivity, verbose, errStr);
+		if(count < 0)
+		{
+			cerr << errStr.errStr << endl;
+			return -2;
+		}
+		if(verbose >= 1 && count > 0)
+			cout << "Published " << count << " diffs" << endl;
+
+		if(!vm.count("loop"))
+			break;
+		std::this_thread::sleep_for(std::chrono::seconds(interval < 10 ? interval : 10));
+	}
+
+	cout << "All done!" << endl;
+	return 0;
+}
@@ -42,14 +42,14 @@ pgmap_module = Extension('_pgmap',
 				define_macros = [('PYTHON_AWARE', '1')],
 				sources=['pgmap.i', 'util.cpp', 'dbquery.cpp', 'dbids.cpp', 'dbadmin.cpp', 'dbcommon.cpp', 'dbreplicate.cpp', 'dbdecode.cpp', 
 					'dbstore.cpp', 'dbdump.cpp', 'dbfilters.cpp', 'dbchangeset.cpp', 'dbjson.cpp', 'dbmeta.cpp', 'dbusername.cpp', 
-					'dboverpass.cpp', 'dbeditactivity.cpp', 'pgcommon.cpp', 'pgmap.cpp', 'cppo5m/o5m.cpp', 
+					'dboverpass.cpp', 'dbeditactivity.cpp', 'dbcopystream.cpp', 'copyrow.cpp', 'dbparallel.cpp', 'osmchangestream.cpp', 'tileexpiry.cpp', 'changesetbbox.cpp', 'tagquery.cpp', 'dbtagstats.cpp', 'pgcommon.cpp', 'pgmap.cpp', 'cppo5m/o5m.cpp', 
 					'cppo5m/varint.cpp', 'cppo5m/OsmData.cpp', 'cppo5m/osmxml.cpp', 'cppo5m/iso8601lib/iso8601.c',
 					'cppo5m/utils.cpp', 'cppo5m/pbf.cpp', 'cppo5m/pbf/fileformat.pb.cc', 'cppo5m/pbf/osmformat.pb.cc',
 					'cppGzip/EncodeGzip.cpp', 'cppGzip/DecodeGzip.cpp'],
 				swig_opts=['-c++', '-DPYTHON_AWARE', '-DSWIGWORDSIZE64'],
 				libraries = ['pqxx', 'expat', 'z', 'boost_filesystem', 'boost_system', 'protobuf', 'boost_iostreams'],
 				language = "c++",
-				extra_compile_args = ["-std=c++11"],
+				extra_compile_args = ["-std=c++11", "-pthread"],
 			)
 
 setup (name = 'pgmap',
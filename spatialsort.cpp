@@ -0,0 +1,257 @@
+#include "spatialsort.h"
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <cstdio>
+using namespace std;
+
+// Based on xy2d from https://en.wikipedia.org/wiki/Hilbert_curve
+uint64_t HilbertKey(double lon, double lat)
+{
+	double fx = (lon + 180.0) / 360.0;
+	double fy = (lat + 90.0) / 180.0;
+	if(fx < 0.0) fx = 0.0;
+	if(fx > 1.0) fx = 1.0;
+	if(fy < 0.0) fy = 0.0;
+	if(fy > 1.0) fy = 1.0;
+	uint32_t x = (uint32_t)(fx * 4294967295.0);
+	uint32_t y = (uint32_t)(fy * 4294967295.0);
+
+	uint64_t d = 0;
+	for(uint64_t s = (uint64_t)1 << 31; s > 0; s >>= 1)
+	{
+		uint32_t rx = (x & s) > 0;
+		uint32_t ry = (y & s) > 0;
+		d += s * s * ((3 * rx) ^ ry);
+
+		//Rotate quadrant
+		if(ry == 0)
+		{
+			if(rx == 1)
+			{
+				x = ~x;
+				y = ~y;
+			}
+			std::swap(x, y);
+		}
+	}
+	return d;
+}
+
+std::string EncodeSortKey(uint64_t key)
+{
+	return string((const char *)&key, sizeof(key));
+}
+
+uint64_t DecodeSortKey(const std::string &payload, size_t offset)
+{
+	if(payload.size() < offset + sizeof(uint64_t))
+		throw runtime_error("Payload too short to contain key");
+	uint64_t key = 0;
+	payload.copy((char *)&key, sizeof(key), offset);
+	return key;
+}
+
+// **********************************************
+
+static bool CompareRecordKeys(const std::pair<uint64_t, std::string> &a, const std::pair<uint64_t, std::string> &b)
+{
+	return a.first < b.first;
+}
+
+bool ExternalSort::RunHead::operator>(const RunHead &other) const
+{
+	if(key != other.key)
+		return key > other.key;
+	return run > other.run; //Earlier runs first, to keep the sort stable
+}
+
+ExternalSort::ExternalSort(const std::string &tempPrefix, size_t maxMemBytes, size_t maxFanIn):
+	tempPrefix(tempPrefix),
+	maxMemBytes(maxMemBytes),
+	bufferBytes(0),
+	maxFanIn(maxFanIn),
+	runsCreated(0),
+	count(0),
+	bufferPos(0),
+	reading(false)
+{
+	if(this->maxFanIn < 2)
+		this->maxFanIn = 2;
+}
+
+ExternalSort::~ExternalSort()
+{
+	runFiles.clear();
+	for(size_t i=0; i<runFilenames.size(); i++)
+		remove(runFilenames[i].c_str());
+}
+
+void ExternalSort::Add(uint64_t key, const std::string &payload)
+{
+	if(reading)
+		throw runtime_error("Cannot add records after reading has started");
+	buffer.push_back(std::pair<uint64_t, std::string>(key, payload));
+	bufferBytes += payload.size() + sizeof(std::pair<uint64_t, std::string>);
+	count ++;
+	if(bufferBytes >= maxMemBytes)
+		SpillRun();
+}
+
+std::string ExternalSort::NewRunFilename(std::ofstream &out)
+{
+	stringstream fina;
+	fina << tempPrefix << "sortrun" << (void *)this << "-" << runsCreated << ".tmp";
+	runsCreated ++;
+	out.open(fina.str(), std::ios::out | std::ios::binary);
+	if(!out.is_open())
+		throw runtime_error("Error opening sort run file "+fina.str());
+	return fina.str();
+}
+
+void ExternalSort::WriteRecord(std::ofstream &out, uint64_t key, const std::string &payload)
+{
+	uint32_t len = payload.size();
+	out.write((const char *)&key, sizeof(key));
+	out.write((const char *)&len, sizeof(len));
+	out.write(payload.c_str(), len);
+}
+
+void ExternalSort::SpillRun()
+{
+	std::stable_sort(buffer.begin(), buffer.end(), CompareRecordKeys);
+
+	std::ofstream out;
+	string fina = NewRunFilename(out);
+	runFilenames.push_back(fina);
+
+	for(size_t i=0; i<buffer.size(); i++)
+		WriteRecord(out, buffer[i].first, buffer[i].second);
+	out.close();
+	if(out.fail())
+		throw runtime_error("Error writing sort run file "+fina);
+
+	buffer.clear();
+	buffer.shrink_to_fit();
+	bufferBytes = 0;
+}
+
+bool ExternalSort::ReadRecord(size_t run, RunHead &out)
+{
+	std::ifstream &in = *runFiles[run];
+	uint32_t len = 0;
+	in.read((char *)&out.key, sizeof(out.key));
+	if(in.gcount() != sizeof(out.key))
+		return false;
+	in.read((char *)&len, sizeof(len));
+	out.payload.resize(len);
+	if(len > 0)
+		in.read(&out.payload[0], len);
+	if(!in)
+		throw runtime_error("Error reading sort run file");
+	out.run = run;
+	return true;
+}
+
+//Opens runs [first, last) for merging
+void ExternalSort::OpenRuns(size_t first, size_t last)
+{
+	runFiles.clear();
+	heap = std::priority_queue<RunHead, std::vector<RunHead>, std::greater<RunHead> >();
+	for(size_t i=first; i<last; i++)
+	{
+		std::shared_ptr<std::ifstream> in(new std::ifstream(runFilenames[i], std::ios::in | std::ios::binary));
+		if(!in->is_open())
+			throw runtime_error("Error opening sort run file "+runFilenames[i]);
+		runFiles.push_back(in);
+
+		RunHead head;
+		if(ReadRecord(runFiles.size()-1, head))
+			heap.push(head);
+	}
+}
+
+bool ExternalSort::NextMerged(uint64_t &key, std::string &payload)
+{
+	if(heap.empty())
+		return false;
+	RunHead head = heap.top();
+	heap.pop();
+	key = head.key;
+	payload.swap(head.payload);
+
+	RunHead nextHead;
+	if(ReadRecord(head.run, nextHead))
+		heap.push(nextHead);
+	return true;
+}
+
+//Merges each group of maxFanIn consecutive runs into one run. Groups keep their order,
+//so records with equal keys stay in the order they were added.
+void ExternalSort::MergePass()
+{
+	size_t numRuns = runFilenames.size();
+	for(size_t first=0; first<numRuns; first+=maxFanIn)
+	{
+		size_t last = std::min(first + maxFanIn, numRuns);
+		if(last - first == 1)
+		{
+			runFilenames.push_back(runFilenames[first]);
+			continue;
+		}
+
+		std::ofstream out;
+		string fina = NewRunFilename(out);
+		runFilenames.push_back(fina); //So it is removed if the merge fails
+
+		OpenRuns(first, last);
+		uint64_t key = 0;
+		string payload;
+		while(NextMerged(key, payload))
+			WriteRecord(out, key, payload);
+		out.close();
+		if(out.fail())
+			throw runtime_error("Error writing sort run file "+fina);
+		runFiles.clear();
+
+		for(size_t i=first; i<last; i++)
+			remove(runFilenames[i].c_str());
+	}
+	runFilenames.erase(runFilenames.begin(), runFilenames.begin() + numRuns);
+}
+
+void ExternalSort::StartRead()
+{
+	reading = true;
+	if(runFilenames.size() == 0)
+	{
+		//Everything fits in memory
+		std::stable_sort(buffer.begin(), buffer.end(), CompareRecordKeys);
+		bufferPos = 0;
+		return;
+	}
+
+	if(buffer.size() > 0)
+		SpillRun();
+
+	//Each open run needs a file handle, so limit how many are merged at once
+	while(runFilenames.size() > maxFanIn)
+		MergePass();
+
+	OpenRuns(0, runFilenames.size());
+}
+
+bool ExternalSort::Next(uint64_t &key, std::string &payload)
+{
+	if(runFiles.size() == 0)
+	{
+		if(bufferPos >= buffer.size())
+			return false;
+		key = buffer[bufferPos].first;
+		payload.swap(buffer[bufferPos].second);
+		bufferPos ++;
+		return true;
+	}
+
+	return NextMerged(key, payload);
+}
@@ -0,0 +1,66 @@
+#ifndef _SPATIAL_SORT_H
+#define _SPATIAL_SORT_H
+
+#include <string>
+#include <vector>
+#include <queue>
+#include <memory>
+#include <fstream>
+#include <cstdint>
+#include <functional>
+
+//Position of a point along a Hilbert curve covering the globe, at 32 bits per axis
+uint64_t HilbertKey(double lon, double lat);
+
+//Sorts (key, payload) records by key using bounded memory. Records are buffered until
+//maxMemBytes is reached, then sorted and spilled to a temporary run file. Reading merges
+//the runs, at most maxFanIn at a time, so if there are more runs than that they are first
+//merged into longer runs. Records with equal keys are returned in the order they were added.
+class ExternalSort
+{
+private:
+	std::string tempPrefix;
+	size_t maxMemBytes, bufferBytes, maxFanIn;
+	std::vector<std::pair<uint64_t, std::string> > buffer;
+	std::vector<std::string> runFilenames;
+	size_t runsCreated;
+	int64_t count;
+
+	//Merge state
+	class RunHead
+	{
+	public:
+		uint64_t key;
+		std::string payload;
+		size_t run;
+		bool operator>(const RunHead &other) const;
+	};
+	std::vector<std::shared_ptr<std::ifstream> > runFiles;
+	std::priority_queue<RunHead, std::vector<RunHead>, std::greater<RunHead> > heap;
+	size_t bufferPos;
+	bool reading;
+
+	std::string NewRunFilename(std::ofstream &out);
+	void WriteRecord(std::ofstream &out, uint64_t key, const std::string &payload);
+	void SpillRun();
+	bool ReadRecord(size_t run, RunHead &out);
+	void OpenRuns(size_t first, size_t last);
+	bool NextMerged(uint64_t &key, std::string &payload);
+	void MergePass();
+
+public:
+	ExternalSort(const std::string &tempPrefix, size_t maxMemBytes, size_t maxFanIn = 64);
+	virtual ~ExternalSort();
+
+	void Add(uint64_t key, const std::string &payload);
+	//Call after the last Add, then Next until it returns false
+	void StartRead();
+	bool Next(uint64_t &key, std::string &payload);
+	int64_t Count() {return count;};
+};
+
+//Encoding for keys stored in a payload
+std::string EncodeSortKey(uint64_t key);
+uint64_t DecodeSortKey(const std::string &payload, size_t offset = 0);
+
+#endif //_SPATIAL_SORT_H
@@ -0,0 +1,238 @@
+#include "tagquery.h"
+#include <sstream>
+#include <cctype>
+using namespace std;
+
+TagQuery::TagQuery():
+	type(ALL_OF)
+{
+
+}
+
+TagQuery::~TagQuery()
+{
+
+}
+
+bool TagQuery::MatchesAll() const
+{
+	return type == ALL_OF && children.size() == 0;
+}
+
+// **********************************************
+
+class TagQueryParser
+{
+public:
+	const std::string &str;
+	size_t pos;
+	std::string errStr;
+
+	TagQueryParser(const std::string &str): str(str), pos(0) {};
+
+	void SkipSpace()
+	{
+		while(pos < str.size() && isspace((unsigned char)str[pos]))
+			pos++;
+	}
+
+	bool Fail(const std::string &msg)
+	{
+		stringstream ss;
+		ss << msg << " at position " << pos;
+		errStr = ss.str();
+		return false;
+	}
+
+	//Reads a key or value, stopping at an unescaped =, ~, | or ]
+	bool ReadString(std::string &out)
+	{
+		out.clear();
+		while(pos < str.size())
+		{
+			char ch = str[pos];
+			if(ch == '=' || ch == '~' || ch == '|' || ch == ']')
+				return true;
+			if(ch == '\\')
+			{
+				pos++;
+				if(pos >= str.size())
+					return Fail("Unfinished escape");
+				ch = str[pos];
+			}
+			out += ch;
+			pos++;
+		}
+		return Fail("Missing ]");
+	}
+
+	bool ReadRegex(std::string &out)
+	{
+		out.clear();
+		while(pos < str.size())
+		{
+			char ch = str[pos];
+			if(ch == ']')
+				return true;
+			if(ch == '\\' && pos+1 < str.size() && str[pos+1] == ']')
+			{
+				out += ']';
+				pos += 2;
+				continue;
+			}
+			out += ch;
+			pos++;
+		}
+		return Fail("Missing ]");
+	}
+
+	bool ParsePredicate(class TagQuery &out)
+	{
+		pos++; //Skip [
+		out = TagQuery();
+		bool ok = ReadString(out.key);
+		if(!ok) return false;
+		if(out.key.size() == 0)
+			return Fail("Empty key");
+
+		char op = str[pos];
+		if(op == ']')
+			out.type = TagQuery::HAS_KEY;
+		else if(op == '~')
+		{
+			pos++;
+			out.type = TagQuery::REGEX;
+			out.values.resize(1);
+			ok = ReadRegex(out.values[0]);
+			if(!ok) return false;
+		}
+		else if(op == '=')
+		{
+			out.type = TagQuery::VALUE_IN;
+			while(str[pos] != ']')
+			{
+				pos++; //Skip = or |
+				std::string val;
+				ok = ReadString(val);
+				if(!ok) return false;
+				if(str[pos] != ']' && str[pos] != '|')
+					return Fail("Unexpected character");
+				out.values.push_back(val);
+			}
+			if(out.values.size() == 1 && out.values[0] == "*")
+			{
+				out.type = TagQuery::HAS_KEY;
+				out.values.clear();
+			}
+		}
+		else
+			return Fail("Unexpected character");
+
+		pos++; //Skip ]
+		return true;
+	}
+
+	bool ParseFactor(class TagQuery &out)
+	{
+		SkipSpace();
+		if(pos >= str.size())
+			return Fail("Expected [ or (");
+		if(str[pos] == '[')
+			return ParsePredicate(out);
+		if(str[pos] != '(')
+			return Fail("Expected [ or (");
+		pos++;
+		bool ok = ParseExpr(out);
+		if(!ok) return false;
+		SkipSpace();
+		if(pos >= str.size() || str[pos] != ')')
+			return Fail("Missing )");
+		pos++;
+		return true;
+	}
+
+	bool ParseAnd(class TagQuery &out)
+	{
+		out = TagQuery();
+		while(true)
+		{
+			class TagQuery child;
+			bool ok = ParseFactor(child);
+			if(!ok) return false;
+			out.children.push_back(child);
+
+			SkipSpace();
+			if(pos < str.size() && str[pos] == '&')
+			{
+				pos++;
+				continue;
+			}
+			if(pos >= str.size() || (str[pos] != '[' && str[pos] != '('))
+				break;
+		}
+		if(out.children.size() == 1)
+		{
+			class TagQuery child = out.children[0];
+			out = child;
+		}
+		return true;
+	}
+
+	bool ParseExpr(class TagQuery &out)
+	{
+		out = TagQuery();
+		out.type = TagQuery::ANY_OF;
+		while(true)
+		{
+			class TagQuery child;
+			bool ok = ParseAnd(child);
+			if(!ok) return false;
+			out.children.push_back(child);
+
+			SkipSpace();
+			if(pos >= str.size() || str[pos] != '|')
+				break;
+			pos++;
+		}
+		if(out.children.size() == 1)
+		{
+			class TagQuery child = out.children[0];
+			out = child;
+		}
+		return true;
+	}
+};
+
+bool ParseTagQuery(const std::string &queryStr, class TagQuery &out, std::string &errStr)
+{
+	out = TagQuery();
+	class TagQueryParser parser(queryStr);
+	parser.SkipSpace();
+	if(parser.pos >= queryStr.size())
+		return true;
+
+	bool ok = parser.ParseExpr(out);
+	if(ok)
+	{
+		parser.SkipSpace();
+		if(parser.pos < queryStr.size())
+			ok = parser.Fail("Unexpected character");
+	}
+	errStr = parser.errStr;
+	return ok;
+}
+
+void TagQueryFromKeyValue(const std::string &key, const std::string &value, class TagQuery &out)
+{
+	out = TagQuery();
+	if(key.size() == 0)
+		return;
+	out.key = key;
+	if(value.size() > 0)
+	{
+		out.type = TagQuery::VALUE_IN;
+		out.values.push_back(value);
+	}
+	else
+		out.type = TagQuery::HAS_KEY;
+}
@@ -0,0 +1,46 @@
+#ifndef _TAG_QUERY_H
+#define _TAG_QUERY_H
+
+#include <string>
+#include <vector>
+
+//A condition on the tags of an object, parsed from an XAPI style expression. Each predicate
+//is in square brackets:
+//  [key]  or  [key=*]      has the key
+//  [key=value]             has the key with this value
+//  [key=value1|value2]     has the key with any of these values
+//  [key~regex]             has the key with a value that matches the regular expression
+//Predicates next to each other (or joined by &) must all match. Groups joined by | are
+//alternatives. Parentheses group. A backslash escapes the next character in keys and values,
+//and \] is a ] in a regular expression.
+class TagQuery
+{
+public:
+	enum Type
+	{
+		ALL_OF, //Every child matches
+		ANY_OF, //At least one child matches
+		HAS_KEY,
+		VALUE_IN, //The value of key is one of values
+		REGEX //The value of key matches values[0]
+	};
+
+	TagQuery();
+	virtual ~TagQuery();
+
+	Type type;
+	std::string key;
+	std::vector<std::string> values; //For a regex, the single pattern
+	std::vector<class TagQuery> children;
+
+	//An and with no children matches every object
+	bool MatchesAll() const;
+};
+
+bool ParseTagQuery(const std::string &queryStr, class TagQuery &out, std::string &errStr);
+
+//The condition used by the older XapiQuery, where an empty key matches every object and
+//an empty value matches any value
+void TagQueryFromKeyValue(const std::string &key, const std::string &value, class TagQuery &out);
+
+#endif //_TAG_QUERY_H
@@ -0,0 +1,126 @@
+#include "tileexpiry.h"
+#include "util.h"
+#include <fstream>
+#include <cmath>
+#include <cstdlib>
+#include <algorithm>
+using namespace std;
+
+//Latitude limit of the web mercator projection
+static const double maxMercatorLat = 85.0511287798;
+
+static int ClampTile(double t, int zoom)
+{
+	int maxTile = (1 << zoom) - 1;
+	int v = (int)floor(t);
+	if(v < 0) return 0;
+	if(v > maxTile) return maxTile;
+	return v;
+}
+
+static double ClampLat(double lat)
+{
+	if(lat > maxMercatorLat) return maxMercatorLat;
+	if(lat < -maxMercatorLat) return -maxMercatorLat;
+	return lat;
+}
+
+TileExpiry::TileExpiry(const std::vector<int> &zooms, int64_t maxTilesPerBbox):
+	zooms(zooms), maxTilesPerBbox(maxTilesPerBbox)
+{
+
+}
+
+TileExpiry::~TileExpiry()
+{
+
+}
+
+void TileExpiry::ExpireBbox(const std::vector<double> &bbox)
+{
+	if(bbox.size() != 4)
+		return;
+	double lat1 = ClampLat(bbox[1]), lat2 = ClampLat(bbox[3]);
+
+	for(size_t i=0; i<zooms.size(); i++)
+	{
+		int zoom = zooms[i];
+		int x1 = ClampTile(long2tilex(bbox[0], zoom), zoom);
+		int x2 = ClampTile(long2tilex(bbox[2], zoom), zoom);
+		//Tile y increases to the south
+		int y1 = ClampTile(lat2tiley(lat2, zoom), zoom);
+		int y2 = ClampTile(lat2tiley(lat1, zoom), zoom);
+		if(x2 < x1) swap(x1, x2);
+		if(y2 < y1) swap(y1, y2);
+		if(maxTilesPerBbox > 0 && (int64_t)(x2-x1+1) * (int64_t)(y2-y1+1) > maxTilesPerBbox)
+			continue;
+
+		for(int x=x1; x<=x2; x++)
+		{
+			for(int y=y1; y<=y2; y++)
+			{
+				bool added = tiles.insert(make_tuple(zoom, x, y)).second;
+				if(added && callback)
+					callback(zoom, x, y);
+			}
+		}
+	}
+}
+
+void TileExpiry::ExpirePoint(double lon, double lat)
+{
+	std::vector<double> bbox = {lon, lat, lon, lat};
+	ExpireBbox(bbox);
+}
+
+void TileExpiry::Clear()
+{
+	tiles.clear();
+}
+
+bool TileExpiry::WriteFile(const std::string &fina, bool append, std::string &errStr)
+{
+	std::ofstream out(fina, append ? std::ios::app : std::ios::trunc);
+	if(!out)
+	{
+		errStr = "Failed to open "+fina;
+		return false;
+	}
+	for(auto it=tiles.begin(); it!=tiles.end(); it++)
+		out << get<0>(*it) << "/" << get<1>(*it) << "/" << get<2>(*it) << "\n";
+	out.close();
+	if(!out)
+	{
+		errStr = "Failed to write "+fina;
+		return false;
+	}
+	return true;
+}
+
+bool ParseZoomList(const std::string &zoomsStr, std::vector<int> &out, std::string &errStr)
+{
+	vector<string> parts = split(zoomsStr, ',');
+	for(size_t i=0; i<parts.size(); i++)
+	{
+		if(parts[i].size() == 0)
+			continue;
+		vector<string> range = split(parts[i], '-');
+		if(range.size() < 1 || range.size() > 2)
+		{
+			errStr = "Invalid zoom range: "+parts[i];
+			return false;
+		}
+		int z1 = atoi(range[0].c_str());
+		int z2 = range.size() == 2 ? atoi(range[1].c_str()) : z1;
+		if(z1 < 0 || z2 > 30 || z2 < z1)
+		{
+			errStr = "Invalid zoom range: "+parts[i];
+			return false;
+		}
+		for(int z=z1; z<=z2; z++)
+			if(find(out.begin(), out.end(), z) == out.end())
+				out.push_back(z);
+	}
+	sort(out.begin(), out.end());
+	return true;
+}
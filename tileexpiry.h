@@ -0,0 +1,44 @@
+#ifndef _TILE_EXPIRY_H
+#define _TILE_EXPIRY_H
+
+#include <string>
+#include <vector>
+#include <set>
+#include <tuple>
+#include <functional>
+#include <cstdint>
+
+//Collects the z/x/y slippy map tiles covered by the envelopes of changed objects, at each 
+//of the given zooms. Each tile is recorded once. Envelopes that cover more than 
+//maxTilesPerBbox tiles at a zoom are not expired at that zoom, so a continent sized 
+//relation does not produce millions of entries.
+class TileExpiry
+{
+private:
+	std::vector<int> zooms;
+	int64_t maxTilesPerBbox;
+	std::set<std::tuple<int, int, int> > tiles;
+
+public:
+	TileExpiry(const std::vector<int> &zooms, int64_t maxTilesPerBbox = 65536);
+	virtual ~TileExpiry();
+
+	//Called the first time each tile is expired
+	std::function<void(int zoom, int x, int y)> callback;
+
+	//Envelope is lon1, lat1, lon2, lat2. A point has equal min and max.
+	void ExpireBbox(const std::vector<double> &bbox);
+	void ExpirePoint(double lon, double lat);
+
+	size_t Count() {return tiles.size();};
+	const std::set<std::tuple<int, int, int> > &GetTiles() {return tiles;};
+	void Clear();
+
+	//Writes one z/x/y line per tile
+	bool WriteFile(const std::string &fina, bool append, std::string &errStr);
+};
+
+//Parses a list of zooms such as "12,14-16"
+bool ParseZoomList(const std::string &zoomsStr, std::vector<int> &out, std::string &errStr);
+
+#endif //_TILE_EXPIRY_H
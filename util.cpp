@@ -209,3 +209,23 @@ void FindOuterBbox(const std::vector<std::vector<double> > &bboxesIn, std::vecto
 	}	
 }
 
+void StreamObjectsTo(const class OsmData &data, class IDataStreamHandler &out)
+{
+	for(size_t i=0; i<data.nodes.size(); i++)
+	{
+		const class OsmNode &node = data.nodes[i];
+		out.StoreNode(node.objId, node.metaData, node.tags, node.lat, node.lon);
+	}
+	for(size_t i=0; i<data.ways.size(); i++)
+	{
+		const class OsmWay &way = data.ways[i];
+		out.StoreWay(way.objId, way.metaData, way.tags, way.refs);
+	}
+	for(size_t i=0; i<data.relations.size(); i++)
+	{
+		const class OsmRelation &relation = data.relations[i];
+		out.StoreRelation(relation.objId, relation.metaData, relation.tags, 
+			relation.refTypeStrs, relation.refIds, relation.refRoles);
+	}
+}
+
@@ -254,5 +254,8 @@ double tiley2lat(int y, int z);
 
 void FindOuterBbox(const std::vector<std::vector<double> > &bboxesIn, std::vector<double> &bboxOut);
 
+//Passes the objects to out, without the header, reset or finish calls made by OsmData::StreamTo
+void StreamObjectsTo(const class OsmData &data, class IDataStreamHandler &out);
+
 #endif //_UTIL_H
 